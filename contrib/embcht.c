@@ -0,0 +1,307 @@
+#include "embcht.h"
+#include <sched.h>
+
+#ifdef EMBHT_NO_VALUES
+#error "embcht requires values"
+#endif
+
+#define EMBCHT_VSIZE sizeof(((embht_entry*)0)->u_value)
+
+struct embcht_retired {
+    struct embcht_retired *next;
+    embht_entry *array;
+};
+
+static int
+embcht_cmp_key(const void *ukey, unsigned int uklen, const embht_key *ekey)
+{
+    if (uklen != ekey->klen) {
+        return 1;
+    }
+
+    if (uklen == EMBHT_KLEN_INT) {
+        return !((uint32_t)(uintptr_t)ukey == ekey->u_kdata.kd32);
+    }
+    return memcmp(ukey, ekey->u_kdata.kds, uklen);
+}
+
+static embcht_bucket *
+embcht_bucket_for(const embcht_table *ht, uint32_t hash)
+{
+    return ht->buckets + (hash % ht->nbuckets);
+}
+
+static void
+embcht_lock(embcht_bucket *bh)
+{
+    unsigned int nspins = 0;
+
+    while (1) {
+        uint32_t seq = __atomic_load_n(&bh->seq, __ATOMIC_RELAXED);
+        if (!(seq & 1) &&
+                __atomic_compare_exchange_n(&bh->seq, &seq, seq + 1, 0,
+                                            __ATOMIC_ACQUIRE,
+                                            __ATOMIC_RELAXED)) {
+            break;
+        }
+        if (++nspins % 64 == 0) {
+            sched_yield();
+        }
+    }
+
+    /* Readers which see any of our stores must also see the odd count */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void
+embcht_unlock(embcht_bucket *bh)
+{
+    __atomic_store_n(&bh->seq, __atomic_load_n(&bh->seq, __ATOMIC_RELAXED) + 1,
+                     __ATOMIC_RELEASE);
+}
+
+/**
+ * Search a locked bucket. Returns the matching entry, and sets *empty to
+ * the first free slot (or NULL).
+ */
+static embht_entry *
+embcht_search(embcht_bucket *bh, const void *key, unsigned int nkey,
+              uint32_t hash, embht_entry **empty)
+{
+    unsigned int ii;
+
+    if (empty) {
+        *empty = NULL;
+    }
+
+    for (ii = 0; ii < bh->capacity; ii++) {
+        embht_entry *cur = bh->array + ii;
+
+        if (cur->key.klen == 0) {
+            if (empty && !*empty) {
+                *empty = cur;
+            }
+            continue;
+        }
+
+        if (cur->key.hash == hash &&
+                embcht_cmp_key(key, nkey, &cur->key) == 0) {
+            return cur;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Grow a locked bucket. The old array stays readable until reclaimed.
+ */
+static embht_entry *
+embcht_grow(embcht_table *ht, embcht_bucket *bh)
+{
+    unsigned int capacity =
+            bh->capacity ? bh->capacity * 2 : EMBHT_INITIAL_FILL_SIZE;
+    embht_entry *array = calloc(capacity, sizeof(*array));
+    embht_entry *old = bh->array;
+
+    if (old) {
+        struct embcht_retired *rt = malloc(sizeof(*rt));
+
+        memcpy(array, old, bh->capacity * sizeof(*array));
+
+        rt->array = old;
+        rt->next = __atomic_load_n(&ht->retired, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&ht->retired, &rt->next, rt, 0,
+                                            __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED));
+    }
+
+    /**
+     * A reader which sees the new capacity also sees the new array. One
+     * which sees the old capacity is safe with either array.
+     */
+    __atomic_store_n(&bh->array, array, __ATOMIC_RELEASE);
+    array += bh->capacity;
+    __atomic_store_n(&bh->capacity, capacity, __ATOMIC_RELEASE);
+    return array;
+}
+
+EMBCHT_API
+embcht_table *
+embcht_make(size_t size)
+{
+    embcht_table *ret = calloc(1, sizeof(*ret));
+    ret->buckets = calloc(size, sizeof(*ret->buckets));
+    ret->nbuckets = size;
+    return ret;
+}
+
+EMBCHT_API
+void
+embcht_destroy(embcht_table *ht)
+{
+    size_t ii;
+
+    embcht_reclaim(ht);
+    for (ii = 0; ii < ht->nbuckets; ii++) {
+        free(ht->buckets[ii].array);
+    }
+    free(ht->buckets);
+    free(ht);
+}
+
+EMBCHT_API
+int
+embcht_lookup(embcht_table *ht, const void *key, unsigned int nkey,
+              void *value)
+{
+    uint32_t hash = embht_hash_key(key, nkey, EMBHT_IHASH_DEFAULT);
+    embcht_bucket *bh = embcht_bucket_for(ht, hash);
+    /* Only read once found, but the compiler can't tell */
+    char tmp[EMBCHT_VSIZE] = { 0 };
+
+    while (1) {
+        uint32_t seq = __atomic_load_n(&bh->seq, __ATOMIC_ACQUIRE);
+        unsigned int capacity, ii;
+        embht_entry *array;
+        int found = 0;
+
+        if (seq & 1) {
+            continue;
+        }
+
+        capacity = __atomic_load_n(&bh->capacity, __ATOMIC_ACQUIRE);
+        array = __atomic_load_n(&bh->array, __ATOMIC_ACQUIRE);
+
+        /**
+         * The entries may change underneath us, in which case whatever was
+         * read is discarded once the sequence check fails.
+         */
+        for (ii = 0; ii < capacity; ii++) {
+            embht_entry *cur = array + ii;
+            if (cur->key.klen && cur->key.hash == hash &&
+                    embcht_cmp_key(key, nkey, &cur->key) == 0) {
+                memcpy(tmp, &cur->u_value, sizeof(tmp));
+                found = 1;
+                break;
+            }
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&bh->seq, __ATOMIC_RELAXED) != seq) {
+            continue;
+        }
+
+        if (found && value) {
+            memcpy(value, tmp, sizeof(tmp));
+        }
+        return found;
+    }
+}
+
+EMBCHT_API
+int
+embcht_store(embcht_table *ht, const void *key, unsigned int nkey,
+             const void *value)
+{
+    uint32_t hash = embht_hash_key(key, nkey, EMBHT_IHASH_DEFAULT);
+    embcht_bucket *bh = embcht_bucket_for(ht, hash);
+    embht_entry *cur, *empty;
+
+    if (nkey != EMBHT_KLEN_INT && (nkey == 0 || nkey > EMBHT_KEY_SIZE)) {
+        return -1;
+    }
+
+    embcht_lock(bh);
+
+    if ( (cur = embcht_search(bh, key, nkey, hash, &empty)) ) {
+        goto GT_SETVAL;
+    }
+
+    if ( (cur = empty) == NULL) {
+        cur = embcht_grow(ht, bh);
+    }
+
+    bh->fill++;
+    __atomic_add_fetch(&ht->nitems, 1, __ATOMIC_RELAXED);
+
+    cur->key.hash = hash;
+    if (nkey == EMBHT_KLEN_INT) {
+        cur->key.u_kdata.kd32 = (uint32_t)(uintptr_t)key;
+    } else {
+        memcpy(cur->key.u_kdata.kds, key, nkey);
+    }
+    cur->key.klen = nkey;
+
+    GT_SETVAL:
+    memcpy(&cur->u_value, value, EMBCHT_VSIZE);
+    embcht_unlock(bh);
+    return 0;
+}
+
+EMBCHT_API
+int
+embcht_delete(embcht_table *ht, const void *key, unsigned int nkey,
+              void *value)
+{
+    uint32_t hash = embht_hash_key(key, nkey, EMBHT_IHASH_DEFAULT);
+    embcht_bucket *bh = embcht_bucket_for(ht, hash);
+    embht_entry *cur;
+
+    embcht_lock(bh);
+
+    if ( (cur = embcht_search(bh, key, nkey, hash, NULL)) == NULL) {
+        embcht_unlock(bh);
+        return 0;
+    }
+
+    if (value) {
+        memcpy(value, &cur->u_value, EMBCHT_VSIZE);
+    }
+    memset(cur, 0, sizeof(*cur));
+    bh->fill--;
+    __atomic_sub_fetch(&ht->nitems, 1, __ATOMIC_RELAXED);
+
+    embcht_unlock(bh);
+    return 1;
+}
+
+EMBCHT_API
+void
+embcht_foreach(embcht_table *ht,
+               void (*callback)(const embht_entry *ent, void *arg),
+               void *arg)
+{
+    size_t ii;
+
+    for (ii = 0; ii < ht->nbuckets; ii++) {
+        embcht_bucket *bh = ht->buckets + ii;
+        unsigned int jj;
+
+        if (!__atomic_load_n(&bh->fill, __ATOMIC_RELAXED)) {
+            continue;
+        }
+
+        embcht_lock(bh);
+        for (jj = 0; jj < bh->capacity; jj++) {
+            if (bh->array[jj].key.klen) {
+                callback(bh->array + jj, arg);
+            }
+        }
+        embcht_unlock(bh);
+    }
+}
+
+EMBCHT_API
+void
+embcht_reclaim(embcht_table *ht)
+{
+    struct embcht_retired *rt =
+            __atomic_exchange_n(&ht->retired, NULL, __ATOMIC_ACQUIRE);
+
+    while (rt) {
+        struct embcht_retired *next = rt->next;
+        free(rt->array);
+        free(rt);
+        rt = next;
+    }
+}
@@ -0,0 +1,116 @@
+#ifndef EMBCHT_H_
+#define EMBCHT_H_
+
+/**
+ * Concurrent variant of embht.
+ *
+ * Each bucket has a sequence counter which doubles as its writer lock: a
+ * writer makes it odd while modifying the bucket, and even again when done.
+ * Readers never take a lock. They read the counter, search the bucket, copy
+ * out the value, and retry if the counter changed in the meantime. Writers
+ * only contend with other writers hashing to the same bucket.
+ *
+ * Because readers may still be looking at a bucket array which a writer
+ * has just outgrown, the old arrays are not freed immediately. They are
+ * kept until embcht_reclaim() is called at a point where no lookups are in
+ * progress (or until the table is destroyed).
+ *
+ * Keys are integers (hashed with EMBHT_IHASH_DEFAULT) or inline strings of
+ * up to EMBHT_KEY_SIZE bytes; key pointers (EMBHT_F_KPTR) are not
+ * supported, nor is resizing. Values are copied in and out, as a pointer
+ * into the table could be invalidated by a concurrent writer at any time.
+ */
+
+#include "embhash.h"
+
+#ifndef EMBCHT_API
+#define EMBCHT_API
+#endif
+
+typedef struct {
+    /** odd while a writer holds the bucket */
+    uint32_t seq;
+    unsigned int fill;
+    unsigned int capacity;
+    embht_entry *array;
+} embcht_bucket;
+
+struct embcht_retired;
+
+typedef struct {
+    embcht_bucket *buckets;
+    size_t nbuckets;
+    size_t nitems;
+    /** outgrown bucket arrays, waiting for embcht_reclaim */
+    struct embcht_retired *retired;
+} embcht_table;
+
+EMBCHT_API
+embcht_table *
+embcht_make(size_t size);
+
+/**
+ * Must not be called while other threads use the table
+ */
+EMBCHT_API
+void
+embcht_destroy(embcht_table *ht);
+
+/**
+ * Look up a key without locking. If found, the value is copied to 'value'
+ * (which may be NULL) and 1 is returned. Returns 0 if the key doesn't exist.
+ */
+EMBCHT_API
+int
+embcht_lookup(embcht_table *ht, const void *key, unsigned int nkey,
+              void *value);
+
+/**
+ * Insert a key, or replace its value if it exists. Returns -1 if the key
+ * is too long.
+ */
+EMBCHT_API
+int
+embcht_store(embcht_table *ht, const void *key, unsigned int nkey,
+             const void *value);
+
+/**
+ * Remove a key. If it existed, its value is copied to 'value' (which may be
+ * NULL) and 1 is returned.
+ */
+EMBCHT_API
+int
+embcht_delete(embcht_table *ht, const void *key, unsigned int nkey,
+              void *value);
+
+/**
+ * Call 'callback' for each entry. Each bucket is locked against writers
+ * while it is being visited (readers are not affected), so the callback
+ * must not modify the table.
+ */
+EMBCHT_API
+void
+embcht_foreach(embcht_table *ht,
+               void (*callback)(const embht_entry *ent, void *arg),
+               void *arg);
+
+/**
+ * Free bucket arrays which writers have replaced. The caller must ensure
+ * no embcht_lookup calls are in progress.
+ */
+EMBCHT_API
+void
+embcht_reclaim(embcht_table *ht);
+
+#define embcht_lookupi(ht, ikey, value) \
+    embcht_lookup(ht, (void*)(uintptr_t)(ikey), EMBHT_KLEN_INT, value)
+
+#define embcht_storei(ht, ikey, value) \
+    embcht_store(ht, (void*)(uintptr_t)(ikey), EMBHT_KLEN_INT, value)
+
+#define embcht_deletei(ht, ikey, value) \
+    embcht_delete(ht, (void*)(uintptr_t)(ikey), EMBHT_KLEN_INT, value)
+
+#define embcht_count(ht) __atomic_load_n(&(ht)->nitems, __ATOMIC_RELAXED)
+
+#endif /* EMBCHT_H_ */
@@ -15,12 +15,56 @@
 #define EMBHT_KEY_SIZE 24
 #endif
 
+/**
+ * For tables created with EMBHT_F_RESIZE; the average amount of entries per
+ * bucket at which the table doubles, and the amount of buckets moved to the
+ * new array on each insertion while resizing.
+ */
+#ifndef EMBHT_MAX_LOAD
+#define EMBHT_MAX_LOAD 2
+#endif
+
+#ifndef EMBHT_REHASH_STEP
+#define EMBHT_REHASH_STEP 4
+#endif
+
+/**
+ * Resizable tables halve once the average amount of entries per bucket
+ * drops below 1/EMBHT_MIN_LOAD_DIV, but never below their initial size.
+ * Bucket arrays are compacted once no more than 1/EMBHT_MIN_LOAD_DIV of
+ * their slots are used.
+ */
+#ifndef EMBHT_MIN_LOAD_DIV
+#define EMBHT_MIN_LOAD_DIV 4
+#endif
+
 #ifndef EMBHT_VALUE_SIZE
 #warning "No value size defined (using defaults)"
 #define EMBHT_VALUE_SIZE 24
 #endif
 
 
+/**
+ * Finalizers for integer keys. Integer keys such as PIDs and descriptors
+ * tend to be clustered, which the identity hash maps straight onto
+ * neighbouring buckets. Tables use the default unless created with
+ * EMBHT_F_HASH_MUL or EMBHT_F_HASH_MURMUR.
+ */
+enum {
+    EMBHT_IHASH_IDENTITY = 0,
+    /** Fibonacci hashing; multiply by 2^64/phi, keep the top bits */
+    EMBHT_IHASH_MUL,
+    /** MurmurHash3's fmix32 */
+    EMBHT_IHASH_MURMUR
+};
+
+#ifndef EMBHT_IHASH_DEFAULT
+#define EMBHT_IHASH_DEFAULT EMBHT_IHASH_IDENTITY
+#endif
+
+/** Size of the histograms in embht_statistics */
+#define EMBHT_HIST_SIZE 16
+
 #define EMBHT_KLEN_MAX 65535
 #define EMBHT_KLEN_INT (EMBHT_KLEN_MAX +1)
 #define EMBHT_KLEN_AUTO (EMBHT_KLEN_MAX + 2)
@@ -35,14 +79,17 @@
 
 typedef enum {
 #define EMBHT_XFLAGS(X) \
-    X(KPTR, use_key_pointers, 0x1)
+    X(KPTR, use_key_pointers, 0x1) \
+    X(RESIZE, auto_resize, 0x2) \
+    X(HASH_MUL, hash_mul, 0x4) \
+    X(HASH_MURMUR, hash_murmur, 0x8)
 
 #define X(c, fld, v) \
     EMBHT_F_##c = v,
     EMBHT_XFLAGS(X)
 #undef X
 
-    EMBHT_F_INVAL = 0x2
+    EMBHT_F_INVAL = 0x10
 } embht_flags_t;
 
 /**
@@ -79,9 +126,26 @@ typedef struct {
     embht_bucket *buckets;
     size_t nbuckets;
 
+    /**
+     * While resizing, the previous bucket array. Buckets below rehash_idx
+     * have already been moved to the new array.
+     */
+    embht_bucket *old_buckets;
+    size_t old_nbuckets;
+    size_t rehash_idx;
+
+    size_t nitems;
+    size_t min_nbuckets;
+
+    /** copy of the last deleted entry, see embht_delete */
+    embht_entry deleted;
+
     /** size of each value (inclusive of the hashbucket size itself) */
     unsigned int elemsize;
     int use_key_pointers;
+    int auto_resize;
+    int hash_mul;
+    int hash_murmur;
 
 } embht_table;
 
@@ -99,8 +163,66 @@ typedef struct {
 typedef struct {
     unsigned int full_buckets;
     unsigned int item_count;
+    /** buckets holding N entries; the last slot counts any more than that */
+    unsigned int occupancy[EMBHT_HIST_SIZE];
+    /** entries which are found after comparing against N+1 entries */
+    unsigned int probes[EMBHT_HIST_SIZE];
 } embht_statistics;
 
+/**
+ * Key hashing, shared with the concurrent variant (embcht)
+ */
+static inline uint32_t
+embht_strnhash(const char *s, unsigned int len)
+{
+    uint32_t hash;
+    unsigned int i;
+    for(hash = i = 0; i < len; ++i)
+    {
+        hash += s[i];
+        hash += (hash << 10);
+        hash ^= (hash >> 6);
+    }
+    hash += (hash << 3);
+    hash ^= (hash >> 11);
+    hash += (hash << 15);
+    return hash;
+
+    /**
+    uint32_t hash = 5381;
+    int ii;
+    for (ii = 0; ii < len; ii++) {
+        hash = ((hash<<5) + hash) + s[ii];
+    }
+    return hash;
+    */
+}
+
+static inline uint32_t
+embht_hash_int(uint32_t key, int mode)
+{
+    if (mode == EMBHT_IHASH_MUL) {
+        return (uint32_t)((key * 0x9e3779b97f4a7c15ULL) >> 32);
+    } else if (mode == EMBHT_IHASH_MURMUR) {
+        key ^= key >> 16;
+        key *= 0x85ebca6b;
+        key ^= key >> 13;
+        key *= 0xc2b2ae35;
+        key ^= key >> 16;
+    }
+    return key;
+}
+
+static inline uint32_t
+embht_hash_key(const void *k, unsigned int klen, int mode) {
+    if (klen == EMBHT_KLEN_INT) {
+        return embht_hash_int((uint32_t)(uintptr_t)k, mode);
+    } else {
+        return embht_strnhash((const char*)k, klen);
+    }
+    return 0;
+}
+
 #define HBIDX(ht, a, ix) \
     ((embht_entry*)(a+( (ix) )))
 
@@ -112,9 +234,14 @@ EMBHT_API
 embht_table*
 embht_make(size_t size, embht_flags_t flags);
 
+/**
+ * Look up a key, creating it if lval is true. Creating a key may move other
+ * entries around, so pointers to entries and iterators are only valid until
+ * the next insertion.
+ */
 EMBHT_API
 embht_entry *
-embht_fetch(const embht_table *ht,
+embht_fetch(embht_table *ht,
             void *key,
             unsigned int nkey,
             int lval);
@@ -128,12 +255,16 @@ embht_fetch(const embht_table *ht,
 #define embht_fetchi(ht, ikey, lval) \
     embht_fetch(ht, (void*)(uintptr_t)(ikey), EMBHT_KLEN_INT, lval)
 
+/**
+ * Delete a key. Returns a pointer to a copy of its value (or NULL if it
+ * didn't exist), which is valid until the next deletion.
+ */
 EMBHT_API
 void *
 embht_delete(embht_table *ht, void *key, unsigned int nkey);
 
 #define embht_deletei(ht, ikey) \
-    embht_delete(ht, (void*)(uintptr_t)ikey, EMBHT_KLEN_INT)
+    embht_delete(ht, (void*)(uintptr_t)(ikey), EMBHT_KLEN_INT)
 
 EMBHT_API
 void
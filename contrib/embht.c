@@ -1,41 +1,5 @@
 #include "embhash.h"
 
-static uint32_t
-embht_strnhash(const char *s, unsigned int len)
-{
-    uint32_t hash;
-    unsigned int i;
-    for(hash = i = 0; i < len; ++i)
-    {
-        hash += s[i];
-        hash += (hash << 10);
-        hash ^= (hash >> 6);
-    }
-    hash += (hash << 3);
-    hash ^= (hash >> 11);
-    hash += (hash << 15);
-    return hash;
-
-    /**
-    uint32_t hash = 5381;
-    int ii;
-    for (ii = 0; ii < len; ii++) {
-        hash = ((hash<<5) + hash) + s[ii];
-    }
-    return hash;
-    */
-}
-
-static uint32_t
-embht_hash_key(const void *k, unsigned int klen) {
-    if (klen == EMBHT_KLEN_INT) {
-        return (uint32_t)(uintptr_t)k;
-    } else {
-        return embht_strnhash((const char*)k, klen);
-    }
-    return 0;
-}
-
 static int
 embht_cmp_key(const embht_table *ht,
               const void *ukey,
@@ -56,9 +20,10 @@ EMBHT_API
 embht_table*
 embht_make(size_t size, embht_flags_t flags)
 {
-    embht_table *ret = malloc(sizeof(*ret));
+    embht_table *ret = calloc(1, sizeof(*ret));
     ret->buckets = calloc(1, sizeof(embht_bucket) * size);
     ret->nbuckets = size;
+    ret->min_nbuckets = size;
 #define X(c, fld, v) \
     if (flags & EMBHT_F_##c) { ret->fld = 1; }
     EMBHT_XFLAGS(X)
@@ -67,6 +32,179 @@ embht_make(size_t size, embht_flags_t flags)
     return ret;
 }
 
+static uint32_t
+embht_table_hash(const embht_table *ht, const void *key, unsigned int nkey)
+{
+    int mode = EMBHT_IHASH_DEFAULT;
+    if (ht->hash_murmur) {
+        mode = EMBHT_IHASH_MURMUR;
+    } else if (ht->hash_mul) {
+        mode = EMBHT_IHASH_MUL;
+    }
+    return embht_hash_key(key, nkey, mode);
+}
+
+/**
+ * Returns the bucket which holds (or would hold) the given hash. During a
+ * resize, this is in the old array unless that bucket was already moved.
+ */
+static embht_bucket *
+embht_bucket_for(const embht_table *ht, uint32_t hash)
+{
+    if (ht->old_buckets) {
+        size_t idx = hash % ht->old_nbuckets;
+        if (idx >= ht->rehash_idx) {
+            return ht->old_buckets + idx;
+        }
+    }
+    return ht->buckets + (hash % ht->nbuckets);
+}
+
+/**
+ * Get an empty slot in the bucket, starting the search at 'pos'. The
+ * bucket array is grown if it is full.
+ */
+static embht_entry *
+embht_bucket_alloc(embht_bucket *bh, unsigned int pos)
+{
+    embht_entry *cur;
+
+    if (!bh->capacity) {
+        bh->array = calloc(EMBHT_INITIAL_FILL_SIZE,
+                           sizeof(*(bh->array)));
+        bh->capacity = EMBHT_INITIAL_FILL_SIZE;
+    }
+
+    if (bh->fill < bh->capacity) {
+        for (; pos < bh->capacity; pos++) {
+            if (bh->array[pos].key.klen == 0) {
+                cur = bh->array + pos;
+                goto GT_RET;
+            }
+        }
+        for (pos = 0; pos < bh->capacity; pos++) {
+            if (bh->array[pos].key.klen == 0) {
+                cur = bh->array + pos;
+                goto GT_RET;
+            }
+        }
+    }
+
+    {
+        size_t offset, oldsize = bh->capacity;
+        assert (bh->capacity == bh->fill);
+        for (offset = 0; (1<<offset) <= bh->capacity; offset++);
+
+        bh->capacity = 1<<offset;
+
+#define _REINIT(fld) \
+    bh->fld = realloc(bh->fld, bh->capacity * (sizeof(*(bh->fld)))); \
+    memset(bh->fld + oldsize, 0, (bh->capacity - oldsize) * sizeof(*(bh->fld)));
+
+        _REINIT(array);
+#undef _REINIT
+
+        cur = bh->array + oldsize;
+    }
+
+    GT_RET:
+    bh->fill++;
+    assert(bh->fill <= bh->capacity);
+    return cur;
+}
+
+/**
+ * Move a few buckets from the old array into the new one.
+ */
+static void
+embht_rehash_step(embht_table *ht, unsigned int nsteps)
+{
+    while (nsteps-- && ht->old_buckets) {
+        embht_bucket *src = ht->old_buckets + ht->rehash_idx++;
+        unsigned int ii;
+
+        for (ii = 0; ii < src->capacity && src->fill; ii++) {
+            embht_entry *ent = src->array + ii, *dst;
+            if (ent->key.klen == 0) {
+                continue;
+            }
+
+            dst = embht_bucket_alloc(
+                    ht->buckets + (ent->key.hash % ht->nbuckets), 0);
+            *dst = *ent;
+            src->fill--;
+        }
+
+        free(src->array);
+        src->array = NULL;
+        src->capacity = 0;
+
+        if (ht->rehash_idx == ht->old_nbuckets) {
+            free(ht->old_buckets);
+            ht->old_buckets = NULL;
+            ht->old_nbuckets = 0;
+            ht->rehash_idx = 0;
+        }
+    }
+}
+
+/**
+ * Change the amount of buckets. Entries are moved over gradually by
+ * subsequent insertions and deletions rather than all at once.
+ */
+static void
+embht_resize(embht_table *ht, size_t nbuckets)
+{
+    while (ht->old_buckets) {
+        embht_rehash_step(ht, EMBHT_REHASH_STEP);
+    }
+
+    ht->old_buckets = ht->buckets;
+    ht->old_nbuckets = ht->nbuckets;
+    ht->rehash_idx = 0;
+
+    ht->nbuckets = nbuckets;
+    ht->buckets = calloc(ht->nbuckets, sizeof(embht_bucket));
+}
+
+/**
+ * Pack the live entries of a mostly empty bucket into a smaller array.
+ */
+static void
+embht_bucket_compact(embht_bucket *bh)
+{
+    unsigned int capacity = bh->capacity, ii, jj;
+    embht_entry *array;
+
+    if (capacity <= EMBHT_INITIAL_FILL_SIZE ||
+            bh->fill * EMBHT_MIN_LOAD_DIV > capacity) {
+        return;
+    }
+
+    if (!bh->fill) {
+        free(bh->array);
+        bh->array = NULL;
+        bh->capacity = 0;
+        return;
+    }
+
+    while (capacity / 2 >= bh->fill * 2 &&
+            capacity / 2 >= EMBHT_INITIAL_FILL_SIZE) {
+        capacity /= 2;
+    }
+
+    array = calloc(capacity, sizeof(*array));
+    for (ii = jj = 0; ii < bh->capacity; ii++) {
+        if (bh->array[ii].key.klen) {
+            array[jj++] = bh->array[ii];
+        }
+    }
+
+    free(bh->array);
+    bh->array = array;
+    bh->capacity = capacity;
+}
+
 struct embht_search_ctx {
     int first_empty;
     unsigned int pos;
@@ -84,8 +222,8 @@ embht_fetchonly(const embht_table *ht,
     embht_entry *cur;
     unsigned int ii, nchecked = 0, check_max;
 
-    uint32_t hash = embht_hash_key(key, nkey);
-    embht_bucket *bh = ht->buckets + (hash % ht->nbuckets );
+    uint32_t hash = embht_table_hash(ht, key, nkey);
+    embht_bucket *bh = embht_bucket_for(ht, hash);
 
     if (search) {
         search->bh = bh;
@@ -125,66 +263,39 @@ embht_fetchonly(const embht_table *ht,
 
 static
 embht_entry *
-embht_fetchstore(const embht_table *ht,
+embht_fetchstore(embht_table *ht,
                  void *key,
                  unsigned int nkey)
 {
     embht_entry *cur;
-    embht_bucket *bh;
 
     struct embht_search_ctx ctx = { 0 };
     ctx.first_empty = -1;
 
+    if (ht->old_buckets) {
+        embht_rehash_step(ht, EMBHT_REHASH_STEP);
+    }
+
     if ( (cur = embht_fetchonly(ht, key, nkey, &ctx)) ) {
         return cur;
     }
 
-    bh = ctx.bh;
-
-    if (!bh->fill) {
-        if (!bh->capacity) {
-            bh->array = calloc(EMBHT_INITIAL_FILL_SIZE,
-                               sizeof(*(bh->array)));
-            bh->capacity = EMBHT_INITIAL_FILL_SIZE;
-        }
-        cur = bh->array;
-        goto GT_INIT_CUR;
+    if (ht->auto_resize &&
+            ht->nitems >= ht->nbuckets * EMBHT_MAX_LOAD) {
+        embht_resize(ht, ht->nbuckets * 2);
+        ctx.bh = embht_bucket_for(ht, ctx.hash);
+        ctx.first_empty = -1;
+        ctx.pos = 0;
     }
 
     if (ctx.first_empty >= 0) {
-        cur = bh->array + ctx.first_empty;
-        goto GT_INIT_CUR;
-    }
-
-    for (; ctx.pos < bh->capacity; ctx.pos++) {
-
-        if (bh->array[ctx.pos].key.klen == 0) {
-            cur = bh->array + ctx.pos;
-            goto GT_INIT_CUR;
-        }
-    }
-
-
-    {
-        size_t offset, oldsize = bh->capacity;
-        assert (bh->capacity == bh->fill);
-        for (offset = 0; (1<<offset) <= bh->capacity; offset++);
-
-        bh->capacity = 1<<offset;
-
-#define _REINIT(fld) \
-    bh->fld = realloc(bh->fld, bh->capacity * (sizeof(*(bh->fld)))); \
-    memset(bh->fld + oldsize, 0, (bh->capacity - oldsize) * sizeof(*(bh->fld)));
-
-        _REINIT(array);
-#undef _REINIT
-
-        cur = bh->array + oldsize;
+        cur = ctx.bh->array + ctx.first_empty;
+        ctx.bh->fill++;
+    } else {
+        cur = embht_bucket_alloc(ctx.bh, ctx.pos);
     }
 
-    GT_INIT_CUR:
-    bh->fill++;
-    assert(bh->fill <= bh->capacity);
+    ht->nitems++;
     cur->key.klen = nkey;
     cur->key.hash = ctx.hash;
     if (nkey == EMBHT_KLEN_INT) {
@@ -198,7 +309,7 @@ embht_fetchstore(const embht_table *ht,
 
 EMBHT_API
 embht_entry *
-embht_fetch(const embht_table *ht,
+embht_fetch(embht_table *ht,
             void *key,
             unsigned int nkey,
             int lval)
@@ -215,15 +326,30 @@ void *
 embht_delete(embht_table *ht, void *key, unsigned int nkey)
 {
     struct embht_search_ctx ctx = { 0 };
-    embht_entry *ent = embht_fetchonly(ht, key, nkey, &ctx);
+    embht_entry *ent;
+
+    if (ht->old_buckets) {
+        embht_rehash_step(ht, EMBHT_REHASH_STEP);
+    }
 
-    if (!ent) {
+    if ( (ent = embht_fetchonly(ht, key, nkey, &ctx)) == NULL) {
         return NULL;
     }
 
+    ht->deleted = *ent;
     ctx.bh->fill--;
+    ht->nitems--;
     ent->key.klen = 0;
-    return &ent->u_value;
+
+    embht_bucket_compact(ctx.bh);
+
+    if (ht->auto_resize && !ht->old_buckets &&
+            ht->nbuckets / 2 >= ht->min_nbuckets &&
+            ht->nitems * EMBHT_MIN_LOAD_DIV < ht->nbuckets) {
+        embht_resize(ht, ht->nbuckets / 2);
+    }
+
+    return &ht->deleted.u_value;
 }
 
 EMBHT_API
@@ -237,10 +363,30 @@ embht_destroy(embht_table *ht)
             free(bh->array);
         }
     }
+    for (ii = 0; ii < ht->old_nbuckets; ii++) {
+        embht_bucket *bh = ht->old_buckets + ii;
+        if (bh->array) {
+            free(bh->array);
+        }
+    }
+    free(ht->old_buckets);
     free(ht->buckets);
     free(ht);
 }
 
+/**
+ * While resizing, iteration covers the old buckets first and then the new
+ * ones. Already moved buckets in the old array are empty.
+ */
+static embht_bucket *
+embht_iter_bucket(const embht_table *ht, size_t bidx)
+{
+    if (bidx < ht->old_nbuckets) {
+        return ht->old_buckets + bidx;
+    }
+    return ht->buckets + (bidx - ht->old_nbuckets);
+}
+
 EMBHT_API
 void
 embht_iterinit(embht_table *ht, embht_iterator *iter)
@@ -252,7 +398,7 @@ embht_iterinit(embht_table *ht, embht_iterator *iter)
         iter->done = 1;
     } else {
         iter->done = 0;
-        iter->bh = ht->buckets;
+        iter->bh = embht_iter_bucket(ht, 0);
         iter->b_remaining = iter->bh->fill;
         iter->b_traversed = 0;
     }
@@ -289,14 +435,15 @@ embht_iternext(embht_iterator *iter)
 
         iter->bidx++;
         iter->aidx = -1;
-        iter->bh = iter->ht->buckets + iter->bidx;
 
-        if (iter->bidx >= iter->ht->nbuckets) {
+        if (iter->bidx >= iter->ht->nbuckets + iter->ht->old_nbuckets) {
             /* last bucket */
             iter->done = 1;
             return 0;
         }
 
+        iter->bh = embht_iter_bucket(iter->ht, iter->bidx);
+
         if ( (iter->b_remaining = iter->bh->fill) == 0) {
             /* empty bucket */
             iter->b_traversed = 1;
@@ -325,6 +472,7 @@ embht_iterdel(embht_iterator *iter)
     memset(&ent->u_value, 0, sizeof(ent->u_value));
 
     iter->bh->fill--;
+    iter->ht->nitems--;
 }
 
 EMBHT_API
@@ -332,14 +480,34 @@ void
 embht_stat(embht_table *ht, embht_statistics *stats)
 {
     int ii;
-    stats->full_buckets = 0;
-    stats->item_count = 0;
+    memset(stats, 0, sizeof(*stats));
 
-    for (ii = 0; ii < ht->nbuckets; ii++) {
-        embht_bucket *hb = ht->buckets + ii;
-        if (hb->fill) {
-            stats->item_count += hb->fill;
-            stats->full_buckets++;
+    for (ii = 0; ii < ht->nbuckets + ht->old_nbuckets; ii++) {
+        embht_bucket *hb = embht_iter_bucket(ht, ii);
+        unsigned int jj, nseen = 0;
+
+        /* Buckets already moved out of the old array don't count */
+        if (ii < ht->old_nbuckets && ii < ht->rehash_idx) {
+            continue;
+        }
+
+        stats->occupancy[hb->fill < EMBHT_HIST_SIZE
+                         ? hb->fill : EMBHT_HIST_SIZE - 1]++;
+
+        if (!hb->fill) {
+            continue;
+        }
+
+        stats->item_count += hb->fill;
+        stats->full_buckets++;
+
+        /* A lookup compares against each live entry up to its own */
+        for (jj = 0; jj < hb->capacity && nseen < hb->fill; jj++) {
+            if (hb->array[jj].key.klen) {
+                stats->probes[nseen < EMBHT_HIST_SIZE
+                              ? nseen : EMBHT_HIST_SIZE - 1]++;
+                nseen++;
+            }
         }
     }
 }
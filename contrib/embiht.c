@@ -0,0 +1,463 @@
+#include "embiht.h"
+
+/**
+ * Memory for the table is obtained through these, so an application can
+ * plug in its own allocator. The size is passed to the free function too.
+ */
+#ifndef EMBIHT_MALLOC
+#define EMBIHT_MALLOC(size) malloc(size)
+#define EMBIHT_FREE(ptr, size) free(ptr)
+#endif
+
+#define EMBIHT_NPOS ((size_t)-1)
+#define EMBIHT_H2(hash) ((uint8_t)((hash) & 0x7f))
+#define EMBIHT_H1(hash) ((size_t)((hash) >> 7))
+
+#define embiht_isfull(c) (((c) & 0x80) == 0)
+#define embiht_nctrl(nslots) ((nslots) + EMBIHT_GROUP_WIDTH - 1)
+
+/**
+ * The functions below only deal with control bytes, and are shared by all
+ * table types. The typed functions are generated by EMBIHT_DEFINE.
+ */
+
+/**
+ * Each of these returns a bitmask with bit N set if the Nth control byte
+ * of the group starting at 'ctrl' matches.
+ */
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+static inline uint32_t
+embiht_match(const uint8_t *ctrl, uint8_t h2)
+{
+    __m128i grp = _mm_loadu_si128((const __m128i*)ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(grp, _mm_set1_epi8((char)h2)));
+}
+
+static inline uint32_t
+embiht_match_empty(const uint8_t *ctrl)
+{
+    return embiht_match(ctrl, EMBIHT_CTRL_EMPTY);
+}
+
+/** Empty or deleted slots; these are the only ones with the top bit set */
+static inline uint32_t
+embiht_match_free(const uint8_t *ctrl)
+{
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)ctrl));
+}
+
+#else
+
+static inline uint32_t
+embiht_match(const uint8_t *ctrl, uint8_t h2)
+{
+    uint32_t ret = 0;
+    int ii;
+    for (ii = 0; ii < EMBIHT_GROUP_WIDTH; ii++) {
+        ret |= (uint32_t)(ctrl[ii] == h2) << ii;
+    }
+    return ret;
+}
+
+static inline uint32_t
+embiht_match_empty(const uint8_t *ctrl)
+{
+    return embiht_match(ctrl, EMBIHT_CTRL_EMPTY);
+}
+
+static inline uint32_t
+embiht_match_free(const uint8_t *ctrl)
+{
+    uint32_t ret = 0;
+    int ii;
+    for (ii = 0; ii < EMBIHT_GROUP_WIDTH; ii++) {
+        ret |= (uint32_t)(ctrl[ii] >> 7) << ii;
+    }
+    return ret;
+}
+#endif /* __SSE2__ */
+
+/**
+ * Integer keys (PIDs, file descriptors) are anything but random, so mix
+ * them up before use. The multiplicative hash keeps the well mixed high
+ * half of the product in the low bits, which is where the slot and tag
+ * bits are taken from.
+ */
+static inline uint64_t
+embiht_hash(int mode, uint64_t key)
+{
+    if (mode == EMBIHT_HASH_MUL) {
+        key *= 0x9e3779b97f4a7c15ULL;
+        return (key >> 32) | (key << 32);
+    }
+
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+static void
+embiht_set_ctrl(uint8_t *ctrl, size_t nslots, size_t idx, uint8_t c)
+{
+    ctrl[idx] = c;
+    /* Keep the copy of the first group (read by groups which wrap) in sync */
+    if (idx < EMBIHT_GROUP_WIDTH - 1) {
+        ctrl[nslots + idx] = c;
+    }
+}
+
+static uint8_t *
+embiht_ctrl_alloc(size_t nslots)
+{
+    uint8_t *ctrl = EMBIHT_MALLOC(embiht_nctrl(nslots));
+    memset(ctrl, EMBIHT_CTRL_EMPTY, embiht_nctrl(nslots));
+    return ctrl;
+}
+
+/**
+ * Returns the first empty or deleted slot in the key's probe sequence.
+ * Groups are visited at triangular offsets, which covers every group of a
+ * power-of-two sized table.
+ */
+static size_t
+embiht_find_free(const uint8_t *ctrl, size_t nslots, uint64_t hash)
+{
+    size_t mask = nslots - 1, pos = EMBIHT_H1(hash) & mask, stride = 0;
+
+    while (1) {
+        uint32_t match = embiht_match_free(ctrl + pos);
+        if (match) {
+            return (pos + __builtin_ctz(match)) & mask;
+        }
+        stride += EMBIHT_GROUP_WIDTH;
+        pos = (pos + stride) & mask;
+    }
+}
+
+/**
+ * A slot can be marked empty, rather than deleted, if no probe sequence
+ * could have moved past it. That is the case if there was never a full
+ * group around it. Returns 1 if the slot was marked deleted.
+ */
+static int
+embiht_erase_ctrl(uint8_t *ctrl, size_t nslots, size_t idx)
+{
+    size_t mask = nslots - 1;
+    uint32_t empty_before =
+            embiht_match_empty(ctrl + ((idx - EMBIHT_GROUP_WIDTH) & mask));
+    uint32_t empty_after = embiht_match_empty(ctrl + idx);
+
+    if (empty_before && empty_after &&
+            __builtin_ctz(empty_after) +
+            (__builtin_clz(empty_before) - (32 - EMBIHT_GROUP_WIDTH)) <
+            EMBIHT_GROUP_WIDTH) {
+        embiht_set_ctrl(ctrl, nslots, idx, EMBIHT_CTRL_EMPTY);
+        return 0;
+    }
+    embiht_set_ctrl(ctrl, nslots, idx, EMBIHT_CTRL_DELETED);
+    return 1;
+}
+
+static size_t
+embiht_slots_for(size_t size)
+{
+    size_t nslots = EMBIHT_GROUP_WIDTH;
+    while (nslots * EMBIHT_MAX_LOAD < size * 8) {
+        nslots *= 2;
+    }
+    return nslots;
+}
+
+/**
+ * Size of the table once it needs rebuilding to make room for another
+ * item. It only doubles if the live entries need it; otherwise the rebuild
+ * just clears out deleted slots.
+ */
+static size_t
+embiht_grow_slots(size_t nslots, size_t nitems)
+{
+    if ((nitems + 1) * 16 > nslots * EMBIHT_MAX_LOAD) {
+        nslots *= 2;
+    }
+    return nslots;
+}
+
+/**
+ * Once the load has dropped well below the maximum, halve the table while
+ * the live entries would still leave it no more than half full.
+ */
+static size_t
+embiht_shrink_slots(size_t nslots, size_t min_slots, size_t nitems)
+{
+    if (nslots <= min_slots ||
+            nitems * 8 * EMBIHT_MIN_LOAD_DIV >= nslots * EMBIHT_MAX_LOAD) {
+        return nslots;
+    }
+
+    while (nslots / 2 >= min_slots &&
+            nitems * 16 <= (nslots / 2) * EMBIHT_MAX_LOAD) {
+        nslots /= 2;
+    }
+    return nslots;
+}
+
+/**
+ * Groups visited by a lookup for 'hash' before it reaches slot 'idx'
+ */
+static size_t
+embiht_probe_len(size_t nslots, uint64_t hash, size_t idx)
+{
+    size_t mask = nslots - 1, pos = EMBIHT_H1(hash) & mask, stride = 0;
+    size_t ngroups = 0;
+
+    while (((idx - pos) & mask) >= EMBIHT_GROUP_WIDTH) {
+        stride += EMBIHT_GROUP_WIDTH;
+        pos = (pos + stride) & mask;
+        ngroups++;
+    }
+    return ngroups;
+}
+
+static void
+embiht_stat_ctrl(const uint8_t *ctrl, size_t nslots, embiht_statistics *stats)
+{
+    size_t ii;
+
+    for (ii = 0; ii < nslots; ii += EMBIHT_GROUP_WIDTH) {
+        size_t jj, nfull = 0;
+        for (jj = 0; jj < EMBIHT_GROUP_WIDTH && ii + jj < nslots; jj++) {
+            nfull += embiht_isfull(ctrl[ii + jj]);
+        }
+        stats->occupancy[nfull]++;
+    }
+}
+
+#define EMBIHT_DEFINE(name, ktype, vtype)                                   \
+static void                                                                 \
+name##_alloc(name##_table *ht, size_t nslots)                               \
+{                                                                           \
+    ht->nslots = nslots;                                                    \
+    ht->ctrl = embiht_ctrl_alloc(nslots);                                   \
+    ht->keys = EMBIHT_MALLOC(nslots * sizeof(ktype));                       \
+    ht->values = EMBIHT_MALLOC(nslots * sizeof(vtype));                     \
+    ht->nitems = 0;                                                         \
+    ht->ndeleted = 0;                                                       \
+}                                                                           \
+                                                                            \
+static void                                                                 \
+name##_free_slots(name##_table *ht)                                         \
+{                                                                           \
+    EMBIHT_FREE(ht->ctrl, embiht_nctrl(ht->nslots));                        \
+    EMBIHT_FREE(ht->keys, ht->nslots * sizeof(ktype));                      \
+    EMBIHT_FREE(ht->values, ht->nslots * sizeof(vtype));                    \
+}                                                                           \
+                                                                            \
+static size_t                                                               \
+name##_find(const name##_table *ht, ktype key, uint64_t hash)               \
+{                                                                           \
+    size_t mask = ht->nslots - 1, pos = EMBIHT_H1(hash) & mask;             \
+    size_t stride = 0;                                                      \
+    uint8_t h2 = EMBIHT_H2(hash);                                           \
+                                                                            \
+    while (1) {                                                             \
+        const uint8_t *grp = ht->ctrl + pos;                                \
+        uint32_t match = embiht_match(grp, h2);                             \
+                                                                            \
+        while (match) {                                                     \
+            size_t idx = (pos + __builtin_ctz(match)) & mask;               \
+            if (ht->keys[idx] == key) {                                     \
+                return idx;                                                 \
+            }                                                               \
+            match &= match - 1;                                             \
+        }                                                                   \
+                                                                            \
+        if (embiht_match_empty(grp)) {                                      \
+            return EMBIHT_NPOS;                                             \
+        }                                                                   \
+                                                                            \
+        stride += EMBIHT_GROUP_WIDTH;                                       \
+        pos = (pos + stride) & mask;                                        \
+    }                                                                       \
+}                                                                           \
+                                                                            \
+static void                                                                 \
+name##_rehash(name##_table *ht, size_t nslots)                              \
+{                                                                           \
+    name##_table old = *ht;                                                 \
+    size_t ii;                                                              \
+                                                                            \
+    name##_alloc(ht, nslots);                                               \
+                                                                            \
+    for (ii = 0; ii < old.nslots; ii++) {                                   \
+        uint64_t hash;                                                      \
+        size_t idx;                                                         \
+                                                                            \
+        if (!embiht_isfull(old.ctrl[ii])) {                                 \
+            continue;                                                       \
+        }                                                                   \
+                                                                            \
+        hash = embiht_hash(ht->hash_mode, old.keys[ii]);                    \
+        idx = embiht_find_free(ht->ctrl, nslots, hash);                     \
+        embiht_set_ctrl(ht->ctrl, nslots, idx, EMBIHT_H2(hash));            \
+        ht->keys[idx] = old.keys[ii];                                       \
+        ht->values[idx] = old.values[ii];                                   \
+        ht->nitems++;                                                       \
+    }                                                                       \
+                                                                            \
+    name##_free_slots(&old);                                                \
+}                                                                           \
+                                                                            \
+static void                                                                 \
+name##_maybe_shrink(name##_table *ht)                                       \
+{                                                                           \
+    size_t nslots =                                                         \
+            embiht_shrink_slots(ht->nslots, ht->min_slots, ht->nitems);     \
+    if (nslots != ht->nslots) {                                             \
+        name##_rehash(ht, nslots);                                          \
+    }                                                                       \
+}                                                                           \
+                                                                            \
+EMBIHT_API                                                                  \
+name##_table *                                                              \
+name##_make(size_t size)                                                    \
+{                                                                           \
+    name##_table *ret = EMBIHT_MALLOC(sizeof(*ret));                        \
+                                                                            \
+    memset(ret, 0, sizeof(*ret));                                           \
+    ret->min_slots = embiht_slots_for(size);                                \
+    name##_alloc(ret, ret->min_slots);                                      \
+    return ret;                                                             \
+}                                                                           \
+                                                                            \
+EMBIHT_API                                                                  \
+void                                                                        \
+name##_destroy(name##_table *ht)                                            \
+{                                                                           \
+    name##_free_slots(ht);                                                  \
+    EMBIHT_FREE(ht, sizeof(*ht));                                           \
+}                                                                           \
+                                                                            \
+EMBIHT_API                                                                  \
+vtype *                                                                     \
+name##_fetch(name##_table *ht, ktype key, int lval)                         \
+{                                                                           \
+    uint64_t hash = embiht_hash(ht->hash_mode, key);                        \
+    size_t idx = name##_find(ht, key, hash);                                \
+                                                                            \
+    if (idx != EMBIHT_NPOS) {                                               \
+        return ht->values + idx;                                            \
+    }                                                                       \
+                                                                            \
+    if (!lval) {                                                            \
+        return NULL;                                                        \
+    }                                                                       \
+                                                                            \
+    idx = embiht_find_free(ht->ctrl, ht->nslots, hash);                     \
+                                                                            \
+    /* Reusing a deleted slot doesn't make probe sequences any longer */    \
+    if (ht->ctrl[idx] == EMBIHT_CTRL_EMPTY &&                               \
+            (ht->nitems + ht->ndeleted + 1) * 8 >                           \
+            ht->nslots * EMBIHT_MAX_LOAD) {                                 \
+        name##_rehash(ht, embiht_grow_slots(ht->nslots, ht->nitems));       \
+        idx = embiht_find_free(ht->ctrl, ht->nslots, hash);                 \
+    }                                                                       \
+                                                                            \
+    if (ht->ctrl[idx] == EMBIHT_CTRL_DELETED) {                             \
+        ht->ndeleted--;                                                     \
+    }                                                                       \
+                                                                            \
+    embiht_set_ctrl(ht->ctrl, ht->nslots, idx, EMBIHT_H2(hash));            \
+    ht->keys[idx] = key;                                                    \
+    ht->nitems++;                                                           \
+    memset(ht->values + idx, 0, sizeof(vtype));                             \
+    return ht->values + idx;                                                \
+}                                                                           \
+                                                                            \
+static void                                                                 \
+name##_erase(name##_table *ht, size_t idx)                                  \
+{                                                                           \
+    ht->ndeleted += embiht_erase_ctrl(ht->ctrl, ht->nslots, idx);           \
+    ht->nitems--;                                                           \
+}                                                                           \
+                                                                            \
+EMBIHT_API                                                                  \
+int                                                                         \
+name##_delete(name##_table *ht, ktype key)                                  \
+{                                                                           \
+    size_t idx = name##_find(ht, key, embiht_hash(ht->hash_mode, key));     \
+    if (idx == EMBIHT_NPOS) {                                               \
+        return 0;                                                           \
+    }                                                                       \
+    name##_erase(ht, idx);                                                  \
+    name##_maybe_shrink(ht);                                                \
+    return 1;                                                               \
+}                                                                           \
+                                                                            \
+EMBIHT_API                                                                  \
+void                                                                        \
+name##_stat(name##_table *ht, embiht_statistics *stats)                     \
+{                                                                           \
+    size_t ii;                                                              \
+                                                                            \
+    memset(stats, 0, sizeof(*stats));                                       \
+    stats->nslots = ht->nslots;                                             \
+    stats->item_count = ht->nitems;                                         \
+    stats->deleted_count = ht->ndeleted;                                    \
+    embiht_stat_ctrl(ht->ctrl, ht->nslots, stats);                          \
+                                                                            \
+    for (ii = 0; ii < ht->nslots; ii++) {                                   \
+        size_t ngroups;                                                     \
+        if (!embiht_isfull(ht->ctrl[ii])) {                                 \
+            continue;                                                       \
+        }                                                                   \
+        ngroups = embiht_probe_len(ht->nslots,                              \
+                embiht_hash(ht->hash_mode, ht->keys[ii]), ii);              \
+        stats->probes[ngroups < EMBIHT_HIST_SIZE                            \
+                      ? ngroups : EMBIHT_HIST_SIZE - 1]++;                  \
+    }                                                                       \
+}                                                                           \
+                                                                            \
+EMBIHT_API                                                                  \
+void                                                                        \
+name##_set_hash(name##_table *ht, int mode)                                 \
+{                                                                           \
+    ht->hash_mode = mode;                                                   \
+    if (ht->nitems || ht->ndeleted) {                                       \
+        name##_rehash(ht, ht->nslots);                                      \
+    }                                                                       \
+}                                                                           \
+                                                                            \
+EMBIHT_API                                                                  \
+void                                                                        \
+name##_iterinit(name##_table *ht, name##_iterator *iter)                    \
+{                                                                           \
+    name##_maybe_shrink(ht);                                                \
+    iter->ht = ht;                                                          \
+    iter->pos = EMBIHT_NPOS;                                                \
+}                                                                           \
+                                                                            \
+EMBIHT_API                                                                  \
+int                                                                         \
+name##_iternext(name##_iterator *iter)                                      \
+{                                                                           \
+    name##_table *ht = iter->ht;                                            \
+                                                                            \
+    for (iter->pos++; iter->pos < ht->nslots; iter->pos++) {                \
+        if (embiht_isfull(ht->ctrl[iter->pos])) {                           \
+            return 1;                                                       \
+        }                                                                   \
+    }                                                                       \
+    return 0;                                                               \
+}                                                                           \
+                                                                            \
+EMBIHT_API                                                                  \
+void                                                                        \
+name##_iterdel(name##_iterator *iter)                                       \
+{                                                                           \
+    name##_erase(iter->ht, iter->pos);                                      \
+}
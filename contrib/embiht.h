@@ -0,0 +1,126 @@
+#ifndef EMBIHT_H_
+#define EMBIHT_H_
+
+/**
+ * Open addressing hash table for integer keys.
+ *
+ * Unlike embht, there are no per-bucket arrays. The table is a single
+ * array of slots, with the metadata ("control bytes"), keys and values kept
+ * in separate arrays. Each control byte holds 7 bits of the key's hash, so a
+ * lookup compares 16 control bytes at a time (with SSE2, when available) and
+ * only touches the key array for likely matches.
+ *
+ * Tables are typed. EMBIHT_DECLARE(name, ktype, vtype) declares a table
+ * type name_table with keys of the (unsigned integer) type ktype and values
+ * of type vtype, along with its functions (name_make, name_fetch, ...).
+ * EMBIHT_DEFINE, from embiht.c, generates their definitions; it must be
+ * used exactly once per table type. Key and value arrays are exactly as wide
+ * as their types.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#ifndef EMBIHT_API
+#define EMBIHT_API
+#endif
+
+/** Slots examined at once */
+#define EMBIHT_GROUP_WIDTH 16
+
+/** Maximum load, in eighths */
+#define EMBIHT_MAX_LOAD 7
+
+/**
+ * Tables shrink once the load falls below 1/EMBIHT_MIN_LOAD_DIV of the
+ * maximum, but never below the size they were created with.
+ */
+#define EMBIHT_MIN_LOAD_DIV 4
+
+enum {
+    EMBIHT_CTRL_EMPTY = 0x80,
+    EMBIHT_CTRL_DELETED = 0xfe
+};
+
+/** Key finalizers, see name_set_hash */
+enum {
+    /** MurmurHash3's fmix64 (the default) */
+    EMBIHT_HASH_MURMUR = 0,
+    /** Fibonacci hashing; a single multiplication */
+    EMBIHT_HASH_MUL
+};
+
+/** Size of the probe length histogram in embiht_statistics */
+#define EMBIHT_HIST_SIZE 16
+
+typedef struct {
+    size_t nslots;
+    size_t item_count;
+    size_t deleted_count;
+    /** items found in the N+1th group probed; the last slot counts more */
+    size_t probes[EMBIHT_HIST_SIZE];
+    /** aligned groups of EMBIHT_GROUP_WIDTH slots with N items in them */
+    size_t occupancy[EMBIHT_GROUP_WIDTH + 1];
+} embiht_statistics;
+
+#define EMBIHT_DECLARE(name, ktype, vtype)                                  \
+typedef struct {                                                            \
+    /* nslots control bytes, followed by copies of the first group */      \
+    uint8_t *ctrl;                                                          \
+    ktype *keys;                                                            \
+    vtype *values;                                                          \
+                                                                            \
+    size_t nslots;                                                          \
+    size_t min_slots;                                                       \
+    int hash_mode;                                                          \
+                                                                            \
+    size_t nitems;                                                          \
+    size_t ndeleted;                                                        \
+} name##_table;                                                             \
+                                                                            \
+typedef struct {                                                            \
+    name##_table *ht;                                                       \
+    size_t pos;                                                             \
+} name##_iterator;                                                          \
+                                                                            \
+EMBIHT_API name##_table *name##_make(size_t size);                          \
+EMBIHT_API void name##_destroy(name##_table *ht);                           \
+EMBIHT_API vtype *name##_fetch(name##_table *ht, ktype key, int lval);      \
+EMBIHT_API int name##_delete(name##_table *ht, ktype key);                  \
+EMBIHT_API void name##_stat(name##_table *ht, embiht_statistics *stats);    \
+EMBIHT_API void name##_set_hash(name##_table *ht, int mode);                \
+EMBIHT_API void name##_iterinit(name##_table *ht, name##_iterator *iter);   \
+EMBIHT_API int name##_iternext(name##_iterator *iter);                      \
+EMBIHT_API void name##_iterdel(name##_iterator *iter);
+
+/**
+ * For a table declared as 'name':
+ *
+ * name_make(size) creates a table with room for about 'size' items.
+ *
+ * name_fetch(ht, key, lval) looks up a key, creating it if lval is true.
+ * It returns a pointer to the value, which is zeroed for new entries.
+ * Pointers are only valid until the next insertion or deletion.
+ *
+ * name_delete(ht, key) removes a key, returning 1 if it existed. This may
+ * shrink the table.
+ *
+ * name_stat(ht, stats) collects statistics, including probe length and
+ * occupancy histograms. This walks the whole table.
+ *
+ * name_set_hash(ht, mode) selects the key finalizer (EMBIHT_HASH_*). A
+ * non-empty table is rebuilt.
+ *
+ * name_iterinit/name_iternext iterate over the table. The current entry
+ * may be deleted with name_iterdel, but no entries may be inserted while
+ * iterating. Tables emptied by iteration are shrunk by the next iterinit.
+ */
+
+#define embiht_iterkey(iter) ((iter)->ht->keys[(iter)->pos])
+#define embiht_iterval(iter) (&(iter)->ht->values[(iter)->pos])
+
+#define embiht_count(ht) ((ht)->nitems)
+
+#endif /* EMBIHT_H_ */
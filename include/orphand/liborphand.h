@@ -0,0 +1,204 @@
+#ifndef LIBORPHAND_H_
+#define LIBORPHAND_H_
+
+/**
+ * Client library for the orphand protocol.
+ *
+ * A connection buffers registrations and sends them in batches: a batch
+ * goes out once it holds a certain number of messages, or once the oldest
+ * message in it has waited for a certain time, whichever comes first. Many
+ * children can thus be registered with a handful of system calls.
+ *
+ * In blocking mode (the default), the library flushes whenever a batch is
+ * due, from within the call which made it due. The deadline is only
+ * checked when the library is called, so callers which may go idle with
+ * messages pending should call orphand_conn_flush() or
+ * orphand_conn_process() at some point.
+ *
+ * In non-blocking mode (ORPHAND_CONN_NONBLOCK), no call ever blocks.
+ * Callers poll orphand_conn_fd() for orphand_conn_events(), with a timeout
+ * of orphand_conn_timeout(), and call orphand_conn_process() when the
+ * descriptor is ready or the timeout has expired.
+ *
+ * A connection must not be used by more than one thread at a time.
+ */
+
+#include "orphand.h"
+#include <sys/types.h>
+#include <stddef.h>
+
+#ifndef LIBORPHAND_API
+#define LIBORPHAND_API
+#endif
+
+/** Defaults for orphand_conn_set_batch */
+#define ORPHAND_CONN_DEFAULT_BATCH 128
+#define ORPHAND_CONN_DEFAULT_DELAY_MS 10
+
+enum {
+    /** never block; see above */
+    ORPHAND_CONN_NONBLOCK = 0x1
+};
+
+typedef struct orphand_conn orphand_conn;
+
+/**
+ * Called by orphand_conn_process (or orphand_conn_ping) for each PING
+ * reply. rtt_us is the round trip time in microseconds.
+ */
+typedef void (*orphand_ping_callback)(orphand_conn *conn,
+                                      uint32_t cookie,
+                                      uint64_t rtt_us,
+                                      void *arg);
+
+/**
+ * Connect to the daemon. path may be NULL, in which case ORPHAND_SOCKET
+ * from the environment, or else ORPHAND_DEFAULT_PATH, is used. Returns
+ * NULL with errno set on failure.
+ */
+LIBORPHAND_API
+orphand_conn *
+orphand_conn_new(const char *path, int flags);
+
+/**
+ * Close the connection. In blocking mode, pending messages are flushed
+ * first; in non-blocking mode, they are discarded.
+ */
+LIBORPHAND_API
+void
+orphand_conn_free(orphand_conn *conn);
+
+/**
+ * Set the batch size (in messages) and the maximum time in milliseconds a
+ * message may wait before it is sent. A batch size of 1 disables batching.
+ */
+LIBORPHAND_API
+void
+orphand_conn_set_batch(orphand_conn *conn,
+                       unsigned int max_msgs,
+                       unsigned int max_delay_ms);
+
+/**
+ * Register child to parent. ext may be NULL for the server defaults.
+ * Returns 0 once the message is queued, or -1 with errno set. EAGAIN means
+ * the connection is non-blocking and its buffer is full; EPIPE means the
+ * daemon went away, and the connection can only be freed.
+ */
+LIBORPHAND_API
+int
+orphand_conn_register(orphand_conn *conn,
+                      pid_t parent,
+                      pid_t child,
+                      const orphand_register_ext *ext);
+
+/**
+ * Unregister a reaped child. parent may be 0. Returns as for
+ * orphand_conn_register.
+ */
+LIBORPHAND_API
+int
+orphand_conn_unregister(orphand_conn *conn, pid_t parent, pid_t child);
+
+/**
+ * Send all pending messages, whether a batch is due or not. Returns 0 once
+ * everything has been written to the socket, or -1 with errno set (EAGAIN
+ * if non-blocking and not everything could be written).
+ */
+LIBORPHAND_API
+int
+orphand_conn_flush(orphand_conn *conn);
+
+/**
+ * Send a PING carrying a new cookie, which is returned in *cookie. The reply
+ * is delivered to the ping callback. The PING is sent along with any
+ * pending messages. Returns as for orphand_conn_register.
+ */
+LIBORPHAND_API
+int
+orphand_conn_ping_send(orphand_conn *conn, uint32_t *cookie);
+
+/**
+ * Send a PING and wait up to timeout_ms for the reply, storing the round
+ * trip time in *rtt_us. This blocks even on non-blocking connections.
+ * Returns -1 with ETIMEDOUT if no reply came in time.
+ */
+LIBORPHAND_API
+int
+orphand_conn_ping(orphand_conn *conn, int timeout_ms, uint64_t *rtt_us);
+
+/**
+ * Have the daemon spawn a child and register it to parent, which closes the
+ * window between fork() and registration. fds (at most
+ * ORPHAND_SPAWN_MAX_FDS) become the child's stdin, stdout and stderr; the
+ * others are opened on /dev/null. envp may be NULL for an empty
+ * environment, and ext NULL for the server defaults.
+ *
+ * Pending messages are sent first. This blocks for up to timeout_ms, even
+ * on non-blocking connections. Returns the PID, or -1 with errno set to the
+ * daemon's error (EPERM if we run as a different user) or to ETIMEDOUT.
+ */
+LIBORPHAND_API
+pid_t
+orphand_conn_spawn(orphand_conn *conn,
+                   pid_t parent,
+                   char *const argv[],
+                   char *const envp[],
+                   const int *fds,
+                   unsigned int nfds,
+                   const orphand_register_ext *ext,
+                   int timeout_ms);
+
+/**
+ * Fetch the daemon's counters (see orphand_stats) into *stats. Pending
+ * messages are sent first. This blocks for up to timeout_ms, even on
+ * non-blocking connections. Returns 0, or -1 with errno set (ETIMEDOUT if
+ * no reply came in time).
+ */
+LIBORPHAND_API
+int
+orphand_conn_stats(orphand_conn *conn, orphand_stats *stats, int timeout_ms);
+
+LIBORPHAND_API
+void
+orphand_conn_set_ping_callback(orphand_conn *conn,
+                               orphand_ping_callback callback,
+                               void *arg);
+
+/** The socket, for poll(2) and friends */
+LIBORPHAND_API
+int
+orphand_conn_fd(const orphand_conn *conn);
+
+/**
+ * The poll(2) events the connection is waiting for: POLLOUT while a batch
+ * is due but couldn't be written, and POLLIN while PINGs are outstanding.
+ */
+LIBORPHAND_API
+short
+orphand_conn_events(const orphand_conn *conn);
+
+/**
+ * Milliseconds until the pending batch is due, 0 if it is due already, or
+ * -1 if nothing is pending.
+ */
+LIBORPHAND_API
+int
+orphand_conn_timeout(const orphand_conn *conn);
+
+/**
+ * Send the pending batch if it is due, and handle replies. Returns 0, or -1
+ * with errno set on a fatal error (EAGAIN is not reported here).
+ */
+LIBORPHAND_API
+int
+orphand_conn_process(orphand_conn *conn);
+
+/**
+ * Number of messages in the send buffer. Messages count as pending until the
+ * whole buffer has been written.
+ */
+LIBORPHAND_API
+size_t
+orphand_conn_pending(const orphand_conn *conn);
+
+#endif /* LIBORPHAND_H_ */
@@ -18,6 +18,164 @@ enum {
     ORPHAND_ACTION_REGISTER     = 0x1,
     ORPHAND_ACTION_UNREGISTER   = 0x2,
     ORPHAND_ACTION_PING         = 0x3,
+
+    /**
+     * Request the shared registration ring (see orphand_ring.h). The
+     * message is echoed back, carrying the ring's memfd and eventfd as
+     * SCM_RIGHTS ancillary data. If no descriptors are attached, the ring
+     * is not available.
+     */
+    ORPHAND_ACTION_RING         = 0x4,
+
+    /**
+     * Have orphand spawn the child itself and register it to parent, see
+     * orphand_spawn_ext. The reply is the message with child set to the
+     * new PID (0 on failure), followed by an orphand_spawn_reply.
+     */
+    ORPHAND_ACTION_SPAWN        = 0x5,
+
+    /**
+     * Request the daemon's counters. The reply is the message, followed by
+     * an orphand_stats.
+     */
+    ORPHAND_ACTION_STATS        = 0x6,
 };
 
+/**
+ * The upper 16 bits of the action may contain the length of an extension
+ * payload which immediately follows the message. Clients which don't know
+ * about extensions send a length of zero.
+ */
+#define ORPHAND_ACTION_MASK 0xffff
+#define ORPHAND_EXTLEN_SHIFT 16
+#define ORPHAND_ACTION_CODE(action) ((action) & ORPHAND_ACTION_MASK)
+#define ORPHAND_ACTION_EXTLEN(action) ((action) >> ORPHAND_EXTLEN_SHIFT)
+#define ORPHAND_ACTION_MAKE(code, extlen) \
+    ((code) | ((uint32_t)(extlen) << ORPHAND_EXTLEN_SHIFT))
+
+/**
+ * Extension payload for ORPHAND_ACTION_REGISTER. Fields which are not sent
+ * (because the payload is shorter) are treated as zero.
+ */
+typedef struct {
+    /** milliseconds to wait after signalling before sending SIGKILL.
+     * 0 means the server default */
+    uint32_t grace_ms;
+
+    /** maximum lifetime of the child in seconds, after which it is killed
+     * even if the parent is still alive. 0 for no limit */
+    uint32_t ttl_sec;
+} orphand_register_ext;
+
+/** Descriptors which may accompany a SPAWN request */
+#define ORPHAND_SPAWN_MAX_FDS 3
+
+/**
+ * Extension payload for ORPHAND_ACTION_SPAWN. Unlike REGISTER, all of it
+ * must be sent. It is followed by argc + envc NUL terminated strings; the
+ * arguments, then the environment. argv[0] is the program to run, which is
+ * looked up in orphand's PATH unless it contains a slash.
+ *
+ * The request carries nfds descriptors as SCM_RIGHTS ancillary data, which
+ * become the child's stdin, stdout and stderr, in that order. Those not
+ * sent are opened on /dev/null.
+ */
+typedef struct {
+    uint32_t grace_ms;
+    uint32_t ttl_sec;
+    uint32_t nfds;
+    uint32_t argc;
+    uint32_t envc;
+} orphand_spawn_ext;
+
+/** Extension payload of the reply to ORPHAND_ACTION_SPAWN */
+typedef struct {
+    /** errno value if the child couldn't be spawned, otherwise 0 */
+    uint32_t error;
+} orphand_spawn_reply;
+
+/** Version of orphand_stats described below */
+#define ORPHAND_STATS_VERSION 1
+
+/** Size of orphand_stats.messages, indexed by action code */
+#define ORPHAND_STATS_NACTIONS 8
+
+/** Sizes of the histograms in orphand_table_stats */
+#define ORPHAND_STATS_NPROBES 16
+#define ORPHAND_STATS_NGROUPS 17
+
+/** Tables in orphand_stats.tables */
+enum {
+    /** registrations, keyed by (parent, child) */
+    ORPHAND_STATS_TABLE_CHILDREN = 0,
+    /** connections, keyed by descriptor */
+    ORPHAND_STATS_TABLE_CLIENTS,
+    /** PID namespaces other than the daemon's */
+    ORPHAND_STATS_TABLE_NAMESPACES,
+    ORPHAND_STATS_NTABLES
+};
+
+/**
+ * Occupancy of one of the daemon's hash tables
+ */
+typedef struct {
+    uint64_t nslots;
+    uint64_t nitems;
+    /** slots holding a tombstone */
+    uint64_t ndeleted;
+    /** items found in the N+1th group of 16 slots probed; the last entry
+     * counts all longer probes */
+    uint64_t probes[ORPHAND_STATS_NPROBES];
+    /** groups of 16 slots holding N items */
+    uint64_t occupancy[ORPHAND_STATS_NGROUPS];
+} orphand_table_stats;
+
+/**
+ * Extension payload of the reply to ORPHAND_ACTION_STATS. Counters start at
+ * zero when the daemon does, and only ever grow.
+ *
+ * Later versions only append fields, so a reply may be longer than this
+ * structure. Fields beyond the extension length were not sent, and should
+ * be treated as zero.
+ */
+typedef struct {
+    /** ORPHAND_STATS_VERSION */
+    uint32_t version;
+    /** sizeof(orphand_stats) as known to the daemon */
+    uint32_t size;
+    uint64_t uptime_ms;
+
+    /** messages processed by action code, including records from the ring
+     * and children reaped by the daemon. Unknown actions count in [0] */
+    uint64_t messages[ORPHAND_STATS_NACTIONS];
+
+    /** children currently registered, and the parents they belong to */
+    uint64_t registrations;
+    uint64_t parents;
+    uint64_t clients;
+
+    uint64_t sweeps;
+    /** how long the last sweep took, in microseconds */
+    uint64_t last_sweep_us;
+
+    /** registrations and reaps dropped because /proc/[pid]/stat couldn't
+     * be read */
+    uint64_t procstat_failures;
+    /** orphans not killed since their PID was taken by another process */
+    uint64_t starttime_mismatches;
+
+    /** signals sent to orphans, and those which needed a SIGKILL after
+     * their grace period */
+    uint64_t kills;
+    uint64_t sigkills;
+    /** victims in the kill queue */
+    uint64_t kills_pending;
+
+    /** memory released early with process_mrelease(2) */
+    uint64_t nreclaimed;
+    uint64_t reclaimed_bytes;
+
+    orphand_table_stats tables[ORPHAND_STATS_NTABLES];
+} orphand_stats;
+
 #endif /* ORPHAND_H_ */
@@ -0,0 +1,176 @@
+#ifndef ORPHAND_RING_H_
+#define ORPHAND_RING_H_
+
+/**
+ * Layout of the shared registration ring.
+ *
+ * The daemon creates the ring in a sealed memfd and hands it out, along
+ * with an eventfd, in reply to ORPHAND_ACTION_RING. Any number of processes
+ * may map it and append records; the daemon is the only reader. Mappings
+ * survive fork(), so children of a process which has the ring can register
+ * their own children without ever talking to the daemon. Records carry
+ * PIDs as their producer sees them, so only processes in the daemon's PID
+ * namespace may use the ring. Others (such as children created after
+ * unshare(CLONE_NEWPID)) must use their socket, where PIDs are translated.
+ *
+ * Each slot is a single 64 bit word holding a state tag and a packed
+ * record, so that a record is published with a single compare-and-swap.
+ * The tag is the lap the slot belongs to (its position divided by the
+ * number of slots), doubled, plus one if the slot is full. A producer
+ * claims a position by advancing 'tail', which it may only do when the slot
+ * at that position is empty for the current lap; if it is still full from
+ * the previous lap, the ring is full. The daemon reads full slots in order
+ * and empties them for the next lap.
+ *
+ * A producer which dies between claiming and publishing leaves an empty
+ * slot behind. The daemon eventually skips it by advancing its lap, after
+ * which a late publish fails and the producer falls back to the socket.
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+#define ORPHAND_RING_MAGIC 0x4f524e47
+#define ORPHAND_RING_VERSION 1
+
+/** Number of slots the daemon creates by default. Always a power of two */
+#define ORPHAND_RING_DEFAULT_SLOTS 4096
+
+/**
+ * The ring is considered abandoned (the daemon is gone) once 'expires' is
+ * this many milliseconds in the past
+ */
+#define ORPHAND_RING_SLACK_MS 1000
+
+/** Records hold PIDs of up to this many bits, and 4 bit action codes */
+#define ORPHAND_RING_PID_BITS 22
+#define ORPHAND_RING_TAG_SHIFT 48
+#define ORPHAND_RING_RECORD_MASK ((1ULL << ORPHAND_RING_TAG_SHIFT) - 1)
+
+#define ORPHAND_RING_ALIGN 64
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nslots;
+    uint32_t hdrsize;
+
+    /** CLOCK_MONOTONIC milliseconds until which the daemon will look at
+     * the ring again, even if nobody wakes it */
+    uint64_t expires;
+
+    /** next position to be claimed by a producer */
+    uint64_t tail __attribute__((aligned(ORPHAND_RING_ALIGN)));
+
+    /** set by the daemon before it blocks; the first producer to clear it
+     * must write to the eventfd */
+    uint32_t sleeping __attribute__((aligned(ORPHAND_RING_ALIGN)));
+
+    uint64_t slots[] __attribute__((aligned(ORPHAND_RING_ALIGN)));
+} orphand_ring;
+
+#define ORPHAND_RING_BYTES(nslots) \
+    (sizeof(orphand_ring) + (size_t)(nslots) * sizeof(uint64_t))
+
+#define orphand_ring__tag(ring, pos, full) \
+    ((uint64_t)((((pos) / (ring)->nslots) << 1 | (full)) & 0xffff) \
+            << ORPHAND_RING_TAG_SHIFT)
+
+/** Slot contents when empty or full, for a given position */
+#define ORPHAND_RING_EMPTY(ring, pos) orphand_ring__tag(ring, pos, 0)
+#define ORPHAND_RING_FULL(ring, pos) orphand_ring__tag(ring, pos, 1)
+
+#define ORPHAND_RING_RECORD(parent, child, action) \
+    (((uint64_t)(parent) << (4 + ORPHAND_RING_PID_BITS)) | \
+     ((uint64_t)(child) << 4) | (action))
+
+#define ORPHAND_RING_REC_ACTION(word) ((uint32_t)(word) & 0xf)
+#define ORPHAND_RING_REC_CHILD(word) \
+    ((uint32_t)((word) >> 4) & ((1U << ORPHAND_RING_PID_BITS) - 1))
+#define ORPHAND_RING_REC_PARENT(word) \
+    ((uint32_t)((word) >> (4 + ORPHAND_RING_PID_BITS)) & \
+     ((1U << ORPHAND_RING_PID_BITS) - 1))
+
+/** Give up on claiming a slot after this many lost races */
+#define ORPHAND_RING_MAX_RETRIES 64
+
+enum {
+    ORPHAND_RING_OK = 0,
+    /** the record was added and the daemon must be woken up */
+    ORPHAND_RING_KICK = 1,
+    /** the record can't be added; send it over the socket instead */
+    ORPHAND_RING_FAIL = -1
+};
+
+/**
+ * Append a record. Only actions without an extension payload can be sent
+ * through the ring.
+ */
+static inline int
+orphand_ring_push(orphand_ring *ring,
+                  uint32_t parent, uint32_t child, uint32_t action)
+{
+    uint64_t pos, expected, *slot;
+    struct timespec ts;
+    int ii;
+
+    if (parent >> ORPHAND_RING_PID_BITS || child >> ORPHAND_RING_PID_BITS ||
+            action > 0xf) {
+        return ORPHAND_RING_FAIL;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    if ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000 >
+            __atomic_load_n(&ring->expires, __ATOMIC_RELAXED) +
+                    ORPHAND_RING_SLACK_MS) {
+        return ORPHAND_RING_FAIL;
+    }
+
+    pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    for (ii = 0; ii < ORPHAND_RING_MAX_RETRIES; ii++) {
+        uint64_t word;
+        int16_t diff;
+
+        slot = ring->slots + (pos & (ring->nslots - 1));
+        word = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+        diff = (int16_t)((word >> ORPHAND_RING_TAG_SHIFT) -
+                         (ORPHAND_RING_EMPTY(ring, pos) >>
+                          ORPHAND_RING_TAG_SHIFT));
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, 0,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            /* Not yet drained from the previous lap */
+            return ORPHAND_RING_FAIL;
+        } else {
+            pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    if (ii == ORPHAND_RING_MAX_RETRIES) {
+        return ORPHAND_RING_FAIL;
+    }
+
+    expected = ORPHAND_RING_EMPTY(ring, pos);
+    if (!__atomic_compare_exchange_n(slot, &expected,
+                                     ORPHAND_RING_FULL(ring, pos) |
+                                     ORPHAND_RING_RECORD(parent, child,
+                                                         action),
+                                     0, __ATOMIC_SEQ_CST,
+                                     __ATOMIC_RELAXED)) {
+        /* Took too long; the daemon skipped the slot */
+        return ORPHAND_RING_FAIL;
+    }
+
+    if (__atomic_load_n(&ring->sleeping, __ATOMIC_SEQ_CST) &&
+            __atomic_exchange_n(&ring->sleeping, 0, __ATOMIC_SEQ_CST)) {
+        return ORPHAND_RING_KICK;
+    }
+    return ORPHAND_RING_OK;
+}
+
+#endif /* ORPHAND_RING_H_ */
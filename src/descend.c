@@ -0,0 +1,56 @@
+#include "orphand_priv.h"
+#include <dirent.h>
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+void
+orphand_pidlist_push(orphand_pidlist *list, pid_t pid)
+{
+    if (list->npids == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 16;
+        list->pids = realloc(list->pids, list->capacity * sizeof(pid_t));
+    }
+    list->pids[list->npids++] = pid;
+}
+
+int
+orphand_proc_children(pid_t pid, orphand_pidlist *list)
+{
+    char path[PATH_MAX];
+    DIR *dir;
+    struct dirent *de;
+
+    snprintf(path, sizeof(path), "/proc/%d/task", pid);
+    if ( (dir = opendir(path)) == NULL) {
+        return -1;
+    }
+
+    /**
+     * Each thread has its own list of the children it created
+     */
+    while ( (de = readdir(dir)) ) {
+        FILE *fp;
+        int child;
+
+        if (de->d_name[0] == '.') {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "/proc/%d/task/%s/children",
+                 pid, de->d_name);
+
+        if ( (fp = fopen(path, "r")) == NULL) {
+            continue;
+        }
+
+        while (fscanf(fp, "%d", &child) == 1) {
+            orphand_pidlist_push(list, child);
+        }
+        fclose(fp);
+    }
+
+    closedir(dir);
+    return 0;
+}
@@ -11,7 +11,7 @@ orphand_io_init(orphand_server *srv,
                 const char *path)
 {
     int status,
-        sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        sock = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
 
     struct sockaddr_un uaddr;
 
@@ -46,11 +46,132 @@ orphand_io_init(orphand_server *srv,
     srv->nsock = 1;
     srv->maxfd = -1;
 
-    srv->clients = embht_make(1023, 0);
+    srv->clients = orphand_clientht_make(64);
+    orphand_clientht_set_hash(srv->clients, srv->hash_mode);
 
     return sock;
 }
 
+/**
+ * recv() which also collects descriptors passed along with the data
+ */
+static ssize_t
+sock_recv(orphand_client *cli, void *buf, size_t len)
+{
+    struct iovec iov;
+    struct msghdr mh;
+    struct cmsghdr *cmsg;
+    union {
+        char buf[CMSG_SPACE(ORPHAND_CLIENT_MAX_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } cbuf;
+    ssize_t nr;
+
+    iov.iov_base = buf;
+    iov.iov_len = len;
+
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf.buf;
+    mh.msg_controllen = sizeof(cbuf.buf);
+
+    nr = recvmsg(cli->sockfd, &mh, MSG_DONTWAIT|MSG_CMSG_CLOEXEC);
+    if (nr == -1) {
+        return -1;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+        size_t ii, nfds;
+
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+
+        nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (ii = 0; ii < nfds; ii++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + ii * sizeof(int), sizeof(int));
+
+            if (cli->nfds == ORPHAND_CLIENT_MAX_FDS) {
+                WARN("fd=%d sent too many descriptors", cli->sockfd);
+                close(fd);
+                continue;
+            }
+            cli->fds[cli->nfds++] = fd;
+        }
+    }
+
+    if (mh.msg_flags & MSG_CTRUNC) {
+        WARN("fd=%d sent too many descriptors at once", cli->sockfd);
+    }
+    return nr;
+}
+
+/**
+ * Read as much as is available, up to len bytes. Returns the amount read,
+ * setting SOCKEV_ER in *ret if the connection is done for.
+ */
+static size_t
+sock_fill(orphand_client *cli, char *buf, size_t len, int *ret)
+{
+    size_t total = 0;
+    ssize_t nr;
+
+    while (total < len) {
+
+        nr = sock_recv(cli, buf + total, len - total);
+
+        if (nr > 0) {
+            total += nr;
+            continue;
+        }
+
+        if (nr == -1) {
+            if (errno == EWOULDBLOCK) {
+                break; /* meh */
+            } else if (errno == EINTR) {
+                continue;
+            } else {
+                ERROR("fd=%d recv: %s",
+                      cli->sockfd,
+                      strerror(errno));
+                *ret |= SOCKEV_ER;
+            }
+        } else {
+            *ret |= SOCKEV_ER;
+            DEBUG("Socket %d closed the connection",
+                 cli->sockfd);
+        }
+        break;
+    }
+    return total;
+}
+
+static void
+free_large(orphand_client *cli)
+{
+    orphand_pool_free(cli->large, cli->large_size);
+    cli->large = NULL;
+    cli->large_size = cli->large_used = 0;
+}
+
+static void
+free_client(orphand_server *srv, orphand_client *cli)
+{
+    unsigned int ii;
+
+    for (ii = 0; ii < cli->nfds; ii++) {
+        close(cli->fds[ii]);
+    }
+    if (cli->large) {
+        free_large(cli);
+    }
+    orphand_pidns_detach(srv, cli);
+    close(cli->sockfd);
+    orphand_slab_free(&srv->client_slab, cli);
+}
+
 static int
 do_sockio(orphand_server *srv,
           orphand_client *cli,
@@ -104,55 +225,63 @@ do_sockio(orphand_server *srv,
 
     if (events & SOCKEV_RD) {
         struct orphand_buffer *ob = &cli->rcvbuf;
-        size_t left = ob->total - ob->used;
         ssize_t nr;
-        uint32_t *bufp = (uint32_t*)ob->buf;
+        char *bufp = ob->buf;
+
+        if (cli->large) {
+            cli->large_used += sock_fill(cli, cli->large + cli->large_used,
+                                         cli->large_size - cli->large_used,
+                                         &ret);
+            if (cli->large_used < cli->large_size) {
+                goto GT_READ_DONE;
+            }
 
-        while (left) {
+            orphand_process_message(srv, cli, (orphand_message*)cli->large,
+                                    cli->large + sizeof(orphand_message),
+                                    cli->large_size - sizeof(orphand_message));
+            free_large(cli);
+        }
 
-            nr = recv(cli->sockfd,
-                      ob->buf + ob->used,
-                      left,
-                      MSG_DONTWAIT);
+        ob->used += sock_fill(cli, ob->buf + ob->used, ob->total - ob->used,
+                              &ret);
+        nr = 0;
 
-            if (nr > 0) {
-                left -= nr;
-                ob->used += nr;
-                continue;
-            }
+        while (ob->used >= sizeof(orphand_message)) {
+            orphand_message msg;
+            unsigned int extlen;
 
-            if (nr == -1) {
-                if (errno == EWOULDBLOCK) {
-                    break; /* meh */
-                } else if (errno == EINTR) {
-                    continue;
-                } else {
-                    ERROR("fd=%d recv: %s",
-                          cli->sockfd,
-                          strerror(errno));
+            memcpy(&msg, bufp, sizeof(msg));
+            extlen = ORPHAND_ACTION_EXTLEN(msg.action);
+
+            if (extlen > ob->total - sizeof(msg)) {
+                if (ORPHAND_ACTION_CODE(msg.action) != ORPHAND_ACTION_SPAWN) {
+                    ERROR("fd=%d sent an extension of %u bytes",
+                          cli->sockfd, extlen);
                     ret |= SOCKEV_ER;
+                    break;
                 }
-            } else {
-                ret |= SOCKEV_ER;
-                DEBUG("Socket %d closed the connection",
-                     cli->sockfd);
-            }
-            break;
-        }
 
-        nr = 0;
+                /* Arguments and environment can be large. Everything left
+                 * in the buffer belongs to this request */
+                cli->large_size = sizeof(msg) + extlen;
+                cli->large = orphand_pool_alloc(cli->large_size);
+                cli->large_used = ob->used;
+                memcpy(cli->large, bufp, ob->used);
+                nr += ob->used;
+                ob->used = 0;
+                break;
+            }
 
-        while (ob->used >= 12) {
-            orphand_message msg;
-            msg.parent = bufp[0];
-            msg.child = bufp[1];
-            msg.action = bufp[2];
+            if (ob->used < sizeof(msg) + extlen) {
+                break;
+            }
 
-            bufp += 3;
-            ob->used -= 12;
-            nr += 12;
+            orphand_process_message(srv, cli, &msg,
+                                    bufp + sizeof(msg), extlen);
 
-            orphand_process_message(srv, cli, &msg);
+            bufp += sizeof(msg) + extlen;
+            ob->used -= sizeof(msg) + extlen;
+            nr += sizeof(msg) + extlen;
         }
 
         if (nr && ob->used) {
@@ -160,6 +289,8 @@ do_sockio(orphand_server *srv,
         }
     }
 
+    GT_READ_DONE:
+
     if (cli->sndbuf.used) {
         DEBUG("Socket %d still has %d bytes of data to be written..",
               cli->sockfd,
@@ -175,8 +306,9 @@ do_sockio(orphand_server *srv,
 void
 orphand_io_iteronce(orphand_server *srv)
 {
-    embht_iterator iter;
+    orphand_clientht_iterator iter;
     fd_set fout_rd, fout_wr;
+    struct timeval tmo = srv->tmo;
     int nevents;
 
     fout_rd = srv->fds_rd;
@@ -184,20 +316,26 @@ orphand_io_iteronce(orphand_server *srv)
 
     if (srv->maxfd == -1) {
         srv->maxfd = srv->sock;
-        embht_iterinit(srv->clients, &iter);
-        while (embht_iternext(&iter)) {
-            struct orphand_client *cli = embht_iterval(&iter).ptr;
+        if (srv->ring.shm) {
+            srv->maxfd = MAX(srv->maxfd, srv->ring.evfd);
+        }
+        srv->maxfd = MAX(srv->maxfd, srv->sigfd);
+        orphand_clientht_iterinit(srv->clients, &iter);
+        while (orphand_clientht_iternext(&iter)) {
+            struct orphand_client *cli = *embiht_iterval(&iter);
             assert(cli);
             srv->maxfd = MAX(srv->maxfd, cli->sockfd);
         }
     }
 
+    orphand_ring_prepare(srv, &tmo);
+
     GT_SELECT:
     nevents = select(srv->maxfd+1,
                      &fout_rd,
                      &fout_wr,
                      NULL,
-                     &srv->tmo);
+                     &tmo);
 
     if (nevents < 1) {
         if (nevents == -1) {
@@ -207,13 +345,31 @@ orphand_io_iteronce(orphand_server *srv)
                 ERROR("select: %s", strerror(errno));
             }
         }
+        orphand_ring_drain(srv, orphand_now_ms());
         return;
     }
 
-    embht_iterinit(srv->clients, &iter);
-    while (embht_iternext(&iter) && nevents) {
+    if (srv->ring.shm && FD_ISSET(srv->ring.evfd, &fout_rd)) {
+        uint64_t nkicks;
+        nevents--;
+        if (read(srv->ring.evfd, &nkicks, sizeof(nkicks)) == -1 &&
+                errno != EAGAIN) {
+            ERROR("eventfd read: %s", strerror(errno));
+        }
+    }
+
+    /* The ring goes first, so sockets can't overtake it */
+    orphand_ring_drain(srv, orphand_now_ms());
+
+    if (srv->sigfd != -1 && FD_ISSET(srv->sigfd, &fout_rd)) {
+        nevents--;
+        orphand_spawn_reap(srv);
+    }
+
+    orphand_clientht_iterinit(srv->clients, &iter);
+    while (orphand_clientht_iternext(&iter) && nevents) {
 
-        struct orphand_client *cli = embht_iterval(&iter).ptr;
+        struct orphand_client *cli = *embiht_iterval(&iter);
         int cbevents = 0;
         assert(cli);
         DEBUG("Checking fd %d for events", cli->sockfd);
@@ -244,9 +400,8 @@ orphand_io_iteronce(orphand_server *srv)
 
             srv->nsock--;
 
-            close(cli->sockfd);
-            embht_iterdel(&iter);
-            free(cli);
+            orphand_clientht_iterdel(&iter);
+            free_client(srv, cli);
 
             continue;
 
@@ -265,25 +420,33 @@ orphand_io_iteronce(orphand_server *srv)
 
         int newsock;
         struct orphand_client *newcli;
-        embht_entry *newent;
+        orphand_client **newent;
 
         assert(nevents == 1);
         assert(FD_ISSET(srv->sock, &fout_rd));
 
-        newsock = accept(srv->sock, NULL, 0);
+        newsock = accept4(srv->sock, NULL, 0, SOCK_CLOEXEC);
         if (newsock == -1) {
             ERROR("accept: %s", strerror(errno));
             return;
         }
 
-        newcli = calloc(1, sizeof(*newcli));
+        newcli = orphand_slab_alloc(&srv->client_slab);
+        memset(newcli, 0, sizeof(*newcli));
         newcli->rcvbuf.total = sizeof(newcli->rcvbuf.buf);
         newcli->sndbuf.total = sizeof(newcli->sndbuf.buf);
+        newcli->sockfd = newsock;
+
+        if (orphand_pidns_attach(srv, newcli) == -1) {
+            close(newsock);
+            orphand_slab_free(&srv->client_slab, newcli);
+            return;
+        }
 
-        newent = embht_fetchi(srv->clients, newsock, 1);
+        newent = orphand_clientht_fetch(srv->clients, newsock, 1);
         assert(newent);
         newcli->sockfd = newsock;
-        newent->u_value.ptr = newcli;
+        *newent = newcli;
         FD_SET(newsock, &srv->fds_rd);
         srv->maxfd = -1;
         srv->nsock++;
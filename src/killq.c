@@ -0,0 +1,337 @@
+#include "orphand_priv.h"
+#include <procstat.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+#ifndef SYS_pidfd_send_signal
+#define SYS_pidfd_send_signal 424
+#endif
+#ifndef SYS_process_mrelease
+#define SYS_process_mrelease 448
+#endif
+
+/** Set if the kernel doesn't know about process_mrelease() */
+static int Have_Mrelease = 1;
+
+/**
+ * pidfds are moved above FD_SETSIZE so that a large number of pending
+ * kills (or spawned children) doesn't push client sockets out of select()'s
+ * range.
+ */
+int
+orphand_pidfd_open(pid_t pid)
+{
+    int fd, highfd;
+
+    fd = syscall(SYS_pidfd_open, pid, 0);
+    if (fd == -1) {
+        return -1;
+    }
+
+    highfd = fcntl(fd, F_DUPFD_CLOEXEC, FD_SETSIZE);
+    close(fd);
+    return highfd;
+}
+
+static int
+victim_signal(orphand_victim *victim, int signum)
+{
+    victim->signum = signum;
+    if (victim->pidfd != -1) {
+        return syscall(SYS_pidfd_send_signal, victim->pidfd, signum, NULL, 0);
+    }
+    return kill(victim->pid, signum);
+}
+
+/**
+ * Check whether the victim has exited. With a pidfd this is exact, otherwise
+ * the start time is compared to detect PID reuse.
+ */
+static int
+victim_gone(orphand_victim *victim)
+{
+    struct procstat pstb;
+
+    if (victim->pidfd != -1) {
+        struct pollfd pfd;
+        pfd.fd = victim->pidfd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        return poll(&pfd, 1, 0) == 1;
+    }
+
+    if (procstat(victim->pid, &pstb) != 0) {
+        return 1;
+    }
+    return pstb.pst_starttime != victim->starttime || pstb.pst_state == 'Z';
+}
+
+/**
+ * Called once SIGKILL has been sent. Rather than waiting for the victim to
+ * tear down its own address space, have the kernel release its memory now.
+ */
+static void
+victim_reclaim(orphand_server *srv, orphand_victim *victim)
+{
+    uint64_t nbytes;
+
+    if (victim->pidfd == -1 || !Have_Mrelease) {
+        return;
+    }
+
+    if (syscall(SYS_process_mrelease, victim->pidfd, 0) != 0) {
+        if (errno == ENOSYS) {
+            INFO("process_mrelease not supported. Not reclaiming memory");
+            Have_Mrelease = 0;
+        } else {
+            DEBUG("process_mrelease(%d): %s", victim->pid, strerror(errno));
+        }
+        return;
+    }
+
+    nbytes = (uint64_t)victim->rss * sysconf(_SC_PAGESIZE);
+    srv->reclaimed_bytes += nbytes;
+    srv->nreclaimed++;
+    INFO("Reclaimed %llu bytes from %d",
+         (unsigned long long)nbytes, victim->pid);
+}
+
+static void
+victim_free(orphand_server *srv, orphand_victim *victim)
+{
+    if (victim->pidfd != -1) {
+        close(victim->pidfd);
+    }
+    orphand_slab_free(&srv->victim_slab, victim);
+}
+
+/**
+ * Victims with the most resident memory go first, then those which have
+ * used the most CPU.
+ */
+static int
+victim_before(const orphand_victim *a, const orphand_victim *b)
+{
+    if (a->rss != b->rss) {
+        return a->rss > b->rss;
+    }
+    return a->utime > b->utime;
+}
+
+static void
+heap_swap(orphand_killq *kq, size_t a, size_t b)
+{
+    orphand_victim *tmp = kq->heap[a];
+    kq->heap[a] = kq->heap[b];
+    kq->heap[b] = tmp;
+}
+
+void
+orphand_killq_reserve(orphand_server *srv, size_t count)
+{
+    orphand_killq *kq = &srv->killq;
+
+    if (count > kq->capacity) {
+        kq->capacity = count;
+        kq->heap = realloc(kq->heap, kq->capacity * sizeof(*kq->heap));
+    }
+}
+
+void
+orphand_killq_push(orphand_server *srv, const orphand_victim *victim)
+{
+    orphand_killq *kq = &srv->killq;
+    size_t pos;
+
+    if (kq->nheap == kq->capacity) {
+        orphand_killq_reserve(srv, kq->capacity ? kq->capacity * 2 : 64);
+    }
+
+    pos = kq->nheap++;
+    kq->heap[pos] = orphand_slab_alloc(&srv->victim_slab);
+    *kq->heap[pos] = *victim;
+    kq->heap[pos]->nchecks = 0;
+    kq->heap[pos]->timer.next = kq->heap[pos]->timer.prev = NULL;
+
+    while (pos) {
+        size_t parent = (pos - 1) / 2;
+        if (!victim_before(kq->heap[pos], kq->heap[parent])) {
+            break;
+        }
+        heap_swap(kq, pos, parent);
+        pos = parent;
+    }
+}
+
+static orphand_victim *
+killq_pop(orphand_killq *kq)
+{
+    orphand_victim *ret;
+    size_t pos = 0;
+
+    if (!kq->nheap) {
+        return NULL;
+    }
+
+    ret = kq->heap[0];
+    kq->heap[0] = kq->heap[--kq->nheap];
+
+    while (1) {
+        size_t best = pos, left = pos * 2 + 1, right = left + 1;
+
+        if (left < kq->nheap && victim_before(kq->heap[left], kq->heap[best])) {
+            best = left;
+        }
+        if (right < kq->nheap && victim_before(kq->heap[right], kq->heap[best])) {
+            best = right;
+        }
+        if (best == pos) {
+            break;
+        }
+        heap_swap(kq, pos, best);
+        pos = best;
+    }
+    return ret;
+}
+
+static void
+escalate(orphand_timer *timer, void *arg)
+{
+    orphand_server *srv = arg;
+    orphand_victim *victim =
+            orphand_container_of(timer, orphand_victim, timer);
+    uint64_t next = ORPHAND_KILL_CHECK_MS;
+
+    if (victim_gone(victim)) {
+        DEBUG("Confirmed %d has exited", victim->pid);
+        victim_free(srv, victim);
+        return;
+    }
+
+    if (victim->signum != SIGKILL) {
+        INFO("%d survived signal %d for %ums. Sending SIGKILL",
+             victim->pid, victim->signum, victim->grace_ms);
+
+        if (victim_signal(victim, SIGKILL) != 0) {
+            WARN("SIGKILL(%d): %s", victim->pid, strerror(errno));
+            victim_free(srv, victim);
+            return;
+        }
+        srv->stats.sigkills++;
+        victim_reclaim(srv, victim);
+
+    } else if (++victim->nchecks >= ORPHAND_KILL_MAX_CHECKS) {
+        WARN("%d still alive after SIGKILL. Giving up", victim->pid);
+        victim_free(srv, victim);
+        return;
+    }
+
+    orphand_wheel_add(&srv->timers, &victim->timer, orphand_now_ms() + next);
+}
+
+/**
+ * Signal the victim. Unless escalation is disabled, the victim is kept
+ * around on the timer wheel until it is confirmed dead. Returns true if
+ * the victim is still in use.
+ */
+static int
+deliver(orphand_server *srv, orphand_victim *victim)
+{
+    struct procstat pstb;
+
+    if (victim->pidfd != -1) {
+        if (victim_gone(victim)) {
+            DEBUG("Victim %d went away by itself", victim->pid);
+            return 0;
+        }
+        goto GT_SIGNAL;
+    }
+
+    /**
+     * The pidfd is opened before re-checking the start time so that if
+     * the check passes, the pidfd refers to the right process.
+     */
+    victim->pidfd = orphand_pidfd_open(victim->pid);
+
+    /**
+     * The victim may have sat in the queue for a while, so make sure the
+     * PID hasn't been recycled in the meantime.
+     */
+    if (procstat(victim->pid, &pstb) != 0) {
+        DEBUG("Victim %d went away by itself", victim->pid);
+        return 0;
+    }
+
+    if (pstb.pst_starttime != victim->starttime) {
+        INFO("PID %d found but start times differ", victim->pid);
+        srv->stats.starttime_mismatches++;
+        return 0;
+    }
+
+    GT_SIGNAL:
+
+    if (victim->reason == ORPHAND_KILL_DEADLINE) {
+        INFO("Deadline expired: Killing %d (parent=%d, rss=%ld)",
+             victim->pid, victim->parent, victim->rss);
+    } else {
+        INFO("Dead parent %d: Killing %d (rss=%ld)",
+             victim->parent, victim->pid, victim->rss);
+    }
+
+    if (victim_signal(victim, srv->default_signum) != 0) {
+        WARN("kill(%d): %s", victim->pid, strerror(errno));
+        return 0;
+    }
+    srv->stats.kills++;
+
+    if (victim->signum == SIGKILL) {
+        victim_reclaim(srv, victim);
+    }
+
+    if (!victim->grace_ms) {
+        return 0;
+    }
+
+    victim->timer.callback = escalate;
+    orphand_wheel_add(&srv->timers, &victim->timer,
+                      orphand_now_ms() + victim->grace_ms);
+    return 1;
+}
+
+long
+orphand_killq_run(orphand_server *srv, uint64_t now)
+{
+    orphand_killq *kq = &srv->killq;
+
+    if (srv->kill_rate) {
+        kq->tokens += (double)(now - kq->last_refill) * srv->kill_rate / 1000;
+        if (kq->tokens > srv->kill_burst) {
+            kq->tokens = srv->kill_burst;
+        }
+    }
+    kq->last_refill = now;
+
+    while (kq->nheap) {
+        orphand_victim *victim;
+
+        if (srv->kill_rate) {
+            if (kq->tokens < 1) {
+                return (long)((1 - kq->tokens) * 1000 / srv->kill_rate) + 1;
+            }
+            kq->tokens--;
+        }
+
+        victim = killq_pop(kq);
+        if (!deliver(srv, victim)) {
+            victim_free(srv, victim);
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,801 @@
+/**
+ * Client library for the orphand protocol; see liborphand.h
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif /* __linux__ */
+
+#include "liborphand.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#define CONN_BUF_SIZE 16384
+
+/** PINGs awaiting a reply. Older ones are forgotten */
+#define CONN_MAX_PINGS 16
+
+struct conn_ping {
+    uint32_t cookie;
+    uint64_t sent_us;
+};
+
+struct orphand_conn {
+    int fd;
+    int flags;
+    /** errno of a fatal error; the connection is unusable */
+    int error;
+
+    unsigned int max_msgs;
+    unsigned int max_delay_ms;
+
+    /** unwritten data is obuf[osent..oused] */
+    char obuf[CONN_BUF_SIZE];
+    size_t oused;
+    size_t osent;
+    size_t npending;
+    /** when the oldest pending message was queued */
+    uint64_t first_us;
+    /** write the buffer out without waiting for the batch (for PINGs) */
+    int urgent;
+
+    char ibuf[CONN_BUF_SIZE];
+    size_t iused;
+
+    struct conn_ping pings[CONN_MAX_PINGS];
+    unsigned int npings;
+    uint32_t next_cookie;
+    orphand_ping_callback ping_cb;
+    void *ping_arg;
+
+    /** set up by orphand_conn_ping, to find its own reply */
+    uint32_t wait_cookie;
+    int wait_done;
+    uint64_t wait_rtt;
+
+    /** the outcome of orphand_conn_spawn. Replies to requests which timed
+     * out are skipped */
+    int spawn_done;
+    pid_t spawn_pid;
+    int spawn_error;
+    unsigned int spawn_skip;
+
+    /** where orphand_conn_stats wants its reply, NULL once it has come */
+    orphand_stats *stats_out;
+    int stats_done;
+    unsigned int stats_skip;
+};
+
+static uint64_t
+now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+LIBORPHAND_API
+orphand_conn *
+orphand_conn_new(const char *path, int flags)
+{
+    struct sockaddr_un saddr;
+    orphand_conn *conn;
+    int err;
+
+    if (!path && (path = getenv("ORPHAND_SOCKET")) == NULL) {
+        path = ORPHAND_DEFAULT_PATH;
+    }
+    if (strlen(path) >= sizeof(saddr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+
+    if ( (conn = calloc(1, sizeof(*conn))) == NULL) {
+        return NULL;
+    }
+    conn->flags = flags;
+    conn->max_msgs = ORPHAND_CONN_DEFAULT_BATCH;
+    conn->max_delay_ms = ORPHAND_CONN_DEFAULT_DELAY_MS;
+    conn->next_cookie = 1;
+
+    conn->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC |
+                      ((flags & ORPHAND_CONN_NONBLOCK) ? SOCK_NONBLOCK : 0),
+                      0);
+    if (conn->fd == -1) {
+        goto GT_ERR;
+    }
+
+    memset(&saddr, 0, sizeof(saddr));
+    saddr.sun_family = AF_UNIX;
+    strcpy(saddr.sun_path, path);
+
+    /* Local connects complete at once, or fail with EAGAIN if the daemon's
+     * backlog is full */
+    if (connect(conn->fd, (struct sockaddr*)&saddr, sizeof(saddr)) != 0) {
+        goto GT_ERR;
+    }
+    return conn;
+
+    GT_ERR:
+    err = errno;
+    if (conn->fd != -1) {
+        close(conn->fd);
+    }
+    free(conn);
+    errno = err;
+    return NULL;
+}
+
+/**
+ * Write as much of the send buffer as possible. Returns 0 once it's all
+ * written, -1 otherwise. Unless dontwait is set, this blocks until there is
+ * room in the socket.
+ */
+static int
+conn_send(orphand_conn *conn, int dontwait)
+{
+    int flags = MSG_NOSIGNAL;
+
+    if (conn->error) {
+        errno = conn->error;
+        return -1;
+    }
+
+    if (dontwait) {
+        flags |= MSG_DONTWAIT;
+    }
+
+    while (conn->osent < conn->oused) {
+        ssize_t nw = send(conn->fd, conn->obuf + conn->osent,
+                          conn->oused - conn->osent, flags);
+        if (nw > 0) {
+            conn->osent += nw;
+            continue;
+        }
+        if (nw == -1 && errno == EINTR) {
+            continue;
+        }
+        if (nw == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return -1;
+        }
+        conn->error = nw == 0 ? EPIPE : errno;
+        errno = conn->error;
+        return -1;
+    }
+
+    conn->osent = conn->oused = 0;
+    conn->npending = 0;
+    conn->urgent = 0;
+    return 0;
+}
+
+/** Write the send buffer, blocking unless the connection is non-blocking */
+static int
+conn_write(orphand_conn *conn)
+{
+    return conn_send(conn, conn->flags & ORPHAND_CONN_NONBLOCK);
+}
+
+static int
+batch_due(const orphand_conn *conn, uint64_t now)
+{
+    return conn->npending &&
+            (conn->urgent || conn->npending >= conn->max_msgs ||
+             now - conn->first_us >= (uint64_t)conn->max_delay_ms * 1000);
+}
+
+/**
+ * Append a message, making room by writing out the buffer if necessary
+ */
+static int
+conn_append(orphand_conn *conn,
+            uint32_t parent, uint32_t child, uint32_t code,
+            const void *ext, unsigned int next)
+{
+    orphand_message msg;
+    size_t len = sizeof(msg) + next;
+
+    if (conn->error) {
+        errno = conn->error;
+        return -1;
+    }
+
+    if (CONN_BUF_SIZE - conn->oused < len) {
+        if (conn->osent) {
+            memmove(conn->obuf, conn->obuf + conn->osent,
+                    conn->oused - conn->osent);
+            conn->oused -= conn->osent;
+            conn->osent = 0;
+        }
+        if (CONN_BUF_SIZE - conn->oused < len && conn_write(conn) == -1) {
+            return -1;
+        }
+    }
+
+    msg.parent = parent;
+    msg.child = child;
+    msg.action = ORPHAND_ACTION_MAKE(code, next);
+    memcpy(conn->obuf + conn->oused, &msg, sizeof(msg));
+    if (next) {
+        memcpy(conn->obuf + conn->oused + sizeof(msg), ext, next);
+    }
+    conn->oused += len;
+
+    if (!conn->npending++) {
+        conn->first_us = now_us();
+    }
+    return 0;
+}
+
+/**
+ * Append a message, and write the batch if it's due
+ */
+static int
+conn_queue(orphand_conn *conn,
+           uint32_t parent, uint32_t child, uint32_t code,
+           const void *ext, unsigned int next)
+{
+    if (conn_append(conn, parent, child, code, ext, next) == -1) {
+        return -1;
+    }
+
+    if (batch_due(conn, now_us()) && conn_write(conn) == -1 &&
+            conn->error) {
+        return -1;
+    }
+    return 0;
+}
+
+LIBORPHAND_API
+int
+orphand_conn_register(orphand_conn *conn,
+                      pid_t parent,
+                      pid_t child,
+                      const orphand_register_ext *ext)
+{
+    return conn_queue(conn, parent, child, ORPHAND_ACTION_REGISTER,
+                      ext, ext ? sizeof(*ext) : 0);
+}
+
+LIBORPHAND_API
+int
+orphand_conn_unregister(orphand_conn *conn, pid_t parent, pid_t child)
+{
+    return conn_queue(conn, parent, child, ORPHAND_ACTION_UNREGISTER,
+                      NULL, 0);
+}
+
+LIBORPHAND_API
+int
+orphand_conn_flush(orphand_conn *conn)
+{
+    return conn_write(conn);
+}
+
+/**
+ * Queue a PING, writing it out right away if flush is set. Otherwise it's
+ * up to the caller to write it.
+ */
+static int
+ping_queue(orphand_conn *conn, uint32_t *cookie, int flush)
+{
+    struct conn_ping *ping;
+
+    if (conn->npings == CONN_MAX_PINGS) {
+        memmove(conn->pings, conn->pings + 1,
+                sizeof(conn->pings) - sizeof(conn->pings[0]));
+        conn->npings--;
+    }
+
+    ping = conn->pings + conn->npings;
+    ping->cookie = conn->next_cookie++;
+    ping->sent_us = now_us();
+
+    if (conn_append(conn, getpid(), ping->cookie, ORPHAND_ACTION_PING,
+                    NULL, 0) == -1) {
+        return -1;
+    }
+
+    /* A probe measures the daemon, not our batching */
+    conn->urgent = 1;
+    conn->npings++;
+    if (cookie) {
+        *cookie = ping->cookie;
+    }
+
+    if (flush && conn_write(conn) == -1 && conn->error) {
+        return -1;
+    }
+    return 0;
+}
+
+LIBORPHAND_API
+int
+orphand_conn_ping_send(orphand_conn *conn, uint32_t *cookie)
+{
+    return ping_queue(conn, cookie, 1);
+}
+
+static void
+handle_reply(orphand_conn *conn,
+             const orphand_message *msg,
+             const void *ext,
+             unsigned int next)
+{
+    unsigned int ii;
+    uint64_t rtt;
+
+    if (ORPHAND_ACTION_CODE(msg->action) == ORPHAND_ACTION_SPAWN) {
+        orphand_spawn_reply spreply;
+
+        if (conn->spawn_skip) {
+            conn->spawn_skip--;
+            return;
+        }
+
+        memset(&spreply, 0, sizeof(spreply));
+        memcpy(&spreply, ext,
+               next < sizeof(spreply) ? next : sizeof(spreply));
+        conn->spawn_done = 1;
+        conn->spawn_pid = msg->child;
+        conn->spawn_error = spreply.error;
+        return;
+    }
+
+    if (ORPHAND_ACTION_CODE(msg->action) == ORPHAND_ACTION_STATS) {
+        if (conn->stats_skip) {
+            conn->stats_skip--;
+            return;
+        }
+        if (!conn->stats_out) {
+            return;
+        }
+
+        /* Older daemons send less, newer ones more */
+        memset(conn->stats_out, 0, sizeof(*conn->stats_out));
+        memcpy(conn->stats_out, ext,
+               next < sizeof(orphand_stats) ? next : sizeof(orphand_stats));
+        conn->stats_done = 1;
+        return;
+    }
+
+    if (ORPHAND_ACTION_CODE(msg->action) != ORPHAND_ACTION_PING) {
+        return;
+    }
+
+    for (ii = 0; ii < conn->npings; ii++) {
+        if (conn->pings[ii].cookie == msg->child) {
+            break;
+        }
+    }
+    if (ii == conn->npings) {
+        return;
+    }
+
+    rtt = now_us() - conn->pings[ii].sent_us;
+    conn->npings--;
+    memmove(conn->pings + ii, conn->pings + ii + 1,
+            (conn->npings - ii) * sizeof(conn->pings[0]));
+
+    if (msg->child == conn->wait_cookie) {
+        conn->wait_done = 1;
+        conn->wait_rtt = rtt;
+    }
+    if (conn->ping_cb) {
+        conn->ping_cb(conn, msg->child, rtt, conn->ping_arg);
+    }
+}
+
+/**
+ * Read whatever replies are available, without blocking
+ */
+static int
+conn_read(orphand_conn *conn)
+{
+    size_t pos = 0;
+
+    while (conn->iused < sizeof(conn->ibuf)) {
+        ssize_t nr = recv(conn->fd, conn->ibuf + conn->iused,
+                          sizeof(conn->ibuf) - conn->iused, MSG_DONTWAIT);
+        if (nr > 0) {
+            conn->iused += nr;
+            continue;
+        }
+        if (nr == -1 && errno == EINTR) {
+            continue;
+        }
+        if (nr == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        conn->error = nr == 0 ? EPIPE : errno;
+        break;
+    }
+
+    while (conn->iused - pos >= sizeof(orphand_message)) {
+        orphand_message msg;
+        unsigned int next;
+
+        memcpy(&msg, conn->ibuf + pos, sizeof(msg));
+        next = ORPHAND_ACTION_EXTLEN(msg.action);
+        if (conn->iused - pos < sizeof(msg) + next) {
+            break;
+        }
+
+        handle_reply(conn, &msg, conn->ibuf + pos + sizeof(msg), next);
+        pos += sizeof(msg) + next;
+    }
+
+    if (pos) {
+        conn->iused -= pos;
+        memmove(conn->ibuf, conn->ibuf + pos, conn->iused);
+    }
+
+    if (conn->error) {
+        errno = conn->error;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Block until *done is set by a reply or, if done is NULL, until the send
+ * buffer has been written out. Returns -1 with ETIMEDOUT once the deadline
+ * (in microseconds) has passed. Writes never block, even on a blocking
+ * connection, so the deadline holds.
+ */
+static int
+conn_wait(orphand_conn *conn, uint64_t deadline, const int *done)
+{
+    while (done ? !*done : conn->osent < conn->oused) {
+        struct pollfd pfd;
+        uint64_t now = now_us();
+
+        if (now >= deadline) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+
+        pfd.fd = conn->fd;
+        pfd.events = POLLIN | (conn->osent < conn->oused ? POLLOUT : 0);
+        if (poll(&pfd, 1, (deadline - now + 999) / 1000) == -1 &&
+                errno != EINTR) {
+            return -1;
+        }
+
+        if ((pfd.revents & POLLOUT) && conn_send(conn, 1) == -1 &&
+                conn->error) {
+            return -1;
+        }
+        if ((pfd.revents & (POLLIN|POLLHUP|POLLERR)) &&
+                conn_read(conn) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+LIBORPHAND_API
+int
+orphand_conn_ping(orphand_conn *conn, int timeout_ms, uint64_t *rtt_us)
+{
+    uint64_t deadline = now_us() + (uint64_t)timeout_ms * 1000;
+    uint32_t cookie;
+    int rv;
+
+    /* Make room first, then leave the writing to conn_wait */
+    if (conn_wait(conn, deadline, NULL) == -1 ||
+            ping_queue(conn, &cookie, 0) == -1) {
+        return -1;
+    }
+    conn->wait_cookie = cookie;
+    conn->wait_done = 0;
+
+    rv = conn_wait(conn, deadline, &conn->wait_done);
+    conn->wait_cookie = 0;
+    if (rv == 0 && rtt_us) {
+        *rtt_us = conn->wait_rtt;
+    }
+    return rv;
+}
+
+/**
+ * Send a request in one go, attaching descriptors to its first byte.
+ * Once part of it has gone out, failing to send the rest leaves the stream
+ * broken.
+ */
+static int
+send_request(orphand_conn *conn,
+             const char *buf,
+             size_t len,
+             const int *fds,
+             unsigned int nfds,
+             uint64_t deadline)
+{
+    union {
+        char buf[CMSG_SPACE(ORPHAND_SPAWN_MAX_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } cbuf;
+    size_t sent = 0;
+
+    while (sent < len) {
+        struct msghdr mh;
+        struct iovec iov;
+        struct pollfd pfd;
+        uint64_t now;
+        ssize_t nw;
+
+        iov.iov_base = (char*)buf + sent;
+        iov.iov_len = len - sent;
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = &iov;
+        mh.msg_iovlen = 1;
+
+        if (!sent && nfds) {
+            struct cmsghdr *cmsg;
+            mh.msg_control = cbuf.buf;
+            mh.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+            cmsg = CMSG_FIRSTHDR(&mh);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+            memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+        }
+
+        nw = sendmsg(conn->fd, &mh, MSG_NOSIGNAL|MSG_DONTWAIT);
+        if (nw > 0) {
+            sent += nw;
+            continue;
+        }
+        if (nw == -1 && errno == EINTR) {
+            continue;
+        }
+        if (nw == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            now = now_us();
+            if (now >= deadline) {
+                if (sent) {
+                    conn->error = ETIMEDOUT;
+                }
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            pfd.fd = conn->fd;
+            pfd.events = POLLOUT;
+            poll(&pfd, 1, (deadline - now + 999) / 1000);
+            continue;
+        }
+        conn->error = nw == 0 ? EPIPE : errno;
+        errno = conn->error;
+        return -1;
+    }
+    return 0;
+}
+
+LIBORPHAND_API
+pid_t
+orphand_conn_spawn(orphand_conn *conn,
+                   pid_t parent,
+                   char *const argv[],
+                   char *const envp[],
+                   const int *fds,
+                   unsigned int nfds,
+                   const orphand_register_ext *ext,
+                   int timeout_ms)
+{
+    uint64_t deadline = now_us() + (uint64_t)timeout_ms * 1000;
+    orphand_spawn_ext spext;
+    orphand_message msg;
+    size_t len = sizeof(msg) + sizeof(spext), pos;
+    char *buf;
+    unsigned int ii;
+    int rv;
+
+    if (conn->error) {
+        errno = conn->error;
+        return -1;
+    }
+
+    if (!argv || !argv[0] || nfds > ORPHAND_SPAWN_MAX_FDS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(&spext, 0, sizeof(spext));
+    if (ext) {
+        spext.grace_ms = ext->grace_ms;
+        spext.ttl_sec = ext->ttl_sec;
+    }
+    spext.nfds = nfds;
+
+    for (ii = 0; argv[ii]; ii++, spext.argc++) {
+        len += strlen(argv[ii]) + 1;
+    }
+    for (ii = 0; envp && envp[ii]; ii++, spext.envc++) {
+        len += strlen(envp[ii]) + 1;
+    }
+
+    if (len - sizeof(msg) > ORPHAND_ACTION_MASK) {
+        errno = E2BIG;
+        return -1;
+    }
+
+    if ( (buf = malloc(len)) == NULL) {
+        return -1;
+    }
+
+    msg.parent = parent;
+    msg.child = 0;
+    msg.action = ORPHAND_ACTION_MAKE(ORPHAND_ACTION_SPAWN, len - sizeof(msg));
+    memcpy(buf, &msg, sizeof(msg));
+    memcpy(buf + sizeof(msg), &spext, sizeof(spext));
+    pos = sizeof(msg) + sizeof(spext);
+
+    for (ii = 0; ii < spext.argc; ii++) {
+        size_t slen = strlen(argv[ii]) + 1;
+        memcpy(buf + pos, argv[ii], slen);
+        pos += slen;
+    }
+    for (ii = 0; ii < spext.envc; ii++) {
+        size_t slen = strlen(envp[ii]) + 1;
+        memcpy(buf + pos, envp[ii], slen);
+        pos += slen;
+    }
+
+    /* Registrations queued before this go first */
+    if (conn_wait(conn, deadline, NULL) == -1) {
+        free(buf);
+        return -1;
+    }
+
+    rv = send_request(conn, buf, len, fds, nfds, deadline);
+    free(buf);
+    if (rv == -1) {
+        return -1;
+    }
+
+    conn->spawn_done = 0;
+    if (conn_wait(conn, deadline, &conn->spawn_done) == -1) {
+        if (errno == ETIMEDOUT) {
+            conn->spawn_skip++;
+        }
+        return -1;
+    }
+
+    if (conn->spawn_error) {
+        errno = conn->spawn_error;
+        return -1;
+    }
+    return conn->spawn_pid;
+}
+
+LIBORPHAND_API
+int
+orphand_conn_stats(orphand_conn *conn, orphand_stats *stats, int timeout_ms)
+{
+    uint64_t deadline = now_us() + (uint64_t)timeout_ms * 1000;
+    orphand_message msg;
+
+    if (conn->error) {
+        errno = conn->error;
+        return -1;
+    }
+
+    if (conn_wait(conn, deadline, NULL) == -1) {
+        return -1;
+    }
+
+    msg.parent = 0;
+    msg.child = 0;
+    msg.action = ORPHAND_ACTION_STATS;
+    if (send_request(conn, (const char*)&msg, sizeof(msg), NULL, 0,
+                     deadline) == -1) {
+        return -1;
+    }
+
+    conn->stats_out = stats;
+    conn->stats_done = 0;
+    if (conn_wait(conn, deadline, &conn->stats_done) == -1) {
+        if (errno == ETIMEDOUT) {
+            conn->stats_skip++;
+        }
+        conn->stats_out = NULL;
+        return -1;
+    }
+    conn->stats_out = NULL;
+    return 0;
+}
+
+LIBORPHAND_API
+void
+orphand_conn_set_ping_callback(orphand_conn *conn,
+                               orphand_ping_callback callback,
+                               void *arg)
+{
+    conn->ping_cb = callback;
+    conn->ping_arg = arg;
+}
+
+LIBORPHAND_API
+void
+orphand_conn_set_batch(orphand_conn *conn,
+                       unsigned int max_msgs,
+                       unsigned int max_delay_ms)
+{
+    conn->max_msgs = max_msgs ? max_msgs : 1;
+    conn->max_delay_ms = max_delay_ms;
+}
+
+LIBORPHAND_API
+int
+orphand_conn_fd(const orphand_conn *conn)
+{
+    return conn->fd;
+}
+
+LIBORPHAND_API
+short
+orphand_conn_events(const orphand_conn *conn)
+{
+    short events = 0;
+
+    if (batch_due(conn, now_us())) {
+        events |= POLLOUT;
+    }
+    if (conn->npings) {
+        events |= POLLIN;
+    }
+    return events;
+}
+
+LIBORPHAND_API
+int
+orphand_conn_timeout(const orphand_conn *conn)
+{
+    uint64_t due, now;
+
+    if (!conn->npending) {
+        return -1;
+    }
+
+    now = now_us();
+    if (batch_due(conn, now)) {
+        return 0;
+    }
+    due = conn->first_us + (uint64_t)conn->max_delay_ms * 1000;
+    return (due - now + 999) / 1000;
+}
+
+LIBORPHAND_API
+int
+orphand_conn_process(orphand_conn *conn)
+{
+    if (batch_due(conn, now_us()) && conn_write(conn) == -1 &&
+            conn->error) {
+        return -1;
+    }
+    return conn_read(conn);
+}
+
+LIBORPHAND_API
+size_t
+orphand_conn_pending(const orphand_conn *conn)
+{
+    return conn->npending;
+}
+
+LIBORPHAND_API
+void
+orphand_conn_free(orphand_conn *conn)
+{
+    if (!(conn->flags & ORPHAND_CONN_NONBLOCK)) {
+        conn_write(conn);
+    }
+    close(conn->fd);
+    free(conn);
+}
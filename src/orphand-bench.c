@@ -0,0 +1,445 @@
+/**
+ * Fork storm benchmark for orphand-forkwait.so.
+ *
+ * Starts an orphand on a private socket, then runs the same storm twice,
+ * each time in a fresh worker process: once as is, and once with the
+ * preload. A worker fills its heap up to the requested RSS (fork cost grows
+ * with it), then its threads fork, and optionally exec, at the requested
+ * rate, each waiting for its own children. The time from calling fork() to
+ * it returning in the parent is recorded for every fork, and reported as
+ * percentiles along with throughput and the CPU time orphand used.
+ *
+ *     make bench BENCH_ARGS="-t 8 -r 2000 -m 1024 -e"
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <procstat.h>
+
+#include <contrib/cliopts.h>
+
+/** Set in the environment of workers, to the descriptor for results */
+#define WORKER_ENV "ORPHAND_BENCH_FD"
+
+/** Time allowed for orphand to catch up once a worker is done, in ms */
+#define SETTLE_MS 500
+
+static int Threads = 4;
+static int Rate = 0;
+static int Duration = 5;
+static int Rss_mb = 256;
+static int Do_exec = 0;
+static char *Orphand_path = NULL;
+static char *Preload_path = NULL;
+
+/** What a worker reports back */
+typedef struct {
+    uint64_t nforks;
+    uint64_t nerrors;
+    uint64_t elapsed_us;
+    /** fork() latency percentiles, in microseconds */
+    uint64_t p50, p90, p99, p999, max;
+} bench_result;
+
+typedef struct {
+    pthread_t thr;
+    int rate;
+    uint64_t deadline;
+    /** fork() latencies in nanoseconds */
+    uint64_t *lat;
+    size_t nlat;
+    size_t capacity;
+    uint64_t nerrors;
+} bench_thread;
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+sleep_until(uint64_t when)
+{
+    struct timespec ts;
+    ts.tv_sec = when / 1000000000;
+    ts.tv_nsec = when % 1000000000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static void *
+storm(void *arg)
+{
+    bench_thread *bt = arg;
+    uint64_t start = now_ns(), ii;
+
+    for (ii = 0; ; ii++) {
+        uint64_t t0;
+        pid_t pid;
+
+        if (bt->rate) {
+            sleep_until(start + ii * 1000000000 / bt->rate);
+        }
+
+        t0 = now_ns();
+        if (t0 >= bt->deadline) {
+            break;
+        }
+
+        pid = fork();
+        if (pid == 0) {
+            if (Do_exec) {
+                execl("/bin/true", "true", (char*)NULL);
+            }
+            _exit(0);
+        }
+
+        if (pid == -1) {
+            bt->nerrors++;
+            continue;
+        }
+
+        if (bt->nlat == bt->capacity) {
+            bt->capacity = bt->capacity ? bt->capacity * 2 : 4096;
+            bt->lat = realloc(bt->lat, bt->capacity * sizeof(*bt->lat));
+        }
+        bt->lat[bt->nlat++] = now_ns() - t0;
+
+        while (waitpid(pid, NULL, 0) == -1 && errno == EINTR)
+            ;
+    }
+    return NULL;
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t
+percentile(const uint64_t *sorted, size_t n, double pct)
+{
+    size_t idx;
+
+    if (!n) {
+        return 0;
+    }
+    idx = (size_t)(pct / 100 * (n - 1) + 0.5);
+    return sorted[idx] / 1000;
+}
+
+static int
+run_worker(int fd)
+{
+    bench_thread *threads = calloc(Threads, sizeof(*threads));
+    bench_result res;
+    uint64_t start, *all;
+    size_t nall = 0, ii;
+    char *heap;
+
+    /* Resident, and private to the worker, so every fork copies its page
+     * tables */
+    heap = malloc((size_t)Rss_mb << 20);
+    if (!heap) {
+        perror("malloc");
+        return 1;
+    }
+    memset(heap, 1, (size_t)Rss_mb << 20);
+
+    start = now_ns();
+    for (ii = 0; ii < (size_t)Threads; ii++) {
+        threads[ii].deadline = start + (uint64_t)Duration * 1000000000;
+        threads[ii].rate = Rate / Threads + ((int)ii < Rate % Threads);
+        if (Rate && !threads[ii].rate) {
+            threads[ii].deadline = start;
+        }
+        pthread_create(&threads[ii].thr, NULL, storm, threads + ii);
+    }
+
+    memset(&res, 0, sizeof(res));
+    for (ii = 0; ii < (size_t)Threads; ii++) {
+        pthread_join(threads[ii].thr, NULL);
+        nall += threads[ii].nlat;
+        res.nerrors += threads[ii].nerrors;
+    }
+    res.elapsed_us = (now_ns() - start) / 1000;
+
+    all = malloc((nall ? nall : 1) * sizeof(*all));
+    for (nall = 0, ii = 0; ii < (size_t)Threads; ii++) {
+        memcpy(all + nall, threads[ii].lat,
+               threads[ii].nlat * sizeof(*all));
+        nall += threads[ii].nlat;
+        free(threads[ii].lat);
+    }
+    qsort(all, nall, sizeof(*all), cmp_u64);
+
+    res.nforks = nall;
+    res.p50 = percentile(all, nall, 50);
+    res.p90 = percentile(all, nall, 90);
+    res.p99 = percentile(all, nall, 99);
+    res.p999 = percentile(all, nall, 99.9);
+    res.max = nall ? all[nall - 1] / 1000 : 0;
+
+    if (write(fd, &res, sizeof(res)) != sizeof(res)) {
+        perror("write");
+        return 1;
+    }
+    free(all);
+    free(threads);
+    free(heap);
+    return 0;
+}
+
+/**
+ * CPU time used by a process, in milliseconds
+ */
+static double
+cpu_ms(pid_t pid)
+{
+    struct procstat pstb;
+
+    if (procstat(pid, &pstb) != 0) {
+        return -1;
+    }
+    return (double)(pstb.pst_utime + pstb.pst_stime) * 1000 /
+            sysconf(_SC_CLK_TCK);
+}
+
+static pid_t
+start_orphand(const char *sockpath)
+{
+    struct sockaddr_un saddr;
+    pid_t pid;
+    int ii;
+
+    pid = fork();
+    if (pid == 0) {
+        /**
+         * Logging each message would dominate its CPU time, and children
+         * which exit before they are registered make it complain
+         */
+        int devnull = open("/dev/null", O_WRONLY);
+        if (devnull != -1) {
+            dup2(devnull, STDERR_FILENO);
+        }
+        execl(Orphand_path, "orphand", "-f", sockpath, "-d", "1",
+              (char*)NULL);
+        perror(Orphand_path);
+        _exit(127);
+    }
+    if (pid == -1) {
+        perror("fork");
+        return -1;
+    }
+
+    memset(&saddr, 0, sizeof(saddr));
+    saddr.sun_family = AF_UNIX;
+    strncpy(saddr.sun_path, sockpath, sizeof(saddr.sun_path) - 1);
+
+    for (ii = 0; ii < 200; ii++) {
+        int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        int rv = connect(sock, (struct sockaddr*)&saddr, sizeof(saddr));
+        close(sock);
+        if (rv == 0) {
+            return pid;
+        }
+        if (waitpid(pid, NULL, WNOHANG) == pid) {
+            break;
+        }
+        usleep(10000);
+    }
+
+    fprintf(stderr, "orphand didn't come up on %s\n", sockpath);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+/**
+ * Run one storm in a worker process. Returns -1 if it failed.
+ */
+static int
+run_storm(char **argv,
+          const char *sockpath,
+          const char *preload,
+          pid_t daemon,
+          bench_result *res,
+          double *daemon_ms)
+{
+    double cpu_before = cpu_ms(daemon);
+    int fds[2], status;
+    ssize_t nr;
+    pid_t pid;
+
+    if (pipe(fds) == -1) {
+        perror("pipe");
+        return -1;
+    }
+
+    pid = fork();
+    if (pid == 0) {
+        char fdstr[16];
+
+        close(fds[0]);
+        snprintf(fdstr, sizeof(fdstr), "%d", fds[1]);
+        setenv(WORKER_ENV, fdstr, 1);
+        setenv("ORPHAND_SOCKET", sockpath, 1);
+        if (preload) {
+            setenv("LD_PRELOAD", preload, 1);
+        } else {
+            unsetenv("LD_PRELOAD");
+        }
+        execv("/proc/self/exe", argv);
+        perror("execv");
+        _exit(127);
+    }
+
+    close(fds[1]);
+    nr = read(fds[0], res, sizeof(*res));
+    close(fds[0]);
+    waitpid(pid, &status, 0);
+
+    if (nr != sizeof(*res) || !WIFEXITED(status) || WEXITSTATUS(status)) {
+        fprintf(stderr, "Worker failed\n");
+        return -1;
+    }
+
+    usleep(SETTLE_MS * 1000);
+    *daemon_ms = cpu_ms(daemon) - cpu_before;
+    return 0;
+}
+
+static void
+print_result(const char *mode, const bench_result *res, double daemon_ms)
+{
+    printf("%-8s %8llu %9.1f %7llu %7llu %7llu %7llu %8llu %10.0f\n",
+           mode,
+           (unsigned long long)res->nforks,
+           res->elapsed_us ? res->nforks * 1e6 / res->elapsed_us : 0,
+           (unsigned long long)res->p50,
+           (unsigned long long)res->p90,
+           (unsigned long long)res->p99,
+           (unsigned long long)res->p999,
+           (unsigned long long)res->max,
+           daemon_ms);
+}
+
+static double
+pct_change(double before, double after)
+{
+    return before ? (after - before) * 100 / before : 0;
+}
+
+int main(int argc, char **argv)
+{
+    bench_result plain, preload;
+    double plain_ms, preload_ms;
+    char sockpath[64];
+    const char *worker_fd;
+    pid_t daemon;
+    int lastidx, rv = 1;
+
+    cliopts_entry entries[] = {
+    { 't', "threads", CLIOPTS_ARGT_INT, &Threads,
+            "Threads forking in the worker" },
+    { 'r', "rate", CLIOPTS_ARGT_INT, &Rate,
+            "Forks per second, across all threads (0 for as fast as possible)" },
+    { 'd', "duration", CLIOPTS_ARGT_INT, &Duration,
+            "Seconds each storm lasts" },
+    { 'm', "rss", CLIOPTS_ARGT_INT, &Rss_mb,
+            "Megabytes of heap the worker touches before forking" },
+    { 'e', "exec", CLIOPTS_ARGT_NONE, &Do_exec,
+            "Have children exec /bin/true rather than exit" },
+    { 'o', "orphand", CLIOPTS_ARGT_STRING, &Orphand_path,
+            "orphand binary to run" },
+    { 'p', "preload", CLIOPTS_ARGT_STRING, &Preload_path,
+            "Path to orphand-forkwait.so" },
+    { 0 }
+    };
+
+    cliopts_parse_options(entries, argc, argv, &lastidx, NULL);
+
+    if (Threads < 1 || Rate < 0 || Duration < 1 || Rss_mb < 0) {
+        fprintf(stderr, "Threads and duration must be >= 1, rate and RSS "
+                "must be >= 0\n");
+        exit(1);
+    }
+
+    if ( (worker_fd = getenv(WORKER_ENV)) ) {
+        return run_worker(atoi(worker_fd));
+    }
+
+    if (!Orphand_path) {
+        Orphand_path = "./orphand";
+    }
+    if (!Preload_path) {
+        Preload_path = "./orphand-forkwait.so";
+    }
+    if (access(Preload_path, R_OK) == -1) {
+        perror(Preload_path);
+        exit(1);
+    }
+
+    /* Children which chdir() would lose a relative path */
+    Preload_path = realpath(Preload_path, NULL);
+
+    snprintf(sockpath, sizeof(sockpath), "/tmp/orphand-bench.%d.sock",
+             (int)getpid());
+    if ( (daemon = start_orphand(sockpath)) == -1) {
+        exit(1);
+    }
+
+    if (Rate) {
+        printf("%d threads, %d forks/s", Threads, Rate);
+    } else {
+        printf("%d threads, unlimited forks/s", Threads);
+    }
+    printf(", %d seconds, %d MB RSS%s\n", Duration, Rss_mb,
+           Do_exec ? ", exec" : "");
+    printf("%-8s %8s %9s %7s %7s %7s %7s %8s %10s\n",
+           "mode", "forks", "forks/s", "p50us", "p90us", "p99us",
+           "p99.9us", "maxus", "daemon-ms");
+
+    if (run_storm(argv, sockpath, NULL, daemon, &plain, &plain_ms) == -1) {
+        goto GT_DONE;
+    }
+    print_result("plain", &plain, plain_ms);
+
+    if (run_storm(argv, sockpath, Preload_path, daemon,
+                  &preload, &preload_ms) == -1) {
+        goto GT_DONE;
+    }
+    print_result("preload", &preload, preload_ms);
+
+    printf("preload overhead: p50 %+.1f%%, p99 %+.1f%%, throughput %+.1f%%\n",
+           pct_change(plain.p50, preload.p50),
+           pct_change(plain.p99, preload.p99),
+           pct_change(plain.nforks * 1e6 / plain.elapsed_us,
+                      preload.nforks * 1e6 / preload.elapsed_us));
+    rv = 0;
+
+    GT_DONE:
+    kill(daemon, SIGTERM);
+    waitpid(daemon, NULL, 0);
+    unlink(sockpath);
+    return rv;
+}
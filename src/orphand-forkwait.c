@@ -11,6 +11,7 @@
 #endif /* __linux__ */
 
 #include "orphand.h"
+#include "orphand_ring.h"
 
 #include <unistd.h>
 #include <sys/socket.h>
@@ -18,9 +19,22 @@
 #include <sys/types.h>
 #include <sys/syscall.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <alloca.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 
 #define PROGNAME "orphand-forkwait.so"
@@ -34,16 +48,198 @@
 static pid_t (*real_wait)(int*);
 static pid_t (*real_waitpid)(pid_t,int*,int);
 static pid_t (*real_fork)(void);
+static int (*real_posix_spawn)(pid_t*, const char*,
+                               const posix_spawn_file_actions_t*,
+                               const posix_spawnattr_t*,
+                               char *const[], char *const[]);
+static int (*real_posix_spawnp)(pid_t*, const char*,
+                                const posix_spawn_file_actions_t*,
+                                const posix_spawnattr_t*,
+                                char *const[], char *const[]);
+static int (*real_clone)(int (*)(void*), void*, int, void*, ...);
+static int (*real_waitid)(idtype_t, id_t, siginfo_t*, int);
+static pid_t (*real_wait3)(int*, int, struct rusage*);
+static pid_t (*real_wait4)(pid_t, int*, int, struct rusage*);
+static void (*real__exit)(int);
+static void (*real__Exit)(int);
+static int (*real_execve)(const char*, char *const[], char *const[]);
+static int (*real_execv)(const char*, char *const[]);
+static int (*real_execvp)(const char*, char *const[]);
+static int (*real_execvpe)(const char*, char *const[], char *const[]);
+static int (*real_fexecve)(int, char *const[], char *const[]);
 
 
 
 
 /**
- * Because of possible thread safety issues, I can't think of any nice
- * way to cache any of this information..
+ * Each process keeps a single connection to the daemon, established on first
+ * use. Only the flush thread (see below) ever uses it.
  */
+static int conn_sock = -1;
 
+/**
+ * The daemon's registration ring, if it handed us one. Mappings are
+ * inherited across fork(), so children use it without connecting at all,
+ * unless they are in a different PID namespace from the process which got
+ * it: their PIDs would mean something else to the daemon. A ring replaced
+ * after a daemon restart is never unmapped, since other threads may still
+ * be appending to it.
+ */
+struct ring_map {
+    orphand_ring *shm;
+    int evfd;
+    /** PID namespace of the process which attached it */
+    uint64_t pidns;
+};
+static struct ring_map *ring_cur;
+
+/** Our PID namespace, see pidns_self */
+static uint64_t self_pidns;
+
+/**
+ * Signal for children to receive from the kernel when their parent dies,
+ * from ORPHAND_PDEATHSIG. 0 (the default) leaves it to the daemon alone.
+ */
+static int pdeath_signum;
+
+/** How long to wait for the daemon to answer ORPHAND_ACTION_RING */
+#define RING_REPLY_TIMEOUT_MS 1000
+
+/** How long to wait for the daemon to answer the PING after a flush */
+#define ACK_TIMEOUT_MS 1000
+
+/**
+ * Messages which can't go through the ring are queued here, and sent by a
+ * background thread, so that neither fork() nor wait() ever block on the
+ * daemon. This is a bounded multi-producer queue where each slot carries
+ * the lap it was last used for, doubled, plus one while it holds a message
+ * (as in the shared ring). A zeroed queue is therefore empty, and costs no
+ * memory until it is used.
+ *
+ * The daemon reads the ring before any socket, so a message which went to
+ * the ring could overtake ones still on their way through the socket. The
+ * ring is therefore only used again once the daemon has acknowledged
+ * everything that was queued (see flush_ack).
+ */
+#define MSGQ_SIZE 4096
+#define MSGQ_BATCH 64
+#define MSGQ_TAG(pos, full) (((pos) / MSGQ_SIZE) << 1 | (full))
+
+struct msgq_slot {
+    uint64_t tag;
+    orphand_message msg;
+};
+
+static struct {
+    uint64_t tail __attribute__((aligned(64)));
+    /** only advanced by the flush thread, once a message is sent */
+    uint64_t head __attribute__((aligned(64)));
+    /** messages before this one have been seen by the daemon */
+    uint64_t acked;
+    struct msgq_slot slots[MSGQ_SIZE];
+} msgq;
+
+static sem_t msgq_pending;
+static int flusher_started;
+/**
+ * The process whose flush thread serves the queue. A vfork() child (or
+ * any other clone() sharing our memory) sees the same queue, but must not
+ * wait for it.
+ */
+static pid_t flusher_pid;
+static int msgq_warned;
+
+/**
+ * How long to wait for the flush thread to make room in a full queue, and
+ * for queued messages to be sent when exiting, in milliseconds
+ */
+#define MSGQ_FULL_TIMEOUT_MS 100
+#define FLUSH_EXIT_TIMEOUT_MS 1000
+
+static int
+msgq_empty(void)
+{
+    return __atomic_load_n(&msgq.head, __ATOMIC_ACQUIRE) ==
+            __atomic_load_n(&msgq.tail, __ATOMIC_ACQUIRE);
+}
+
+/** Whether all queued messages have been acknowledged by the daemon */
+static int
+msgq_acked(void)
+{
+    return __atomic_load_n(&msgq.acked, __ATOMIC_ACQUIRE) ==
+            __atomic_load_n(&msgq.tail, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Returns -1 if the queue is full
+ */
+static int
+msgq_push(uint32_t parent, uint32_t child, uint32_t action)
+{
+    uint64_t pos = __atomic_load_n(&msgq.tail, __ATOMIC_RELAXED);
+    struct msgq_slot *slot;
+
+    while (1) {
+        int64_t diff;
+
+        slot = msgq.slots + (pos & (MSGQ_SIZE - 1));
+        diff = (int64_t)(__atomic_load_n(&slot->tag, __ATOMIC_ACQUIRE) -
+                         MSGQ_TAG(pos, 0));
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&msgq.tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = __atomic_load_n(&msgq.tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->msg.parent = parent;
+    slot->msg.child = child;
+    slot->msg.action = action;
+    __atomic_store_n(&slot->tag, MSGQ_TAG(pos, 1), __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * Reset state in a new child process. The child has no flush thread, and
+ * shares the parent's connection, so it drops both. Whatever the parent
+ * still had queued is the parent's to send. A child which shares the
+ * parent's descriptor table (clone() with CLONE_FILES) must leave the
+ * socket open.
+ */
+static void
+conn_reset(int close_sock)
+{
+    if (conn_sock != -1) {
+        if (close_sock) {
+            close(conn_sock);
+        }
+        conn_sock = -1;
+    }
+    if (!msgq_empty()) {
+        memset(&msgq, 0, sizeof(msgq));
+    }
+    /* The parent's messages don't need to be ordered against ours */
+    msgq.acked = msgq.tail;
+    sem_init(&msgq_pending, 0, 0);
+    flusher_started = 0;
+    flusher_pid = 0;
+    self_pidns = 0;
+}
 
+/** fork() handler */
+static void
+conn_child(void)
+{
+    conn_reset(1);
+}
 
 static void __attribute__((constructor))
 init_real_functions(void)
@@ -74,25 +270,45 @@ init_real_functions(void)
     load_assert(wait);
     load_assert(waitpid);
     load_assert(fork);
+    load_assert(posix_spawn);
+    load_assert(posix_spawnp);
+    load_assert(clone);
+    load_assert(waitid);
+    load_assert(wait3);
+    load_assert(wait4);
+    load_assert(_exit);
+    load_assert(_Exit);
+    load_assert(execve);
+    load_assert(execv);
+    load_assert(execvp);
+    load_assert(execvpe);
+    load_assert(fexecve);
 
 #undef load_assert
+
+    sem_init(&msgq_pending, 0, 0);
+    pthread_atfork(NULL, NULL, conn_child);
+
+    if (getenv("ORPHAND_PDEATHSIG")) {
+        pdeath_signum = atoi(getenv("ORPHAND_PDEATHSIG"));
+        if (pdeath_signum < 1 || pdeath_signum >= NSIG) {
+            fprintf(stderr, "%s: Ignoring invalid ORPHAND_PDEATHSIG\n",
+                    PROGNAME);
+            pdeath_signum = 0;
+        }
+    }
 }
 
-static void
-send_orphand_message(pid_t parent,
-                     pid_t child,
-                     int action)
+static int
+conn_open(void)
 {
-    ssize_t nw, nremaining, wtotal;
-    char buf[12];
-    uint32_t* bufp = (uint32_t*)buf;
     struct sockaddr_un saddr;
     char *sockpath;
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
 
-    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
     if (sock == -1) {
         perror(PROGNAME ": socket");
-        return;
+        return -1;
     }
 
     sockpath = getenv("ORPHAND_SOCKET");
@@ -100,40 +316,567 @@ send_orphand_message(pid_t parent,
         sockpath = ORPHAND_DEFAULT_PATH;
     }
 
+    memset(&saddr, 0, sizeof(saddr));
     saddr.sun_family = AF_UNIX;
-    memcpy(saddr.sun_path, sockpath, strlen(sockpath)+1);
-
-    bufp[0] = parent;
-    bufp[1] = child;
-    bufp[2] = action;
+    strncpy(saddr.sun_path, sockpath, sizeof(saddr.sun_path) - 1);
 
     if (connect(sock, (struct sockaddr*)&saddr, sizeof(saddr)) != 0) {
         fprintf(stderr, "%s: connect: %s\n", PROGNAME, strerror(errno));
-        goto GT_END;
+        close(sock);
+        return -1;
     }
+    return sock;
+}
+
+/**
+ * Returns 0 once the whole buffer is sent, or -1 with errno set. A partial
+ * send leaves the stream unusable, so the caller must then reconnect.
+ */
+static int
+conn_send(int sock, const char *buf, size_t len)
+{
+    ssize_t nw;
 
-    wtotal = 0;
-    nremaining = 12;
-    while (nremaining) {
-        nw = send(sock, buf + wtotal, nremaining, 0);
+    while (len) {
+        /* A daemon restart must not kill the application with SIGPIPE */
+        nw = send(sock, buf, len, MSG_NOSIGNAL);
         if (nw > 0) {
-            nremaining -= nw;
-            wtotal += nw;
+            len -= nw;
+            buf += nw;
+        } else if (nw == -1 && errno == EINTR) {
+            continue;
         } else {
-            if (nw == 0){
-                fprintf(stderr, "%s: Remote closed connection\n", PROGNAME);
-            } else {
-                if (errno == EINTR) {
-                    continue;
-                }
-                fprintf(stderr, "%s: send: %s\n", PROGNAME, strerror(errno));
+            if (nw == 0) {
+                errno = EPIPE;
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * The inode of our PID namespace, or -1 if it can't be found. A process
+ * never changes namespaces (unshare() and setns() only affect its
+ * children), so this is looked up once per process.
+ */
+static uint64_t
+pidns_self(void)
+{
+    uint64_t ino = __atomic_load_n(&self_pidns, __ATOMIC_RELAXED);
+    struct stat st;
+
+    if (!ino) {
+        ino = stat("/proc/self/ns/pid", &st) == 0
+                ? (uint64_t)st.st_ino : (uint64_t)-1;
+        __atomic_store_n(&self_pidns, ino, __ATOMIC_RELAXED);
+    }
+    return ino;
+}
+
+/**
+ * Map a ring from the daemon's descriptors. Returns NULL if it doesn't look
+ * like one.
+ */
+static struct ring_map *
+ring_map_fds(int memfd, int evfd)
+{
+    struct ring_map *rm;
+    struct stat st;
+    orphand_ring *shm;
+
+    if (fstat(memfd, &st) != 0 || st.st_size < (off_t)sizeof(orphand_ring)) {
+        return NULL;
+    }
+
+    shm = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (shm == MAP_FAILED) {
+        return NULL;
+    }
+
+    if (shm->magic != ORPHAND_RING_MAGIC ||
+            shm->version != ORPHAND_RING_VERSION ||
+            shm->hdrsize != sizeof(orphand_ring) ||
+            !shm->nslots || (shm->nslots & (shm->nslots - 1)) ||
+            ORPHAND_RING_BYTES(shm->nslots) > (size_t)st.st_size) {
+        munmap(shm, st.st_size);
+        return NULL;
+    }
+
+    if ( (rm = malloc(sizeof(*rm))) == NULL) {
+        munmap(shm, st.st_size);
+        return NULL;
+    }
+    rm->shm = shm;
+    rm->evfd = evfd;
+    rm->pidns = pidns_self();
+    return rm;
+}
+
+/**
+ * Ask the daemon for its ring over a fresh connection. Daemons which don't
+ * have one reply without descriptors; ones which predate the ring don't
+ * reply at all, hence the timeout. The connection stays in use afterwards,
+ * so its previous receive timeout is put back.
+ */
+static void
+ring_attach(int sock)
+{
+    orphand_message msg;
+    struct iovec iov;
+    struct msghdr mh;
+    struct cmsghdr *cmsg;
+    struct timeval tv, tv_save;
+    socklen_t tvlen = sizeof(tv_save);
+    union {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } cbuf;
+    struct ring_map *rm = NULL;
+    int fds[2] = { -1, -1 };
+    ssize_t nr;
+
+    msg.parent = getpid();
+    msg.child = 0;
+    msg.action = ORPHAND_ACTION_RING;
+
+    if (conn_send(sock, (const char*)&msg, sizeof(msg)) != 0) {
+        return;
+    }
+
+    if (getsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv_save, &tvlen) != 0) {
+        memset(&tv_save, 0, sizeof(tv_save));
+    }
+    tv.tv_sec = RING_REPLY_TIMEOUT_MS / 1000;
+    tv.tv_usec = (RING_REPLY_TIMEOUT_MS % 1000) * 1000;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    iov.iov_base = &msg;
+    iov.iov_len = sizeof(msg);
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf.buf;
+    mh.msg_controllen = sizeof(cbuf.buf);
+
+    do {
+        nr = recvmsg(sock, &mh, MSG_WAITALL|MSG_CMSG_CLOEXEC);
+    } while (nr == -1 && errno == EINTR);
+
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv_save, sizeof(tv_save));
+
+    for (cmsg = nr > 0 ? CMSG_FIRSTHDR(&mh) : NULL; cmsg;
+            cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET &&
+                cmsg->cmsg_type == SCM_RIGHTS &&
+                cmsg->cmsg_len == CMSG_LEN(sizeof(fds))) {
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+        }
+    }
+
+    if (nr == sizeof(msg) && fds[0] != -1) {
+        rm = ring_map_fds(fds[0], fds[1]);
+    }
+
+    /* The mapping stays valid without the memfd */
+    if (fds[0] != -1) {
+        close(fds[0]);
+    }
+    if (!rm) {
+        if (fds[1] != -1) {
+            close(fds[1]);
+        }
+        return;
+    }
+    __atomic_store_n(&ring_cur, rm, __ATOMIC_RELEASE);
+}
+
+/**
+ * Send a batch of messages over the connection, (re)connecting as needed.
+ * Messages which can't be sent are dropped, as there is no daemon to
+ * receive them.
+ */
+static void
+flush_batch(const orphand_message *batch, size_t count)
+{
+    int attempt, err;
+
+    for (attempt = 0; attempt < 2; attempt++) {
+        if (conn_sock == -1) {
+            if ( (conn_sock = conn_open()) == -1) {
+                break;
             }
+            ring_attach(conn_sock);
+        }
+        if (conn_send(conn_sock, (const char*)batch,
+                      count * sizeof(*batch)) == 0) {
             break;
         }
+
+        err = errno;
+        close(conn_sock);
+        conn_sock = -1;
+
+        /* The daemon went away since we connected; retry on a new socket */
+        if (err == EPIPE || err == ECONNRESET || err == ENOTCONN) {
+            continue;
+        }
+        fprintf(stderr, "%s: send: %s\n", PROGNAME, strerror(err));
+        break;
+    }
+}
+
+/**
+ * Wait for the daemon to process everything sent over the connection so
+ * far. It answers a PING only after the messages before it. Returns 0 once
+ * the reply is in, or -1 if the connection should be dropped.
+ */
+static int
+flush_ack(void)
+{
+    orphand_message msg;
+    struct pollfd pfd;
+    size_t nread = 0;
+    ssize_t nr;
+    int rv;
+
+    msg.parent = getpid();
+    msg.child = 0;
+    msg.action = ORPHAND_ACTION_PING;
+
+    if (conn_send(conn_sock, (const char*)&msg, sizeof(msg)) != 0) {
+        return -1;
+    }
+
+    pfd.fd = conn_sock;
+    pfd.events = POLLIN;
+
+    while (nread < sizeof(msg)) {
+        do {
+            rv = poll(&pfd, 1, ACK_TIMEOUT_MS);
+        } while (rv == -1 && errno == EINTR);
+        if (rv < 1) {
+            return -1;
+        }
+
+        do {
+            nr = recv(conn_sock, (char*)&msg + nread, sizeof(msg) - nread, 0);
+        } while (nr == -1 && errno == EINTR);
+        if (nr < 1) {
+            return -1;
+        }
+        nread += nr;
+    }
+    return 0;
+}
+
+static void *
+flusher_main(void *arg)
+{
+    orphand_message batch[MSGQ_BATCH];
+
+    while (1) {
+        size_t count = 0;
+        uint64_t head = msgq.head;
+
+        while (sem_wait(&msgq_pending) == -1 && errno == EINTR);
+
+        /* Send everything that's there, not just what we were woken for */
+        while (1) {
+            struct msgq_slot *slot = msgq.slots + ((head + count) &
+                                                   (MSGQ_SIZE - 1));
+            if (count < MSGQ_BATCH &&
+                    __atomic_load_n(&slot->tag, __ATOMIC_ACQUIRE) ==
+                            MSGQ_TAG(head + count, 1)) {
+                batch[count++] = slot->msg;
+                continue;
+            }
+            if (!count) {
+                break;
+            }
+
+            flush_batch(batch, count);
+
+            for (; count; count--, head++) {
+                slot = msgq.slots + (head & (MSGQ_SIZE - 1));
+                __atomic_store_n(&slot->tag, MSGQ_TAG(head + MSGQ_SIZE, 0),
+                                 __ATOMIC_RELEASE);
+            }
+            __atomic_store_n(&msgq.head, head, __ATOMIC_RELEASE);
+        }
+
+        /**
+         * Drained (for now); hand senders back to the ring once the daemon
+         * has caught up. Without a connection, whatever was queued was
+         * dropped, so there is nothing left to wait for. Otherwise, until
+         * an acknowledgement arrives, everything keeps using the socket.
+         */
+        if (head != __atomic_load_n(&msgq.acked, __ATOMIC_RELAXED)) {
+            if (conn_sock == -1 || flush_ack() == 0) {
+                __atomic_store_n(&msgq.acked, head, __ATOMIC_RELEASE);
+            } else {
+                close(conn_sock);
+                conn_sock = -1;
+            }
+        }
+    }
+    return arg;
+}
+
+static void
+flusher_start(void)
+{
+    pthread_t thr;
+    pthread_attr_t attr;
+    sigset_t all, old;
+
+    if (__atomic_exchange_n(&flusher_started, 1, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    __atomic_store_n(&flusher_pid, getpid(), __ATOMIC_RELEASE);
+
+    /* The application's signals are none of our business */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    if (pthread_create(&thr, &attr, flusher_main, NULL) != 0) {
+        fprintf(stderr, "%s: Couldn't start flush thread\n", PROGNAME);
+        __atomic_store_n(&flusher_started, 0, __ATOMIC_RELEASE);
+    }
+
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static void
+send_orphand_message(pid_t parent,
+                     pid_t child,
+                     int action)
+{
+    struct ring_map *rm = __atomic_load_n(&ring_cur, __ATOMIC_ACQUIRE);
+    struct timespec delay = { 0, 1000000 };
+    int waited;
+
+    /**
+     * The fast path; no system calls unless the daemon is asleep. Once
+     * anything is queued, later messages follow it through the socket
+     * until the daemon has seen it, to keep them in order. A ring
+     * inherited from another PID namespace is left alone; the socket
+     * (opened from this namespace) gets our PIDs translated.
+     */
+    if (rm && rm->pidns == pidns_self() && msgq_acked()) {
+        int status = orphand_ring_push(rm->shm, parent, child, action);
+        if (status == ORPHAND_RING_KICK) {
+            uint64_t one = 1;
+            if (write(rm->evfd, &one, sizeof(one)) == -1) {
+                /* The daemon also wakes up on its own; nothing to do */
+            }
+        }
+        if (status != ORPHAND_RING_FAIL) {
+            return;
+        }
+    }
+
+    flusher_start();
+
+    /**
+     * Only a daemon which has fallen this far behind makes us wait, and
+     * then only for a bounded time
+     */
+    for (waited = 0; msgq_push(parent, child, action) == -1; waited++) {
+        if (waited == MSGQ_FULL_TIMEOUT_MS) {
+            if (!__atomic_exchange_n(&msgq_warned, 1, __ATOMIC_RELAXED)) {
+                fprintf(stderr, "%s: Queue full, dropping messages\n",
+                        PROGNAME);
+            }
+            return;
+        }
+        nanosleep(&delay, NULL);
+    }
+
+    sem_post(&msgq_pending);
+}
+
+/**
+ * Wait up to timeout_ms milliseconds for queued messages to be sent.
+ * Returns 0 once the queue is empty, or -1 on timeout. Applications may
+ * look this up with dlsym(RTLD_DEFAULT, ...) to flush at a point of their
+ * choosing.
+ */
+int
+orphand_forkwait_flush(int timeout_ms)
+{
+    struct timespec delay = { 0, 1000000 };
+    int waited;
+
+    for (waited = 0; !msgq_empty(); waited++) {
+        if (waited >= timeout_ms) {
+            return -1;
+        }
+        nanosleep(&delay, NULL);
+    }
+    return 0;
+}
+
+/**
+ * Queued messages would be lost when the process exits or execs, so these
+ * wait for them, up to FLUSH_EXIT_TIMEOUT_MS. Only the process which owns
+ * the queue does; a vfork() child about to exec would otherwise hold up
+ * its suspended parent.
+ */
+static void
+flush_before_exit(void)
+{
+    int errno_save = errno;
+
+    if (__atomic_load_n(&flusher_started, __ATOMIC_ACQUIRE) &&
+            __atomic_load_n(&flusher_pid, __ATOMIC_ACQUIRE) == getpid() &&
+            orphand_forkwait_flush(FLUSH_EXIT_TIMEOUT_MS) == -1) {
+        fprintf(stderr, "%s: Exiting with unsent messages\n", PROGNAME);
+    }
+    errno = errno_save;
+}
+
+static void __attribute__((destructor))
+flush_at_exit(void)
+{
+    flush_before_exit();
+}
+
+void
+_exit(int status)
+{
+    flush_before_exit();
+    real__exit(status);
+    __builtin_unreachable();
+}
+
+void
+_Exit(int status)
+{
+    flush_before_exit();
+    real__Exit(status);
+    __builtin_unreachable();
+}
+
+int
+execve(const char *path, char *const argv[], char *const envp[])
+{
+    flush_before_exit();
+    return real_execve(path, argv, envp);
+}
+
+int
+execv(const char *path, char *const argv[])
+{
+    flush_before_exit();
+    return real_execv(path, argv);
+}
+
+int
+execvp(const char *file, char *const argv[])
+{
+    flush_before_exit();
+    return real_execvp(file, argv);
+}
+
+int
+execvpe(const char *file, char *const argv[], char *const envp[])
+{
+    flush_before_exit();
+    return real_execvpe(file, argv, envp);
+}
+
+int
+fexecve(int fd, char *const argv[], char *const envp[])
+{
+    flush_before_exit();
+    return real_fexecve(fd, argv, envp);
+}
+
+/**
+ * The execl() variants don't go through the functions above inside libc,
+ * so collect their arguments and pass them on ourselves. For execle(),
+ * the environment follows the terminating NULL.
+ */
+#define COLLECT_ARGS(arg0, last, argv, envp) do { \
+    va_list ap; \
+    size_t nargs = 1; \
+    va_start(ap, last); \
+    while (va_arg(ap, char*)) { \
+        nargs++; \
+    } \
+    va_end(ap); \
+    argv = alloca((nargs + 1) * sizeof(char*)); \
+    argv[0] = (char*)(arg0); \
+    va_start(ap, last); \
+    for (nargs = 1; (argv[nargs] = va_arg(ap, char*)); nargs++); \
+    envp = va_arg(ap, char**); \
+    va_end(ap); \
+} while (0)
+
+int
+execl(const char *path, const char *arg, ...)
+{
+    char **argv, **envp;
+    COLLECT_ARGS(arg, arg, argv, envp);
+    (void)envp;
+    return execv(path, argv);
+}
+
+int
+execlp(const char *file, const char *arg, ...)
+{
+    char **argv, **envp;
+    COLLECT_ARGS(arg, arg, argv, envp);
+    (void)envp;
+    return execvp(file, argv);
+}
+
+int
+execle(const char *path, const char *arg, ...)
+{
+    char **argv, **envp;
+    COLLECT_ARGS(arg, arg, argv, envp);
+    return execve(path, argv, envp);
+}
+
+#undef COLLECT_ARGS
+
+/**
+ * Have the kernel signal the (just forked) child as soon as the parent dies.
+ * The parent may already be gone by the time the signal is set up, which
+ * is what the getppid() check catches.
+ *
+ * This is only a fast path; the parent still registers the child. The
+ * kernel clears the setting when the child executes a setuid program, and
+ * fires it when the forking thread (rather than the whole process) exits,
+ * so it's opt-in.
+ */
+static void
+pdeath_setup(pid_t parent)
+{
+    if (prctl(PR_SET_PDEATHSIG, pdeath_signum) != 0) {
+        return;
+    }
+    if (getppid() != parent) {
+        kill(getpid(), pdeath_signum);
+    }
+}
+
+static void
+spawn_common(pid_t parent, pid_t child)
+{
+    int errno_save = errno;
+
+    if (getenv("ORPHAND_DEBUG")) {
+        fprintf(stderr, "== %s == FORK %d => %d\n", PROGNAME, parent, child);
     }
 
-    GT_END:
-    close(sock);
+    send_orphand_message(parent, child, ORPHAND_ACTION_REGISTER);
+    errno = errno_save;
 }
 
 pid_t fork(void)
@@ -144,18 +887,178 @@ pid_t fork(void)
 
     child = real_fork();
     if (child == 0) {
+        if (pdeath_signum) {
+            errno_save = errno;
+            pdeath_setup(self);
+            errno = errno_save;
+        }
         return child;
     }
 
-    errno_save = errno;
+    if (child != -1) {
+        spawn_common(self, child);
+    }
+    return child;
+}
 
-    if (getenv("ORPHAND_DEBUG")) {
-        fprintf(stderr, "== %s == FORK %d => %d\n", PROGNAME, self, child);
+#ifdef __x86_64__
+/**
+ * vfork() can't be wrapped in C: its child runs on the parent's stack until
+ * it execs, so it would return through (and clobber) the wrapper's frame
+ * before the parent got to use it. Like libc's own vfork(), this keeps the
+ * return address in a register across the system call and puts it back on
+ * the stack afterwards, in each process. Only the parent, which resumes
+ * once the child has exec'd or exited, then calls into C to register the
+ * child, saving the PID to return across the call.
+ *
+ * Elsewhere, vfork() is left alone, and its children go unregistered.
+ */
+__attribute__((used)) static pid_t
+vfork_failed(int err)
+{
+    errno = err;
+    return -1;
+}
+
+__attribute__((used)) static void
+vfork_parent(pid_t child)
+{
+    spawn_common(getpid(), child);
+}
+
+#define VFORK_STR(x) VFORK_STR_(x)
+#define VFORK_STR_(x) #x
+
+__asm__(
+    ".text\n"
+    ".globl vfork\n"
+    ".type vfork, @function\n"
+    "vfork:\n"
+    "    popq %rdi\n"
+    "    movl $" VFORK_STR(SYS_vfork) ", %eax\n"
+    "    syscall\n"
+    "    pushq %rdi\n"
+    "    cmpq $-4095, %rax\n"
+    "    jae 1f\n"
+    "    testl %eax, %eax\n"
+    "    jz 2f\n"
+    "    pushq %rax\n"
+    "    movl %eax, %edi\n"
+    "    call vfork_parent\n"
+    "    popq %rax\n"
+    "2:  ret\n"
+    "1:  negl %eax\n"
+    "    movl %eax, %edi\n"
+    "    jmp vfork_failed\n"
+    ".size vfork, .-vfork\n"
+);
+
+#undef VFORK_STR
+#undef VFORK_STR_
+#endif
+
+int
+posix_spawn(pid_t *pid, const char *path,
+            const posix_spawn_file_actions_t *file_actions,
+            const posix_spawnattr_t *attrp,
+            char *const argv[], char *const envp[])
+{
+    pid_t child;
+    int ret = real_posix_spawn(&child, path, file_actions, attrp, argv, envp);
+
+    if (ret == 0) {
+        spawn_common(getpid(), child);
+        if (pid) {
+            *pid = child;
+        }
     }
+    return ret;
+}
 
-    send_orphand_message(self, child, ORPHAND_ACTION_REGISTER);
-    errno = errno_save;
-    return child;
+int
+posix_spawnp(pid_t *pid, const char *file,
+             const posix_spawn_file_actions_t *file_actions,
+             const posix_spawnattr_t *attrp,
+             char *const argv[], char *const envp[])
+{
+    pid_t child;
+    int ret = real_posix_spawnp(&child, file, file_actions, attrp, argv, envp);
+
+    if (ret == 0) {
+        spawn_common(getpid(), child);
+        if (pid) {
+            *pid = child;
+        }
+    }
+    return ret;
+}
+
+struct clone_start {
+    int (*fn)(void*);
+    void *arg;
+    int flags;
+};
+
+/**
+ * Runs in a child created by clone() without CLONE_VM. Unlike fork(),
+ * clone() doesn't run the atfork handlers, so reset the state here. The
+ * child has its own copy of the parent's memory, so 'start' (which lives
+ * on the parent's stack) is still there.
+ *
+ * libc ends the child by exiting only the calling thread once fn returns,
+ * which would leave a flush thread started by the child running (and the
+ * process alive), and skips exit handlers. So flush and end the process
+ * here, as clone(2) documents.
+ */
+static int
+clone_child(void *arg)
+{
+    struct clone_start *start = arg;
+    int status;
+
+    conn_reset(!(start->flags & CLONE_FILES));
+    status = start->fn(start->arg);
+    flush_before_exit();
+    real__exit(status);
+    __builtin_unreachable();
+}
+
+/**
+ * The optional arguments are always passed along; the kernel only looks at
+ * those which the flags ask for.
+ */
+int
+clone(int (*fn)(void*), void *stack, int flags, void *arg, ...)
+{
+    va_list ap;
+    pid_t *parent_tid, *child_tid;
+    void *tls;
+    struct clone_start start;
+    int ret;
+
+    va_start(ap, arg);
+    parent_tid = va_arg(ap, pid_t*);
+    tls = va_arg(ap, void*);
+    child_tid = va_arg(ap, pid_t*);
+    va_end(ap);
+
+    /* Threads and vfork()-like children share our memory, and our state */
+    if (!(flags & (CLONE_VM|CLONE_THREAD))) {
+        start.fn = fn;
+        start.arg = arg;
+        start.flags = flags;
+        fn = clone_child;
+        arg = &start;
+    }
+
+    ret = real_clone(fn, stack, flags, arg, parent_tid, tls, child_tid);
+    if (ret < 1 || (flags & CLONE_THREAD)) {
+        return ret;
+    }
+
+    /* CLONE_PARENT makes it our sibling */
+    spawn_common((flags & CLONE_PARENT) ? getppid() : getpid(), ret);
+    return ret;
 }
 
 static void
@@ -176,6 +1079,18 @@ reap_common(pid_t child)
     errno = errno_save;
 }
 
+/**
+ * Unregister a child returned by one of the wait functions, unless it was
+ * merely stopped or continued
+ */
+static void
+reap_status(pid_t child, int status)
+{
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+        reap_common(child);
+    }
+}
+
 pid_t
 wait(int *status)
 {
@@ -193,14 +1108,76 @@ pid_t
 waitpid(pid_t pid, int *status, int options)
 {
     pid_t ret;
-    ret = real_waitpid(pid, status, options);
+    int lstatus;
+
+    ret = real_waitpid(pid, &lstatus, options);
     if (ret < 1) {
         return ret;
     }
 
-    if (WIFEXITED(*status) == 0 && WIFSIGNALED(*status) == 0) {
+    if (status) {
+        *status = lstatus;
+    }
+    reap_status(ret, lstatus);
+    return ret;
+}
+
+pid_t
+wait3(int *status, int options, struct rusage *rusage)
+{
+    pid_t ret;
+    int lstatus;
+
+    ret = real_wait3(&lstatus, options, rusage);
+    if (ret < 1) {
         return ret;
     }
-    reap_common(ret);
+
+    if (status) {
+        *status = lstatus;
+    }
+    reap_status(ret, lstatus);
+    return ret;
+}
+
+pid_t
+wait4(pid_t pid, int *status, int options, struct rusage *rusage)
+{
+    pid_t ret;
+    int lstatus;
+
+    ret = real_wait4(pid, &lstatus, options, rusage);
+    if (ret < 1) {
+        return ret;
+    }
+
+    if (status) {
+        *status = lstatus;
+    }
+    reap_status(ret, lstatus);
+    return ret;
+}
+
+int
+waitid(idtype_t idtype, id_t id, siginfo_t *infop, int options)
+{
+    siginfo_t linfo;
+    int ret;
+
+    /* With WNOHANG and nothing to report, si_pid is left alone */
+    memset(&linfo, 0, sizeof(linfo));
+    ret = real_waitid(idtype, id, &linfo, options);
+    if (infop) {
+        *infop = linfo;
+    }
+
+    if (ret != 0 || linfo.si_pid == 0 || (options & WNOWAIT)) {
+        return ret;
+    }
+
+    if (linfo.si_code == CLD_EXITED || linfo.si_code == CLD_KILLED ||
+            linfo.si_code == CLD_DUMPED) {
+        reap_common(linfo.si_pid);
+    }
     return ret;
 }
@@ -0,0 +1,228 @@
+/**
+ * Micro-benchmark for the registry's hash table.
+ *
+ * Times the same operations on embiht (which holds registrations) and on
+ * embht (which held them before), keyed like the registry by (parent,
+ * child) and with values the size of a registration. Both tables start at
+ * the daemon's initial size and grow as needed. Each phase is repeated and
+ * the best round is reported, in nanoseconds per operation.
+ *
+ *     make tablebench TABLEBENCH_ARGS="-n 1000000 -r 5"
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <contrib/cliopts.h>
+
+#define EMBHT_API
+#define EMBHT_KEY_SIZE sizeof(uint64_t)
+#define EMBHT_VALUE_SIZE sizeof(bench_value)
+
+#define EMBIHT_API
+
+/** Same size as a registration (orphand_child) */
+typedef struct {
+    uint64_t words[4];
+} bench_value;
+
+#include <contrib/embht.c>
+#include <contrib/embiht.c>
+
+EMBIHT_DECLARE(bench_iht, uint64_t, bench_value)
+EMBIHT_DEFINE(bench_iht, uint64_t, bench_value)
+
+/** Buckets (or slots) tables start with, as in the daemon */
+#define INITIAL_SIZE 4096
+
+/** PIDs are drawn below this, as on 64 bit Linux */
+#define PID_LIMIT (1 << 22)
+
+enum {
+    PHASE_INSERT = 0,
+    PHASE_HIT,
+    PHASE_MISS,
+    PHASE_DELETE,
+    NPHASES
+};
+
+static const char *Phase_names[NPHASES] = {
+    "insert", "lookup", "miss", "delete"
+};
+
+static int Nkeys = 1000000;
+static int Rounds = 3;
+static int Seed = 1;
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Random (parent, child) keys, packed as the registry packs them. The
+ * first half are inserted, the second half are used for misses.
+ */
+static uint64_t *
+make_keys(size_t count)
+{
+    uint64_t *keys = malloc(count * sizeof(*keys));
+    size_t ii;
+
+    srandom(Seed);
+    for (ii = 0; ii < count; ii++) {
+        uint32_t parent = 1 + random() % (PID_LIMIT - 1);
+        uint32_t child = 1 + random() % (PID_LIMIT - 1);
+        keys[ii] = (uint64_t)parent << 32 | child;
+    }
+    return keys;
+}
+
+/** Keeps lookups from being optimized away */
+static volatile uint64_t Sink;
+
+static void
+run_embiht(const uint64_t *keys, size_t n, uint64_t *ns)
+{
+    bench_iht_table *ht = bench_iht_make(INITIAL_SIZE);
+    uint64_t start, sum = 0;
+    size_t ii;
+
+    start = now_ns();
+    for (ii = 0; ii < n; ii++) {
+        bench_iht_fetch(ht, keys[ii], 1)->words[0] = ii;
+    }
+    ns[PHASE_INSERT] = now_ns() - start;
+
+    start = now_ns();
+    for (ii = 0; ii < n; ii++) {
+        sum += bench_iht_fetch(ht, keys[ii], 0)->words[0];
+    }
+    ns[PHASE_HIT] = now_ns() - start;
+
+    start = now_ns();
+    for (ii = 0; ii < n; ii++) {
+        sum += bench_iht_fetch(ht, keys[n + ii], 0) != NULL;
+    }
+    ns[PHASE_MISS] = now_ns() - start;
+
+    start = now_ns();
+    for (ii = 0; ii < n; ii++) {
+        bench_iht_delete(ht, keys[ii]);
+    }
+    ns[PHASE_DELETE] = now_ns() - start;
+
+    Sink = sum;
+    bench_iht_destroy(ht);
+}
+
+static void
+run_embht(const uint64_t *keys, size_t n, uint64_t *ns)
+{
+    embht_table *ht = embht_make(INITIAL_SIZE, EMBHT_F_RESIZE);
+    uint64_t start, sum = 0;
+    uint64_t key;
+    size_t ii;
+
+    start = now_ns();
+    for (ii = 0; ii < n; ii++) {
+        key = keys[ii];
+        *(uint64_t*)embht_fetch(ht, &key, sizeof(key), 1)->u_value.value = ii;
+    }
+    ns[PHASE_INSERT] = now_ns() - start;
+
+    start = now_ns();
+    for (ii = 0; ii < n; ii++) {
+        key = keys[ii];
+        sum += *(uint64_t*)embht_fetch(ht, &key, sizeof(key), 0)->
+                u_value.value;
+    }
+    ns[PHASE_HIT] = now_ns() - start;
+
+    start = now_ns();
+    for (ii = 0; ii < n; ii++) {
+        key = keys[n + ii];
+        sum += embht_fetch(ht, &key, sizeof(key), 0) != NULL;
+    }
+    ns[PHASE_MISS] = now_ns() - start;
+
+    start = now_ns();
+    for (ii = 0; ii < n; ii++) {
+        key = keys[ii];
+        embht_delete(ht, &key, sizeof(key));
+    }
+    ns[PHASE_DELETE] = now_ns() - start;
+
+    Sink = sum;
+    embht_destroy(ht);
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t iht_best[NPHASES], ht_best[NPHASES], ns[NPHASES];
+    uint64_t *keys;
+    int lastidx, round, phase;
+
+    cliopts_entry entries[] = {
+    { 'n', "keys", CLIOPTS_ARGT_INT, &Nkeys,
+            "Keys inserted into each table" },
+    { 'r', "rounds", CLIOPTS_ARGT_INT, &Rounds,
+            "Times each table is benchmarked; the best round counts" },
+    { 's', "seed", CLIOPTS_ARGT_INT, &Seed,
+            "Seed for the random keys" },
+    { 0 }
+    };
+
+    cliopts_parse_options(entries, argc, argv, &lastidx, NULL);
+
+    if (Nkeys < 1 || Rounds < 1) {
+        fprintf(stderr, "Keys and rounds must be >= 1\n");
+        exit(1);
+    }
+
+    keys = make_keys((size_t)Nkeys * 2);
+
+    for (phase = 0; phase < NPHASES; phase++) {
+        iht_best[phase] = ht_best[phase] = UINT64_MAX;
+    }
+
+    for (round = 0; round < Rounds; round++) {
+        run_embiht(keys, Nkeys, ns);
+        for (phase = 0; phase < NPHASES; phase++) {
+            if (ns[phase] < iht_best[phase]) {
+                iht_best[phase] = ns[phase];
+            }
+        }
+
+        run_embht(keys, Nkeys, ns);
+        for (phase = 0; phase < NPHASES; phase++) {
+            if (ns[phase] < ht_best[phase]) {
+                ht_best[phase] = ns[phase];
+            }
+        }
+    }
+
+    printf("%d random (parent, child) keys, best of %d rounds\n",
+           Nkeys, Rounds);
+    printf("%-8s %10s %10s %8s\n",
+           "phase", "embht-ns", "embiht-ns", "speedup");
+
+    for (phase = 0; phase < NPHASES; phase++) {
+        printf("%-8s %10.1f %10.1f %7.2fx\n",
+               Phase_names[phase],
+               (double)ht_best[phase] / Nkeys,
+               (double)iht_best[phase] / Nkeys,
+               (double)ht_best[phase] / iht_best[phase]);
+    }
+
+    free(keys);
+    return 0;
+}
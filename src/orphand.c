@@ -16,6 +16,8 @@
 #include <procstat.h>
 #include <fcntl.h>
 #include <sys/file.h>
+#include <sys/resource.h>
+#include <malloc.h>
 
 #include <contrib/cliopts.h>
 
@@ -24,60 +26,603 @@ static struct procstat Orphand_pst_dummy;
 static int Orphand_Use_Procfs = 1;
 
 
-#include <contrib/embht.c>
+#include <contrib/embiht.c>
+
+EMBIHT_DEFINE(orphand_childht, uint64_t, orphand_child)
+EMBIHT_DEFINE(orphand_clientht, uint32_t, orphand_client*)
+EMBIHT_DEFINE(orphand_nsht, uint64_t, struct orphand_pidns*)
 
 #define TOPLEVEL_BUCKET_COUNT 4096
-#define CHILD_BUCKET_COUNT 64
+
+#define CHILD_KEY(parent, child) \
+    (((uint64_t)(uint32_t)(parent) << 32) | (uint32_t)(child))
 
 static
 orphand_server Server;
 
-static embht_table *
-get_pid_table(pid_t pid, int create)
+/**
+ * The registry is made up of three tables. Server.children is keyed by
+ * (parent, child) and holds the registration itself. Server.parents is
+ * keyed by the parent and holds the list of its children, which is what the
+ * sweep walks once the parent is dead. Server.owners maps each child back to
+ * its parent. The latter two are indexed directly by PID (see pidmap.c).
+ */
+
+static orphand_parent *
+get_parent(pid_t pid, int create)
+{
+    orphand_parent *prec = orphand_pidmap_fetch(&Server.parents, pid, 0);
+
+    if (prec || !create) {
+        return prec;
+    }
+
+    prec = orphand_pidmap_fetch(&Server.parents, pid, 1);
+    prec->capacity = ORPHAND_PARENT_INLINE;
+    DEBUG("New parent %d", pid);
+    return prec;
+}
+
+static pid_t *
+parent_children(orphand_parent *prec)
+{
+    if (prec->capacity > ORPHAND_PARENT_INLINE) {
+        return prec->u.list;
+    }
+    return prec->u.inl;
+}
+
+static uint32_t
+parent_add_child(orphand_parent *prec, pid_t child)
+{
+    if (prec->nchildren == prec->capacity) {
+        pid_t *list;
+        if (prec->capacity == ORPHAND_PARENT_INLINE) {
+            list = orphand_pool_alloc(prec->capacity * 2 * sizeof(pid_t));
+            if (list) {
+                memcpy(list, prec->u.inl, sizeof(prec->u.inl));
+            }
+        } else {
+            list = orphand_pool_realloc(prec->u.list,
+                                        prec->capacity * sizeof(pid_t),
+                                        prec->capacity * 2 * sizeof(pid_t));
+        }
+        if (!list) {
+            ERROR("Couldn't grow the list of children to %lu",
+                  (unsigned long)prec->capacity * 2);
+            abort();
+        }
+        prec->u.list = list;
+        prec->capacity *= 2;
+    }
+    parent_children(prec)[prec->nchildren] = child;
+    return prec->nchildren++;
+}
+
+/**
+ * Give back most of the list once it is mostly unused, moving it back
+ * inline if it fits.
+ */
+static void
+parent_shrink(orphand_parent *prec)
+{
+    uint32_t capacity = prec->capacity;
+    pid_t *list;
+
+    if (capacity == ORPHAND_PARENT_INLINE ||
+            prec->nchildren * 4 > capacity) {
+        return;
+    }
+
+    list = prec->u.list;
+    if (prec->nchildren <= ORPHAND_PARENT_INLINE) {
+        memcpy(prec->u.inl, list, prec->nchildren * sizeof(pid_t));
+        orphand_pool_free(list, capacity * sizeof(pid_t));
+        prec->capacity = ORPHAND_PARENT_INLINE;
+        return;
+    }
+
+    /* Keep the larger list if it can't be moved */
+    if ( (list = orphand_pool_realloc(list, capacity * sizeof(pid_t),
+                                      capacity / 2 * sizeof(pid_t))) ) {
+        prec->u.list = list;
+        prec->capacity = capacity / 2;
+    }
+}
+
+static void
+parent_free_children(orphand_parent *prec)
+{
+    if (prec->capacity > ORPHAND_PARENT_INLINE) {
+        orphand_pool_free(prec->u.list, prec->capacity * sizeof(pid_t));
+    }
+    prec->nchildren = 0;
+    prec->capacity = ORPHAND_PARENT_INLINE;
+}
+
+/**
+ * Returns the parent the child is registered to, or 0
+ */
+static pid_t
+get_owner(pid_t child)
+{
+    pid_t *owner = orphand_pidmap_fetch(&Server.owners, child, 0);
+    return owner ? *owner : 0;
+}
+
+static orphand_child *
+get_child(pid_t parent, pid_t child)
+{
+    return orphand_childht_fetch(Server.children, CHILD_KEY(parent, child), 0);
+}
+
+/**
+ * Create a registration which doesn't exist yet.
+ */
+static orphand_child *
+new_child(pid_t parent, orphand_parent *prec, pid_t child)
+{
+    orphand_child *rec =
+            orphand_childht_fetch(Server.children, CHILD_KEY(parent, child), 1);
+    rec->index = parent_add_child(prec, child);
+    rec->pidfd = -1;
+    *(pid_t*)orphand_pidmap_fetch(&Server.owners, child, 1) = parent;
+    return rec;
+}
+
+static void
+delete_child_entry(pid_t parent, pid_t child, orphand_child *rec)
+{
+    if (rec->pidfd != -1) {
+        close(rec->pidfd);
+    }
+    orphand_childht_delete(Server.children, CHILD_KEY(parent, child));
+    if (get_owner(child) == parent) {
+        orphand_pidmap_delete(&Server.owners, child);
+        if (Server.namespaces) {
+            orphand_pidns_release(&Server, child);
+        }
+    }
+}
+
+static void
+cancel_deadline(orphand_child *rec)
+{
+    if (rec->deadline) {
+        orphand_wheel_del(&Server.timers, &rec->deadline->timer);
+        orphand_slab_free(&Server.deadline_slab, rec->deadline);
+        rec->deadline = NULL;
+    }
+}
+
+/**
+ * Remove a registration along with its slot in the parent's child list.
+ * The last child in the list takes its place.
+ */
+static void
+remove_child(pid_t parent, orphand_parent *prec, pid_t child)
+{
+    orphand_child *rec = get_child(parent, child);
+    pid_t *list = parent_children(prec);
+    uint32_t index;
+
+    if (!rec) {
+        return;
+    }
+
+    cancel_deadline(rec);
+    index = rec->index;
+    delete_child_entry(parent, child, rec);
+
+    assert(index < prec->nchildren && list[index] == child);
+    if (index != --prec->nchildren) {
+        list[index] = list[prec->nchildren];
+        get_child(parent, list[index])->index = index;
+    }
+    parent_shrink(prec);
+}
+
+/**
+ * Drop a parent's record once its last child is gone. The record must not
+ * be used afterwards.
+ */
+static void
+release_if_empty(pid_t parent, orphand_parent *prec)
+{
+    if (prec->nchildren) {
+        return;
+    }
+    DEBUG("Parent %d has no more children", parent);
+    parent_free_children(prec);
+    orphand_pidmap_delete(&Server.parents, parent);
+}
+
+/**
+ * The victim takes over the registration's pidfd, if any
+ */
+static void
+queue_victim(pid_t parent,
+             pid_t child,
+             orphand_child *rec,
+             const struct procstat *pstb,
+             int reason)
+{
+    orphand_victim victim;
+
+    victim.pid = child;
+    victim.parent = parent;
+    victim.reason = reason;
+    victim.starttime = rec->starttime;
+    victim.rss = pstb->pst_rss;
+    victim.utime = pstb->pst_utime;
+    victim.grace_ms = rec->grace_ms ? rec->grace_ms : Server.grace_ms;
+    victim.pidfd = rec->pidfd;
+    rec->pidfd = -1;
+    orphand_killq_push(&Server, &victim);
+}
+
+/**
+ * Called when a child has outlived its TTL. The deadline may be stale if
+ * the child was unregistered or re-registered in the meantime
+ */
+static void
+deadline_expired(orphand_timer *timer, void *arg)
 {
-    embht_entry *ent;
-    ent = embht_fetchi(Server.ht, pid, create);
-    if (ent) {
-        if (ent->u_value.ptr == NULL) {
-            assert(create);
-            ent->u_value.ptr = embht_make(CHILD_BUCKET_COUNT, 0);
-            DEBUG("Created new bucket %p", ent->u_value.ptr);
+    orphand_deadline *dl = orphand_container_of(timer, orphand_deadline, timer);
+    orphand_parent *prec = get_parent(dl->parent, 0);
+    orphand_child *rec = get_child(dl->parent, dl->child);
+    struct procstat pstb;
+
+    if (!prec || !rec || rec->deadline != dl) {
+        orphand_slab_free(&Server.deadline_slab, dl);
+        return;
+    }
+
+    rec->deadline = NULL;
+
+    if (procstat(dl->child, &pstb) == 0) {
+        if (rec->pidfd != -1 || pstb.pst_starttime == rec->starttime) {
+            queue_victim(dl->parent, dl->child, rec, &pstb,
+                         ORPHAND_KILL_DEADLINE);
         } else {
-            DEBUG("Have bucket=%p, ht=%p", ent, ent->u_value.ptr);
+            INFO("PID %d found but start times differ", dl->child);
+            Server.stats.starttime_mismatches++;
+        }
+    }
+
+    remove_child(dl->parent, prec, dl->child);
+    release_if_empty(dl->parent, prec);
+    orphand_slab_free(&Server.deadline_slab, dl);
+}
+
+/**
+ * Remove a child's registration. The parent is only advisory (it may be
+ * zero); the child is removed from whichever parent it is registered to.
+ */
+static void
+unregister_child(pid_t parent, pid_t child)
+{
+    pid_t owner = get_owner(child);
+    orphand_parent *prec;
+
+    if (!owner || !(prec = get_parent(owner, 0))) {
+        return;
+    }
+
+    if (parent && parent != owner) {
+        DEBUG("%d unregistered by %d, but belongs to %d", child, parent, owner);
+    }
+
+    DEBUG("Unregistering %d", child);
+    remove_child(owner, prec, child);
+    release_if_empty(owner, prec);
+}
+
+/**
+ * Add or update a registration. pidfd is -1 unless we spawned the child,
+ * in which case the start time is irrelevant.
+ */
+static void
+add_child(pid_t parent,
+          pid_t child,
+          uint64_t starttime,
+          int pidfd,
+          const orphand_register_ext *ext)
+{
+    orphand_parent *prec;
+    orphand_child *rec;
+    pid_t owner;
+
+    /**
+     * A child registered again under a different parent (e.g. after a
+     * double fork) belongs to the new one only
+     */
+    owner = get_owner(child);
+    if (owner && owner != parent) {
+        INFO("Moving %d from parent %d to %d", child, owner, parent);
+        unregister_child(owner, child);
+    }
+
+    prec = get_parent(parent, 1);
+    assert(prec);
+
+    if ( (rec = get_child(parent, child)) ) {
+        cancel_deadline(rec);
+    } else {
+        rec = new_child(parent, prec, child);
+    }
+
+    if (pidfd != -1) {
+        if (rec->pidfd != -1) {
+            close(rec->pidfd);
         }
-        return ent->u_value.ptr;
+        rec->pidfd = pidfd;
+    }
+
+    rec->starttime = starttime;
+    rec->grace_ms = ext->grace_ms;
+    rec->flags = 0;
+
+    if (ext->ttl_sec) {
+        rec->deadline = orphand_slab_alloc(&Server.deadline_slab);
+        rec->deadline->parent = parent;
+        rec->deadline->child = child;
+        rec->deadline->timer.next = rec->deadline->timer.prev = NULL;
+        rec->deadline->timer.callback = deadline_expired;
+        orphand_wheel_add(&Server.timers, &rec->deadline->timer,
+                          orphand_now_ms() + (uint64_t)ext->ttl_sec * 1000);
     }
-    return NULL;
 }
 
 static void
-register_child(pid_t parent, pid_t child)
+register_child(pid_t parent, pid_t child, const orphand_register_ext *ext)
 {
-    embht_table *ht = get_pid_table(parent, 1);
-    embht_entry *ent;
     struct procstat pstb;
 
-    assert(ht);
+    if (parent < 1 || parent >= ORPHAND_PID_LIMIT ||
+            child < 1 || child >= ORPHAND_PID_LIMIT) {
+        WARN("Ignoring registration of %d to %d: invalid PID", child, parent);
+        return;
+    }
 
     if ( procstat(child, &pstb) != 0 ) {
         fprintf(stderr, "Orphand: procstat(%d) failed with %d,%d\n",
                 child, pstb.lib_error, pstb.sys_error);
+        Server.stats.procstat_failures++;
         return;
     }
 
-    ent = embht_fetchi(ht, child, 1);
-    *(uint64_t*)(ent->u_value.value) = pstb.pst_starttime;
+    add_child(parent, child, pstb.pst_starttime, -1, ext);
 }
 
+/**
+ * Spawn a child on behalf of a client and register it, replying with its
+ * PID. Without a pidfd, the child is registered like any other.
+ */
 static void
-unregister_child(pid_t parent, pid_t child)
+spawn_child(orphand_server *srv,
+            orphand_client *cli,
+            const orphand_message *msg,
+            const void *ext,
+            unsigned int next)
 {
-    embht_table *ht = get_pid_table(parent, 0);
-    if (!ht) {
+    struct orphand_buffer *ob = &cli->sndbuf;
+    orphand_spawn_reply spreply;
+    orphand_register_ext regext;
+    orphand_message reply;
+    pid_t child;
+    int pidfd;
+
+    spreply.error = orphand_spawn(srv, cli, msg, ext, next, &child, &pidfd);
+
+    if (!spreply.error) {
+        /* The payload is at least an orphand_spawn_ext, which starts with
+         * the same fields */
+        memcpy(&regext, ext, sizeof(regext));
+
+        if (pidfd != -1) {
+            add_child(msg->parent, child, 0, pidfd, &regext);
+        } else {
+            register_child(msg->parent, child, &regext);
+        }
+    }
+
+    if (ob->total - ob->used < sizeof(reply) + sizeof(spreply)) {
+        ERROR("Too little space in send buffer..");
         return;
     }
-    DEBUG("Unregistering %d", child);
-    embht_deletei(ht, child);
+
+    reply.parent = msg->parent;
+    reply.child = child;
+    reply.action = ORPHAND_ACTION_MAKE(ORPHAND_ACTION_SPAWN, sizeof(spreply));
+    memcpy(ob->buf + ob->used, &reply, sizeof(reply));
+    memcpy(ob->buf + ob->used + sizeof(reply), &spreply, sizeof(spreply));
+    ob->used += sizeof(reply) + sizeof(spreply);
+}
+
+static void
+copy_table_stats(orphand_table_stats *dst, const embiht_statistics *src)
+{
+    size_t ii;
+
+    dst->nslots = src->nslots;
+    dst->nitems = src->item_count;
+    dst->ndeleted = src->deleted_count;
+    for (ii = 0; ii < ORPHAND_STATS_NPROBES && ii < EMBIHT_HIST_SIZE; ii++) {
+        dst->probes[ii] = src->probes[ii];
+    }
+    for (ii = 0; ii < ORPHAND_STATS_NGROUPS &&
+            ii < EMBIHT_GROUP_WIDTH + 1; ii++) {
+        dst->occupancy[ii] = src->occupancy[ii];
+    }
+}
+
+/**
+ * Reply to STATS with the counters, and a snapshot of the registry and
+ * the tables. Collecting the table statistics walks each table.
+ */
+static void
+send_stats(orphand_server *srv,
+           orphand_client *cli,
+           const orphand_message *msg)
+{
+    struct orphand_buffer *ob = &cli->sndbuf;
+    orphand_stats *st = &srv->stats;
+    embiht_statistics hstats;
+    orphand_message reply;
+
+    if (ob->total - ob->used < sizeof(reply) + sizeof(*st)) {
+        ERROR("Too little space in send buffer..");
+        return;
+    }
+
+    st->version = ORPHAND_STATS_VERSION;
+    st->size = sizeof(*st);
+    st->uptime_ms = orphand_now_ms() - srv->started_ms;
+    st->registrations = srv->children->nitems;
+    st->parents = orphand_pidmap_count(&srv->parents);
+    st->clients = srv->clients->nitems;
+    st->kills_pending = srv->killq.nheap;
+    st->nreclaimed = srv->nreclaimed;
+    st->reclaimed_bytes = srv->reclaimed_bytes;
+
+    memset(st->tables, 0, sizeof(st->tables));
+    orphand_childht_stat(srv->children, &hstats);
+    copy_table_stats(st->tables + ORPHAND_STATS_TABLE_CHILDREN, &hstats);
+    orphand_clientht_stat(srv->clients, &hstats);
+    copy_table_stats(st->tables + ORPHAND_STATS_TABLE_CLIENTS, &hstats);
+    if (srv->namespaces) {
+        orphand_nsht_stat(srv->namespaces, &hstats);
+        copy_table_stats(st->tables + ORPHAND_STATS_TABLE_NAMESPACES,
+                         &hstats);
+    }
+
+    reply.parent = msg->parent;
+    reply.child = msg->child;
+    reply.action = ORPHAND_ACTION_MAKE(ORPHAND_ACTION_STATS, sizeof(*st));
+    memcpy(ob->buf + ob->used, &reply, sizeof(reply));
+    memcpy(ob->buf + ob->used + sizeof(reply), st, sizeof(*st));
+    ob->used += sizeof(reply) + sizeof(*st);
+}
+
+
+/**
+ * Add the descendants of a parent's children to its table, so they are
+ * killed along with the children once the parent dies. Discovered entries
+ * are pruned here as they exit, since nobody unregisters them. Each process
+ * inspected costs one unit of the budget. Returns 0 if the budget ran out
+ * before the whole tree was inspected.
+ */
+static int
+discover_descendants(pid_t parent, orphand_parent *prec, int *budget)
+{
+    /* Kept around between calls, so they only ever grow */
+    static orphand_pidlist work, found;
+    size_t ii, jj;
+
+    work.npids = 0;
+
+    for (ii = 0; ii < prec->nchildren; ii++) {
+        orphand_pidlist_push(&work, parent_children(prec)[ii]);
+    }
+
+    for (ii = 0; ii < work.npids && *budget > 0; ii++, (*budget)--) {
+        pid_t pid = work.pids[ii];
+        orphand_child *rec = get_child(parent, pid);
+        uint32_t grace_ms;
+        struct procstat pstb;
+
+        if (!rec) {
+            continue;
+        }
+
+        grace_ms = rec->grace_ms;
+
+        if (rec->flags & ORPHAND_CHILD_F_DESCENDANT) {
+            if (procstat(pid, &pstb) != 0 ||
+                    pstb.pst_starttime != rec->starttime) {
+                DEBUG("Descendant %d of %d is gone", pid, parent);
+                remove_child(parent, prec, pid);
+                continue;
+            }
+        }
+
+        found.npids = 0;
+        if (orphand_proc_children(pid, &found) != 0) {
+            continue;
+        }
+
+        for (jj = 0; jj < found.npids; jj++) {
+            pid_t desc = found.pids[jj];
+
+            /* Already registered, either here or to another parent */
+            if (get_owner(desc)) {
+                continue;
+            }
+
+            if (procstat(desc, &pstb) != 0) {
+                continue;
+            }
+
+            DEBUG("Discovered %d (child of %d) for %d", desc, pid, parent);
+
+            rec = new_child(parent, prec, desc);
+            rec->starttime = pstb.pst_starttime;
+            rec->grace_ms = grace_ms;
+            rec->flags = ORPHAND_CHILD_F_DESCENDANT;
+
+            orphand_pidlist_push(&work, desc);
+        }
+    }
+    return ii >= work.npids;
+}
+
+/**
+ * Drop all the registrations of a parent. If 'reap' is set, the parent is
+ * dead and its children are queued to be killed.
+ */
+static void
+release_parent(pid_t parent_pid, orphand_parent *prec, int reap)
+{
+    pid_t *children = parent_children(prec);
+    struct procstat pstb;
+    uint32_t ii;
+
+    for (ii = 0; ii < prec->nchildren; ii++) {
+        pid_t child_pid = children[ii];
+        orphand_child *rec = get_child(parent_pid, child_pid);
+
+        if (!rec) {
+            continue;
+        }
+
+        cancel_deadline(rec);
+
+        if (!reap || child_pid < 1) {
+            goto GT_NEXT;
+        }
+
+        if (procstat(child_pid, &pstb) != 0) {
+            fprintf(stderr, "procstat(%d) (%d,%d)\n",
+                    child_pid, pstb.lib_error, pstb.sys_error);
+            Server.stats.procstat_failures++;
+            goto GT_NEXT;
+        }
+
+        if (rec->pidfd == -1 && pstb.pst_starttime != rec->starttime) {
+            INFO("PID %d found but start times differ", child_pid);
+            Server.stats.starttime_mismatches++;
+            goto GT_NEXT;
+        }
+
+        queue_victim(parent_pid, child_pid, rec, &pstb,
+                     ORPHAND_KILL_ORPHAN);
+
+        GT_NEXT:
+        delete_child_entry(parent_pid, child_pid, rec);
+    }
+
+    parent_free_children(prec);
 }
 
 /**
@@ -88,18 +633,17 @@ unregister_child(pid_t parent, pid_t child)
 static void
 sweep(void)
 {
-    embht_iterator parents_iter;
-    embht_iterinit(Server.ht, &parents_iter);
+    orphand_pidmap_iter parents_iter;
+    int descend_budget = Server.descend_budget;
+    pid_t descend_cursor = Server.descend_cursor;
 
-    while (embht_iternext(&parents_iter)) {
-        embht_table *children_ht;
-        embht_entry *children_hb;
-        embht_iterator child_iter;
-        struct procstat pstb;
+    Server.descend_cursor = 0;
+    orphand_pidmap_iterinit(&Server.parents, &parents_iter);
 
-        children_hb = embht_itercur(&parents_iter);
-        pid_t parent_pid = children_hb->key.u_kdata.kd32;
-        children_ht = children_hb->u_value.ptr;
+    while (orphand_pidmap_iternext(&parents_iter)) {
+        pid_t parent_pid = orphand_pidmap_iterkey(&parents_iter);
+        orphand_parent *prec = orphand_pidmap_iterval(&parents_iter);
+        int reap = 0;
 
         DEBUG("Checking children of %d", parent_pid);
 
@@ -110,6 +654,27 @@ sweep(void)
 
         if (kill(parent_pid, 0) == 0) {
             DEBUG("Parent still alive");
+
+            /**
+             * Parents are visited in PID order. If the budget runs out, the
+             * next sweep starts over with the parent it ran out on (or the
+             * next one up, if that one is gone by then). A parent which
+             * exhausts a whole budget by itself doesn't get another one
+             * straight away, so that it can't starve the others.
+             */
+            if (Server.descendants && parent_pid >= descend_cursor &&
+                    !Server.descend_cursor &&
+                    !discover_descendants(parent_pid, prec,
+                                          &descend_budget)) {
+                Server.descend_cursor = parent_pid == descend_cursor
+                        ? parent_pid + 1 : parent_pid;
+            }
+
+            /* All of its discovered descendants may have exited */
+            if (!prec->nchildren) {
+                parent_free_children(prec);
+                orphand_pidmap_iterdel(&parents_iter);
+            }
             continue;
         } else {
             int old_errno = errno;
@@ -121,56 +686,123 @@ sweep(void)
             }
         }
 
-        embht_iterinit(children_ht, &child_iter);
-        while (embht_iternext(&child_iter)) {
+        reap = 1;
 
-            uint64_t child_start =
-                    *(uint64_t*)(embht_itercur(&child_iter)->u_value.value);
+        GT_CLEAN_PARENT:
+        release_parent(parent_pid, prec, reap);
+        orphand_pidmap_iterdel(&parents_iter);
+    }
+}
 
-            pid_t child_pid = embht_itercur(&child_iter)->key.u_kdata.kd32;
+/**
+ * Our PID for a child registered from another namespace, as long as its
+ * registration is still the one that was made from there. This is how
+ * children are unregistered once they have been reaped, and can no longer
+ * be found in /proc.
+ */
+static pid_t
+nspid_lookup(orphand_pidns *ns, pid_t nspid)
+{
+    orphand_nspid *ent = orphand_pidmap_fetch(&ns->pids, nspid, 0);
+    orphand_child *rec;
+    pid_t owner;
 
-            if (child_pid < 1) {
-                continue;
-            }
+    if (!ent) {
+        return 0;
+    }
 
-            if (procstat(child_pid, &pstb) != 0) {
-                fprintf(stderr, "procstat(%d) (%d,%d)\n",
-                        child_pid, pstb.lib_error, pstb.sys_error);
-                continue;
-            }
+    owner = get_owner(ent->pid);
+    if (owner && (rec = get_child(owner, ent->pid)) &&
+            rec->starttime == ent->starttime) {
+        return ent->pid;
+    }
 
-            if (pstb.pst_starttime != child_start) {
-                INFO("PID %d found but start times differ", child_pid);
-                continue;
-            }
+    orphand_pidmap_delete(&ns->pids, nspid);
+    return 0;
+}
 
-            INFO("Dead parent %d: Killing %d", parent_pid, child_pid);
-            kill(child_pid, Server.default_signum);
-        }
+/**
+ * Handle REGISTER and UNREGISTER from a client in another PID namespace,
+ * by translating the PIDs to ours
+ */
+static void
+process_foreign(orphand_client *cli,
+                const orphand_message *msg,
+                const orphand_register_ext *regext)
+{
+    orphand_pidns *ns = cli->ns;
+    int action = ORPHAND_ACTION_CODE(msg->action);
+    pid_t parent, child;
+    orphand_child *rec;
 
-        GT_CLEAN_PARENT:
-        if (children_ht) {
-            embht_destroy(children_ht);
+    if (msg->child < 1 || msg->child >= ORPHAND_PID_LIMIT) {
+        return;
+    }
+
+    if (action == ORPHAND_ACTION_UNREGISTER) {
+        if ( (child = nspid_lookup(ns, msg->child)) ) {
+            unregister_child(0, child);
         }
-        embht_iterdel(&parents_iter);
+        return;
+    }
+
+    /**
+     * The map isn't used here, as a PID in the namespace may have been
+     * reused before its old registration is gone
+     */
+    parent = orphand_pidns_find(&Server, cli, msg->parent, 0);
+    child = parent ? orphand_pidns_find(&Server, cli, msg->child, parent) : 0;
+
+    if (!child) {
+        WARN("fd=%d Couldn't find %d (parent %d) of namespace %llu",
+             cli->sockfd, msg->child, msg->parent,
+             (unsigned long long)ns->ino);
+        return;
+    }
+
+    DEBUG("Registering %d (%d here) to %d (%d here)",
+          msg->child, child, msg->parent, parent);
+    register_child(parent, child, regext);
+
+    if ( (rec = get_child(parent, child)) ) {
+        orphand_pidns_add(&Server, cli, msg->child, child, rec->starttime);
     }
 }
 
 void
 orphand_process_message(orphand_server *srv,
                         orphand_client *cli,
-                        const orphand_message *msg)
+                        const orphand_message *msg,
+                        const void *ext,
+                        unsigned int next)
 {
+    int action = ORPHAND_ACTION_CODE(msg->action);
+
+    /* Records from the ring have no client */
     INFO("Sock: %d, Action=%d, Parent=%d, Child=%d",
-          cli->sockfd,
-          msg->action,
+          cli ? cli->sockfd : -1,
+          action,
           msg->parent,
           msg->child);
-    if (msg->action == ORPHAND_ACTION_REGISTER) {
-        register_child(msg->parent, msg->child);
-    } else if (msg->action == ORPHAND_ACTION_UNREGISTER) {
-        unregister_child(msg->parent, msg->child);
-    } else if (msg->action == ORPHAND_ACTION_PING) {
+    srv->stats.messages[action < ORPHAND_STATS_NACTIONS ? action : 0]++;
+
+    if (action == ORPHAND_ACTION_REGISTER) {
+        orphand_register_ext regext;
+        memset(&regext, 0, sizeof(regext));
+        memcpy(&regext, ext, next < sizeof(regext) ? next : sizeof(regext));
+        if (cli && cli->ns) {
+            process_foreign(cli, msg, &regext);
+        } else {
+            register_child(msg->parent, msg->child, &regext);
+        }
+
+    } else if (action == ORPHAND_ACTION_UNREGISTER) {
+        if (cli && cli->ns) {
+            process_foreign(cli, msg, NULL);
+        } else {
+            unregister_child(msg->parent, msg->child);
+        }
+    } else if (action == ORPHAND_ACTION_PING) {
 
         uint32_t *reply =
                 (uint32_t*)((char*)cli->sndbuf.buf + cli->sndbuf.used);
@@ -184,6 +816,15 @@ orphand_process_message(orphand_server *srv,
         reply[2] = msg->action;
         cli->sndbuf.used += 12;
 
+    } else if (action == ORPHAND_ACTION_RING) {
+        orphand_ring_share(srv, cli, msg);
+
+    } else if (action == ORPHAND_ACTION_SPAWN) {
+        spawn_child(srv, cli, msg, ext, next);
+
+    } else if (action == ORPHAND_ACTION_STATS) {
+        send_stats(srv, cli, msg);
+
     } else {
         ERROR("Received unknown code %d", msg->action);
         ERROR("A=%d,P=%d,C=%d",
@@ -194,31 +835,128 @@ orphand_process_message(orphand_server *srv,
 }
 
 
+/**
+ * Format a histogram as space separated counts, leaving out trailing zeros
+ */
+static const char *
+format_hist(char *buf, size_t len, const size_t *hist, size_t nhist)
+{
+    size_t ii, used = 0;
+
+    while (nhist > 1 && !hist[nhist - 1]) {
+        nhist--;
+    }
+
+    buf[0] = '\0';
+    for (ii = 0; ii < nhist && used < len; ii++) {
+        used += snprintf(buf + used, len - used, "%s%lu",
+                         ii ? " " : "", (unsigned long)hist[ii]);
+    }
+    return buf;
+}
+
+/**
+ * Log how well the hash spreads the keys of a table. The probe histogram
+ * counts items by how many groups a lookup visits, the occupancy histogram
+ * counts groups by how many items they hold.
+ */
+static void
+log_table_stats(const char *name, const embiht_statistics *stats)
+{
+    char probes[256], occupancy[256];
+
+    DEBUG("%s: %lu items, %lu deleted, %lu slots; probes [%s] groups [%s]",
+          name,
+          (unsigned long)stats->item_count,
+          (unsigned long)stats->deleted_count,
+          (unsigned long)stats->nslots,
+          format_hist(probes, sizeof(probes),
+                      stats->probes, EMBIHT_HIST_SIZE),
+          format_hist(occupancy, sizeof(occupancy),
+                      stats->occupancy, EMBIHT_GROUP_WIDTH + 1));
+}
+
+/**
+ * Set the select() timeout to whichever comes first; the next sweep, the
+ * next pending timer, or the next time the kill scheduler has tokens
+ * available.
+ */
+static void
+schedule_wakeup(uint64_t now, uint64_t next_sweep, long killq_wait)
+{
+    uint64_t wait_ms = next_sweep > now ? next_sweep - now : 0;
+    long timers_wait = orphand_wheel_next(&Server.timers, now);
+
+    if (killq_wait >= 0 && (uint64_t)killq_wait < wait_ms) {
+        wait_ms = killq_wait;
+    }
+    if (timers_wait >= 0 && (uint64_t)timers_wait < wait_ms) {
+        wait_ms = timers_wait;
+    }
+
+    Server.tmo.tv_sec = wait_ms / 1000;
+    Server.tmo.tv_usec = (wait_ms % 1000) * 1000;
+}
+
 static void start_orphand(const char *path,
                           int interval)
 {
-    struct timeval last_sweep;
+    uint64_t now, next_sweep = 0;
 
     if (orphand_io_init(&Server, path) == -1) {
         ERROR("Couldn't setup socket. Exiting");
     }
 
+    if (Server.ring_slots &&
+            orphand_ring_init(&Server, Server.ring_slots) == -1) {
+        WARN("Couldn't set up the registration ring; clients will only "
+             "use sockets");
+    }
+
+    if (Server.pid_namespaces && orphand_pidns_init(&Server) == -1) {
+        WARN("Clients in other PID namespaces will be treated as if they "
+             "were in ours");
+    }
+
+    if (orphand_spawn_init(&Server) == -1) {
+        WARN("Couldn't set up reaping; SPAWN requests will be refused");
+    }
+
 
-    memset(&last_sweep, 0, sizeof(last_sweep));
-    memset(&Server.tmo, 0, sizeof(&Server.tmo));
+    memset(&Server.tmo, 0, sizeof(Server.tmo));
+    Server.started_ms = orphand_now_ms();
+    orphand_wheel_init(&Server.timers, orphand_now_ms());
 
     /* Ignore SIGPIPE */
     signal(SIGPIPE, SIG_IGN);
 
     while (1) {
+        long killq_wait;
+
         orphand_io_iteronce(&Server);
+        now = orphand_now_ms();
+
+        if (now >= next_sweep) {
+            uint64_t sweep_start = orphand_now_us();
 
-        if (!Server.tmo.tv_sec) {
             DEBUG("Time to sweep!");
             sweep();
-            Server.tmo.tv_sec = interval;
-            Server.tmo.tv_usec = 0;
+            next_sweep = now + interval * 1000;
+            Server.stats.sweeps++;
+            Server.stats.last_sweep_us = orphand_now_us() - sweep_start;
+
+            if (Orphand_Loglevel >= LOGLVL_DEBUG) {
+                embiht_statistics stats;
+                orphand_childht_stat(Server.children, &stats);
+                log_table_stats("children", &stats);
+                orphand_clientht_stat(Server.clients, &stats);
+                log_table_stats("clients", &stats);
+            }
         }
+
+        killq_wait = orphand_killq_run(&Server, now);
+        orphand_wheel_run(&Server.timers, now, &Server);
+        schedule_wakeup(now, next_sweep, killq_wait);
     }
 
 }
@@ -227,6 +965,55 @@ int Orphand_Loglevel = LOGLVL_INFO;
 
 static int Orphand_Lockfd;
 
+/**
+ * Pending kills each hold a pidfd, so allow as many descriptors as we can
+ */
+static void
+raise_fd_limit(void)
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) != 0) {
+            WARN("Couldn't raise descriptor limit: %s", strerror(errno));
+        }
+    }
+}
+
+/**
+ * Set up the tables and object caches. With a preallocation count, they
+ * are sized up front so that the daemon doesn't allocate at all until
+ * that many children are registered.
+ */
+static void
+init_memory(size_t count)
+{
+    size_t nitems = count > TOPLEVEL_BUCKET_COUNT
+            ? count : TOPLEVEL_BUCKET_COUNT;
+
+    /**
+     * Large tables are mapped directly so that they are unmapped when they
+     * shrink. Setting the threshold stops glibc from raising it (and moving
+     * such tables onto the heap) after the first one is freed.
+     */
+    mallopt(M_MMAP_THRESHOLD, ORPHAND_MMAP_THRESHOLD);
+
+    orphand_pidmap_init(&Server.parents, sizeof(orphand_parent));
+    orphand_pidmap_init(&Server.owners, sizeof(pid_t));
+    Server.children = orphand_childht_make(nitems);
+    orphand_childht_set_hash(Server.children, Server.hash_mode);
+
+    orphand_slab_init(&Server.victim_slab, sizeof(orphand_victim));
+    orphand_slab_init(&Server.deadline_slab, sizeof(orphand_deadline));
+    orphand_slab_init(&Server.client_slab, sizeof(orphand_client));
+
+    if (count) {
+        orphand_slab_reserve(&Server.victim_slab, count);
+        orphand_slab_reserve(&Server.deadline_slab, count);
+        orphand_killq_reserve(&Server, count);
+    }
+}
+
 int main(int argc, char **argv)
 {
     /**
@@ -236,6 +1023,7 @@ int main(int argc, char **argv)
 
     char *path = NULL;
     char *lockfile = NULL;
+    char *hashname = NULL;
     int lastidx;
 
     cliopts_entry entries[] = {
@@ -250,6 +1038,24 @@ int main(int argc, char **argv)
             "Lockfile to use"},
     { 'S', "signal", CLIOPTS_ARGT_INT, &Server.default_signum,
            "Signal number to send to orphan processes" },
+    { 'r', "kill-rate", CLIOPTS_ARGT_INT, &Server.kill_rate,
+            "Maximum signals sent per second (0 for unlimited)" },
+    { 'b', "kill-burst", CLIOPTS_ARGT_INT, &Server.kill_burst,
+            "Maximum signals sent at once when rate limited" },
+    { 'g', "grace", CLIOPTS_ARGT_INT, &Server.grace_ms,
+            "Milliseconds before escalating to SIGKILL (0 to never)" },
+    { 'D', "descendants", CLIOPTS_ARGT_NONE, &Server.descendants,
+            "Also kill descendants of registered children" },
+    { 0,   "descend-budget", CLIOPTS_ARGT_INT, &Server.descend_budget,
+            "Processes inspected for descendants per sweep" },
+    { 'p', "prealloc", CLIOPTS_ARGT_INT, &Server.prealloc,
+            "Preallocate memory for this many registrations" },
+    { 0,   "hash", CLIOPTS_ARGT_STRING, &hashname,
+            "Hash finalizer for table keys (murmur or mul)" },
+    { 0,   "ring-slots", CLIOPTS_ARGT_INT, &Server.ring_slots,
+            "Slots in the shared registration ring (0 to disable)" },
+    { 'N', "pid-namespaces", CLIOPTS_ARGT_NONE, &Server.pid_namespaces,
+            "Translate PIDs of clients in other PID namespaces" },
     { 0,   "no-procfs", CLIOPTS_ARGT_INT, &Orphand_Use_Procfs,
             "Don't check procfs for timestamps" },
 
@@ -260,6 +1066,11 @@ int main(int argc, char **argv)
 
     Server.default_signum = ORPHAND_DEFAULT_SIGNAL;
     Server.sweep_interval = ORPHAND_DEFAULT_SWEEP_INTERVAL;
+    Server.kill_rate = ORPHAND_DEFAULT_KILL_RATE;
+    Server.kill_burst = ORPHAND_DEFAULT_KILL_BURST;
+    Server.grace_ms = ORPHAND_DEFAULT_GRACE_MS;
+    Server.descend_budget = ORPHAND_DEFAULT_DESCEND_BUDGET;
+    Server.ring_slots = ORPHAND_RING_DEFAULT_SLOTS;
 
     cliopts_parse_options(entries, argc, argv, &lastidx, NULL);
 
@@ -273,13 +1084,44 @@ int main(int argc, char **argv)
         exit(1);
     }
 
+    if (Server.kill_rate < 0 || Server.kill_burst < 1) {
+        fprintf(stderr, "Kill rate must be >= 0 and burst must be >= 1\n");
+        exit(1);
+    }
+
+    if (Server.grace_ms < 0) {
+        fprintf(stderr, "Grace period must be >= 0\n");
+        exit(1);
+    }
+
+    if (!hashname || strcmp(hashname, "murmur") == 0) {
+        Server.hash_mode = EMBIHT_HASH_MURMUR;
+    } else if (strcmp(hashname, "mul") == 0) {
+        Server.hash_mode = EMBIHT_HASH_MUL;
+    } else {
+        fprintf(stderr, "Unknown hash '%s'\n", hashname);
+        exit(1);
+    }
+
+    if (Server.prealloc < 0) {
+        fprintf(stderr, "Preallocation count must be >= 0\n");
+        exit(1);
+    }
+
+    if (Server.ring_slots < 0 ||
+            (Server.ring_slots & (Server.ring_slots - 1))) {
+        fprintf(stderr, "Ring slots must be 0 or a power of two\n");
+        exit(1);
+    }
+
     if (!path) {
         path = ORPHAND_DEFAULT_PATH;
     }
-    Server.ht = embht_make(TOPLEVEL_BUCKET_COUNT, 0);
+    init_memory(Server.prealloc);
+    raise_fd_limit();
 
     if (lockfile) {
-        Orphand_Lockfd = open(lockfile, O_RDWR|O_CREAT, 0644);
+        Orphand_Lockfd = open(lockfile, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
         if (Orphand_Lockfd == -1) {
             perror(lockfile);
             exit(EXIT_FAILURE);
@@ -1,24 +1,168 @@
 #ifndef ORPHAND_PRIV_H_
 #define ORPHAND_PRIV_H_
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #define ORPHAND_HAVE_PROCFS
 #define ORPHAND_BUF_MAX (1<<17)
 #define ORPHAND_BUF_SIZE 4096
 
-#define EMBHT_API
-#define EMBHT_KEY_SIZE sizeof(pid_t)
-#define EMBHT_VALUE_SIZE sizeof(uint64_t)
+/** Default signals per second and burst size for the kill scheduler */
+#define ORPHAND_DEFAULT_KILL_RATE 500
+#define ORPHAND_DEFAULT_KILL_BURST 50
+
+/**
+ * Full scans of /proc per second, and maximum burst, for translating PIDs
+ * from each other PID namespace
+ */
+#define ORPHAND_PIDNS_SCAN_RATE 10
+#define ORPHAND_PIDNS_SCAN_BURST 20
+
+/** Default grace period before escalating to SIGKILL, in milliseconds */
+#define ORPHAND_DEFAULT_GRACE_MS 5000
+/** Interval and count of liveness checks once SIGKILL has been sent */
+#define ORPHAND_KILL_CHECK_MS 500
+#define ORPHAND_KILL_MAX_CHECKS 10
+
+/** Allocations this large bypass malloc's heap, see init_memory */
+#define ORPHAND_MMAP_THRESHOLD (128 * 1024)
+
+/** Default number of processes inspected per sweep for descendants */
+#define ORPHAND_DEFAULT_DESCEND_BUDGET 4096
+
+/**
+ * PIDs never exceed this (PID_MAX_LIMIT on 64 bit Linux). PID keyed maps
+ * split them into top, middle and leaf indexes of these many bits.
+ */
+#define ORPHAND_PID_LIMIT (1 << 22)
+#define ORPHAND_PIDMAP_LEAF_BITS 8
+#define ORPHAND_PIDMAP_MID_BITS 8
+#define ORPHAND_PIDMAP_TOP_SIZE \
+    (ORPHAND_PID_LIMIT >> (ORPHAND_PIDMAP_LEAF_BITS + ORPHAND_PIDMAP_MID_BITS))
+
+/**
+ * How long the daemon waits for a claimed ring slot to be filled in before
+ * skipping it, in milliseconds
+ */
+#define ORPHAND_RING_STALL_MS 1000
 
+/** Timer wheel geometry. This covers about 124 days at 10ms resolution */
+#define ORPHAND_WHEEL_TICK_MS 10
+#define ORPHAND_WHEEL_BITS 6
+#define ORPHAND_WHEEL_SIZE (1 << ORPHAND_WHEEL_BITS)
+#define ORPHAND_WHEEL_LEVELS 5
 
 #include "orphand.h"
+#include "orphand_ring.h"
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <stddef.h>
 #include <sys/select.h>
 #include <sys/types.h>
-#include "contrib/embhash.h"
+#include <time.h>
+
+struct orphand_deadline;
+
+/**
+ * Per-child registration data, stored inline in the registry
+ */
+typedef struct {
+    uint64_t starttime;
+    /** grace period for this child, 0 for the server default */
+    uint32_t grace_ms;
+    uint32_t flags;
+    /** pending TTL timer, if any */
+    struct orphand_deadline *deadline;
+    /** position in the parent's list of children */
+    uint32_t index;
+    /** pidfd for children spawned by orphand itself, otherwise -1. Their
+     * start time isn't known (or needed) */
+    int pidfd;
+} orphand_child;
+
+/** Parents with up to this many children don't need an allocated list */
+#define ORPHAND_PARENT_INLINE 4
+
+/**
+ * Per-parent data; the list of its children
+ */
+typedef struct {
+    uint32_t nchildren;
+    uint32_t capacity;
+    union {
+        pid_t inl[ORPHAND_PARENT_INLINE];
+        pid_t *list;
+    } u;
+} orphand_parent;
+
+enum {
+    /** Found by descendant discovery rather than registered by a client */
+    ORPHAND_CHILD_F_DESCENDANT = 0x1
+};
+
+#define EMBIHT_API
+#define EMBIHT_MALLOC(size) orphand_pool_alloc(size)
+#define EMBIHT_FREE(ptr, size) orphand_pool_free(ptr, size)
+
+#include "contrib/embiht.h"
+
+struct orphand_slab_chunk;
+
+/**
+ * Cache of fixed size objects, carved out of chunks mapped from the system.
+ * Freed objects are kept for reuse, but a chunk whose objects have all been
+ * freed is unmapped once the cache has another chunk's worth to spare.
+ */
+typedef struct {
+    /** chunks with free objects; allocations come from the first one */
+    struct orphand_slab_chunk *partial;
+    size_t objsize;
+    /** objects per chunk, and the size (and alignment) of a chunk */
+    size_t perchunk;
+    size_t chunksize;
+    size_t nused;
+    size_t nfree;
+    size_t nbytes;
+    /** objects kept even when unused, see orphand_slab_reserve */
+    size_t nreserved;
+} orphand_slab;
+
+void
+orphand_slab_init(orphand_slab *slab, size_t objsize);
+
+/**
+ * Make sure at least count objects can be allocated without mapping more
+ * memory, and keep that many around from then on.
+ */
+void
+orphand_slab_reserve(orphand_slab *slab, size_t count);
+
+void *
+orphand_slab_alloc(orphand_slab *slab);
+
+void
+orphand_slab_free(orphand_slab *slab, void *ptr);
+
+/**
+ * Variable sized allocations, served from power-of-two size classes. The
+ * size must be passed back when freeing. Large sizes go straight to malloc.
+ */
+void *
+orphand_pool_alloc(size_t size);
+
+void
+orphand_pool_free(void *ptr, size_t size);
+
+/**
+ * Like realloc(); on failure, NULL is returned and ptr is left alone
+ */
+void *
+orphand_pool_realloc(void *ptr, size_t oldsize, size_t newsize);
 
 
 enum {
@@ -55,18 +199,270 @@ struct orphand_buffer {
     char buf[ORPHAND_BUF_SIZE];
 };
 
+/** Descriptors a client may have sent ahead of the requests using them */
+#define ORPHAND_CLIENT_MAX_FDS 16
+
 typedef struct orphand_client {
     int sockfd;
+    /** descriptors received, in order, until a SPAWN request takes them */
+    int fds[ORPHAND_CLIENT_MAX_FDS];
+    unsigned int nfds;
+    /** a message too large for rcvbuf, while it is being read */
+    char *large;
+    size_t large_size;
+    size_t large_used;
+    /** the client's PID namespace, NULL if it is ours */
+    struct orphand_pidns *ns;
+    /** the peer process as we see it, and in its namespace (if not ours) */
+    pid_t peer_pid;
+    pid_t peer_nspid;
     struct orphand_buffer rcvbuf;
     struct orphand_buffer sndbuf;
 } orphand_client;
 
+/** (parent, child) => orphand_child */
+EMBIHT_DECLARE(orphand_childht, uint64_t, orphand_child)
+/** fd => orphand_client* */
+EMBIHT_DECLARE(orphand_clientht, uint32_t, orphand_client*)
+/** namespace inode => orphand_pidns* */
+EMBIHT_DECLARE(orphand_nsht, uint64_t, struct orphand_pidns*)
+
+#define orphand_container_of(ptr, type, member) \
+    ((type*)((char*)(ptr) - offsetof(type, member)))
+
+typedef struct orphand_timer {
+    struct orphand_timer *next;
+    struct orphand_timer *prev;
+    /** expiry, in ticks */
+    uint64_t expires;
+    void (*callback)(struct orphand_timer *timer, void *arg);
+} orphand_timer;
+
+#define orphand_timer_pending(timer) ((timer)->next != NULL)
+
+typedef struct {
+    /** list heads for each slot */
+    orphand_timer slots[ORPHAND_WHEEL_LEVELS][ORPHAND_WHEEL_SIZE];
+    /** the next tick to be processed */
+    uint64_t current;
+    size_t count;
+} orphand_wheel;
+
+/**
+ * Timer for a child registered with a TTL. This refers to the registration
+ * by PID rather than by pointer, as child entries move around.
+ */
+typedef struct orphand_deadline {
+    orphand_timer timer;
+    pid_t parent;
+    pid_t child;
+} orphand_deadline;
+
+/**
+ * Map from PID to a fixed size value, see pidmap.c. Unlike the hash tables,
+ * value pointers stay valid until the entry is deleted.
+ */
+typedef struct {
+    struct orphand_pidmap_mid *mids[ORPHAND_PIDMAP_TOP_SIZE];
+    size_t vsize;
+    size_t nitems;
+} orphand_pidmap;
+
+typedef struct {
+    orphand_pidmap *map;
+    uint32_t pos;
+    struct orphand_pidmap_leaf *leaf;
+} orphand_pidmap_iter;
+
+void
+orphand_pidmap_init(orphand_pidmap *map, size_t vsize);
+
+/**
+ * Look up a PID, creating it if lval is true. New values are zeroed.
+ * Returns NULL if the PID is out of range.
+ */
+void *
+orphand_pidmap_fetch(orphand_pidmap *map, pid_t pid, int lval);
+
+int
+orphand_pidmap_delete(orphand_pidmap *map, pid_t pid);
+
+/**
+ * Iteration, in PID order. The current entry may be deleted with
+ * orphand_pidmap_iterdel.
+ */
+void
+orphand_pidmap_iterinit(orphand_pidmap *map, orphand_pidmap_iter *iter);
+
+int
+orphand_pidmap_iternext(orphand_pidmap_iter *iter);
+
+void *
+orphand_pidmap_iterval(orphand_pidmap_iter *iter);
+
+void
+orphand_pidmap_iterdel(orphand_pidmap_iter *iter);
+
+#define orphand_pidmap_iterkey(iter) ((pid_t)(iter)->pos)
+#define orphand_pidmap_count(map) ((map)->nitems)
+
+/** Our PID, and its start time, for a PID in another namespace */
+typedef struct {
+    pid_t pid;
+    uint64_t starttime;
+} orphand_nspid;
+
+/** The namespace and PID there of a child registered from another one */
+typedef struct {
+    uint64_t ino;
+    pid_t nspid;
+} orphand_nsref;
+
+/**
+ * A PID namespace other than ours, which clients connect from; see pidns.c
+ */
+typedef struct orphand_pidns {
+    /** inode of /proc/[pid]/ns/pid */
+    uint64_t ino;
+    /** connections from the namespace */
+    uint32_t nclients;
+    /** PID in the namespace => orphand_nspid, for the children registered
+     * from it. They can't be looked up once they have been reaped. */
+    orphand_pidmap pids;
+    /** full scans of /proc left, see ORPHAND_PIDNS_SCAN_RATE */
+    double scan_tokens;
+    uint64_t scan_refill;
+} orphand_pidns;
+
+/** Why a process is being killed */
+enum {
+    ORPHAND_KILL_ORPHAN = 1,
+    ORPHAND_KILL_DEADLINE
+};
+
+/**
+ * A process which is about to be killed. These are collected by the sweep
+ * and handed to the kill scheduler, which orders them by resource usage.
+ */
+typedef struct orphand_victim {
+    pid_t pid;
+    pid_t parent;
+    /** ORPHAND_KILL_* */
+    int reason;
+    uint64_t starttime;
+    /** resident pages and user time, as seen by the sweep */
+    long rss;
+    unsigned long utime;
+
+    /** how long to wait before escalating to SIGKILL (0 to never) */
+    uint32_t grace_ms;
+
+    /**
+     * pidfd for the victim, or -1 if unavailable. A pidfd passed in is
+     * trusted, and the start time isn't checked. Otherwise the scheduler
+     * opens one just before signalling.
+     */
+    int pidfd;
+
+    /** The fields below are private to the kill scheduler */
+
+    /** the last signal sent */
+    int signum;
+    /** number of liveness checks made after SIGKILL */
+    int nchecks;
+    orphand_timer timer;
+} orphand_victim;
+
+/**
+ * Kill scheduler. Victims are kept in a max-heap (largest first) and
+ * drained according to a token bucket so that a parent with a huge number
+ * of children doesn't cause a signal storm.
+ */
+typedef struct {
+    orphand_victim **heap;
+    size_t nheap;
+    size_t capacity;
+
+    double tokens;
+    uint64_t last_refill;
+} orphand_killq;
+
+/**
+ * Daemon side of the shared registration ring
+ */
+typedef struct {
+    /** the mapping; NULL if the ring is disabled */
+    orphand_ring *shm;
+    size_t nbytes;
+    /** our own copy, as the shared one may be overwritten by clients */
+    uint32_t nslots;
+    int memfd;
+    int evfd;
+    /** next position to read */
+    uint64_t head;
+    /** when the slot at head was found claimed but still empty */
+    uint64_t stalled_since;
+} orphand_ringq;
+
 typedef struct {
     int sock;
     int sweep_interval;
     int default_signum;
-    void *ht;
-    void *clients;
+    /** parent PID => orphand_parent */
+    orphand_pidmap parents;
+    /** (parent, child) => orphand_child */
+    orphand_childht_table *children;
+    /** child => parent; a child is only ever registered to one parent */
+    orphand_pidmap owners;
+    /** fd => orphand_client* */
+    orphand_clientht_table *clients;
+    /** EMBIHT_HASH_* for the tables above */
+    int hash_mode;
+
+    /** Signals per second (0 is unlimited), and maximum burst */
+    int kill_rate;
+    int kill_burst;
+    orphand_killq killq;
+
+    /** Default grace period before SIGKILL, in milliseconds */
+    int grace_ms;
+    orphand_wheel timers;
+
+    /** Memory released early from killed processes */
+    uint64_t reclaimed_bytes;
+    uint64_t nreclaimed;
+
+    /** Whether to discover descendants of registered children */
+    int descendants;
+    /** /proc scans allowed per sweep, and where the last sweep stopped */
+    int descend_budget;
+    pid_t descend_cursor;
+
+    /** Registrations to preallocate memory for */
+    int prealloc;
+    orphand_slab victim_slab;
+    orphand_slab deadline_slab;
+    orphand_slab client_slab;
+
+    /** Slots in the shared registration ring, 0 to disable it */
+    int ring_slots;
+    orphand_ringq ring;
+
+    /** signalfd for SIGCHLD, -1 if we can't spawn children */
+    int sigfd;
+
+    /** Whether to translate PIDs from clients in other namespaces */
+    int pid_namespaces;
+    /** our own namespace, and the others clients connect from (NULL unless
+     * pid_namespaces is set) */
+    uint64_t pidns_ino;
+    orphand_nsht_table *namespaces;
+    /** our PID => orphand_nsref, for the entries in each namespace's pids */
+    orphand_pidmap nsrefs;
+
+    /** Counters for STATS; the rest of it is filled in on request */
+    orphand_stats stats;
+    uint64_t started_ms;
 
     /** Stuff for select() */
     fd_set fds_rd;
@@ -82,14 +478,212 @@ typedef struct {
 int
 orphand_io_init(orphand_server *srv, const char *path);
 
+/**
+ * Handle a single message. ext points to its extension payload (if any),
+ * which is next bytes long.
+ */
 void
 orphand_process_message(orphand_server *srv,
                         orphand_client *cli,
-                        const orphand_message *msg);
+                        const orphand_message *msg,
+                        const void *ext,
+                        unsigned int next);
 
 void
 orphand_io_iteronce(orphand_server *srv);
 
+/**
+ * Create the shared registration ring, with nslots (a power of two) slots.
+ * Must be called after orphand_io_init. Returns -1 if the ring couldn't be
+ * set up, in which case clients only use their sockets.
+ */
+int
+orphand_ring_init(orphand_server *srv, uint32_t nslots);
+
+/**
+ * Reply to ORPHAND_ACTION_RING, passing the ring's descriptors to the
+ * client if possible.
+ */
+void
+orphand_ring_share(orphand_server *srv,
+                   orphand_client *cli,
+                   const orphand_message *msg);
+
+/**
+ * Called before blocking in select(). Asks producers for a wakeup, and
+ * shortens the timeout if records are already waiting or a slot is
+ * stalled.
+ */
+void
+orphand_ring_prepare(orphand_server *srv, struct timeval *tmo);
+
+/**
+ * Process the records in the ring, up to one full lap
+ */
+void
+orphand_ring_drain(orphand_server *srv, uint64_t now);
+
+/**
+ * Become a subreaper and set up reaping of children, which must happen
+ * before anything is spawned. Must be called after orphand_io_init.
+ */
+int
+orphand_spawn_init(orphand_server *srv);
+
+/**
+ * Spawn a child for a SPAWN request, using (and closing) the descriptors
+ * the client sent along with it. Returns 0 and stores the PID and a pidfd
+ * for the child (-1 if unavailable), or returns an errno value.
+ */
+int
+orphand_spawn(orphand_server *srv,
+              orphand_client *cli,
+              const orphand_message *msg,
+              const void *ext,
+              unsigned int next,
+              pid_t *pid,
+              int *pidfd);
+
+/**
+ * Reap all exited children, unregistering them. Called when the signalfd
+ * is readable.
+ */
+void
+orphand_spawn_reap(orphand_server *srv);
+
+/**
+ * Find our own PID namespace, so that clients from others can be told
+ * apart. Returns -1 if that isn't possible.
+ */
+int
+orphand_pidns_init(orphand_server *srv);
+
+/**
+ * Find the PID namespace of a new connection. Returns -1 if the connection
+ * should be refused, because its PIDs can't be translated.
+ */
+int
+orphand_pidns_attach(orphand_server *srv, orphand_client *cli);
+
+void
+orphand_pidns_detach(orphand_server *srv, orphand_client *cli);
+
+/**
+ * Record that our pid (with the given start time) was registered as nspid
+ * from the client's namespace
+ */
+void
+orphand_pidns_add(orphand_server *srv,
+                  orphand_client *cli,
+                  pid_t nspid,
+                  pid_t pid,
+                  uint64_t starttime);
+
+/**
+ * Forget our pid in the namespace it was registered from, if any, once its
+ * registration is gone
+ */
+void
+orphand_pidns_release(orphand_server *srv, pid_t pid);
+
+/**
+ * Translate a PID from the client's namespace to ours by searching /proc,
+ * among the children of parent (one of our PIDs) if it is known. Returns 0
+ * if there is no such process, or if the namespace has used up its scans
+ * of all of /proc.
+ */
+pid_t
+orphand_pidns_find(orphand_server *srv,
+                   orphand_client *cli,
+                   pid_t nspid,
+                   pid_t parent);
+
+/**
+ * Open a pidfd, placed above FD_SETSIZE so that it doesn't push client
+ * sockets out of select()'s range. Returns -1 if pidfds aren't available.
+ */
+int
+orphand_pidfd_open(pid_t pid);
+
+/**
+ * Queue a victim for killing. The structure is copied, and takes over the
+ * victim's pidfd if it has one.
+ */
+void
+orphand_killq_push(orphand_server *srv, const orphand_victim *victim);
+
+/** Make room for count queued victims */
+void
+orphand_killq_reserve(orphand_server *srv, size_t count);
+
+/**
+ * Deliver as many signals as the token bucket allows. Returns the amount
+ * of milliseconds until more victims may be killed, or -1 if the queue
+ * is empty.
+ */
+long
+orphand_killq_run(orphand_server *srv, uint64_t now);
+
+typedef struct {
+    pid_t *pids;
+    size_t npids;
+    size_t capacity;
+} orphand_pidlist;
+
+void
+orphand_pidlist_push(orphand_pidlist *list, pid_t pid);
+
+/**
+ * Append the children of all threads of pid to the list, as listed in
+ * /proc/[pid]/task/[tid]/children. Returns -1 if the process couldn't be
+ * read.
+ */
+int
+orphand_proc_children(pid_t pid, orphand_pidlist *list);
+
+void
+orphand_wheel_init(orphand_wheel *wheel, uint64_t now);
+
+/**
+ * Schedule a timer to fire at the given time (in milliseconds). The
+ * callback must be set, and the timer must not already be pending.
+ */
+void
+orphand_wheel_add(orphand_wheel *wheel, orphand_timer *timer, uint64_t when);
+
+void
+orphand_wheel_del(orphand_wheel *wheel, orphand_timer *timer);
+
+/**
+ * Invoke the callbacks of all timers which have expired by 'now'.
+ * arg is passed to each callback.
+ */
+void
+orphand_wheel_run(orphand_wheel *wheel, uint64_t now, void *arg);
+
+/**
+ * Returns the amount of milliseconds until the wheel needs to run again,
+ * or -1 if there are no timers.
+ */
+long
+orphand_wheel_next(orphand_wheel *wheel, uint64_t now);
+
+static inline uint64_t
+orphand_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline uint64_t
+orphand_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 
 /**
  * ffs how many times do i need to do this..
@@ -0,0 +1,174 @@
+/**
+ * Radix tree keyed by PID. PIDs are small and handed out roughly in order,
+ * so rather than hashing them, the top bits pick a node, the middle bits a
+ * leaf, and the low bits a slot within the leaf. Each leaf has a bitmap of
+ * the slots in use, which lets iteration skip unused ranges a word at a
+ * time, and whole subtrees when a node or leaf is missing.
+ */
+
+#include "orphand_priv.h"
+
+#define LEAF_SIZE (1U << ORPHAND_PIDMAP_LEAF_BITS)
+#define MID_SIZE (1U << ORPHAND_PIDMAP_MID_BITS)
+
+#define LEAF_IDX(pid) ((pid) & (LEAF_SIZE - 1))
+#define MID_IDX(pid) (((pid) >> ORPHAND_PIDMAP_LEAF_BITS) & (MID_SIZE - 1))
+#define TOP_IDX(pid) \
+    ((pid) >> (ORPHAND_PIDMAP_LEAF_BITS + ORPHAND_PIDMAP_MID_BITS))
+
+struct orphand_pidmap_leaf {
+    uint64_t used[LEAF_SIZE / 64];
+    size_t count;
+    char values[];
+};
+
+struct orphand_pidmap_mid {
+    struct orphand_pidmap_leaf *leaves[MID_SIZE];
+    size_t count;
+};
+
+#define leaf_bytes(map) \
+    (sizeof(struct orphand_pidmap_leaf) + LEAF_SIZE * (map)->vsize)
+#define leaf_valp(map, leaf, pid) \
+    ((leaf)->values + LEAF_IDX(pid) * (map)->vsize)
+#define leaf_isset(leaf, pid) \
+    ((leaf)->used[LEAF_IDX(pid) / 64] & (1ULL << ((pid) & 63)))
+
+void
+orphand_pidmap_init(orphand_pidmap *map, size_t vsize)
+{
+    memset(map, 0, sizeof(*map));
+    map->vsize = vsize;
+}
+
+static struct orphand_pidmap_leaf *
+find_leaf(const orphand_pidmap *map, uint32_t pid)
+{
+    struct orphand_pidmap_mid *mid;
+
+    if (pid >= ORPHAND_PID_LIMIT) {
+        return NULL;
+    }
+    if ( (mid = map->mids[TOP_IDX(pid)]) == NULL) {
+        return NULL;
+    }
+    return mid->leaves[MID_IDX(pid)];
+}
+
+void *
+orphand_pidmap_fetch(orphand_pidmap *map, pid_t pid, int lval)
+{
+    struct orphand_pidmap_mid *mid;
+    struct orphand_pidmap_leaf *leaf = find_leaf(map, pid);
+
+    if (leaf && leaf_isset(leaf, pid)) {
+        return leaf_valp(map, leaf, pid);
+    }
+
+    if (!lval || pid < 0 || pid >= ORPHAND_PID_LIMIT) {
+        return NULL;
+    }
+
+    if (!leaf) {
+        if ( (mid = map->mids[TOP_IDX(pid)]) == NULL) {
+            mid = orphand_pool_alloc(sizeof(*mid));
+            memset(mid, 0, sizeof(*mid));
+            map->mids[TOP_IDX(pid)] = mid;
+        }
+
+        leaf = orphand_pool_alloc(leaf_bytes(map));
+        memset(leaf, 0, sizeof(*leaf));
+        mid->leaves[MID_IDX(pid)] = leaf;
+        mid->count++;
+    }
+
+    leaf->used[LEAF_IDX(pid) / 64] |= 1ULL << (pid & 63);
+    leaf->count++;
+    map->nitems++;
+
+    memset(leaf_valp(map, leaf, pid), 0, map->vsize);
+    return leaf_valp(map, leaf, pid);
+}
+
+int
+orphand_pidmap_delete(orphand_pidmap *map, pid_t pid)
+{
+    struct orphand_pidmap_leaf *leaf = find_leaf(map, pid);
+    struct orphand_pidmap_mid *mid;
+
+    if (!leaf || !leaf_isset(leaf, pid)) {
+        return 0;
+    }
+
+    leaf->used[LEAF_IDX(pid) / 64] &= ~(1ULL << (pid & 63));
+    map->nitems--;
+
+    if (--leaf->count) {
+        return 1;
+    }
+
+    /* Give empty leaves back, so sparse PIDs don't pin memory */
+    mid = map->mids[TOP_IDX(pid)];
+    mid->leaves[MID_IDX(pid)] = NULL;
+    orphand_pool_free(leaf, leaf_bytes(map));
+
+    if (!--mid->count) {
+        map->mids[TOP_IDX(pid)] = NULL;
+        orphand_pool_free(mid, sizeof(*mid));
+    }
+    return 1;
+}
+
+void
+orphand_pidmap_iterinit(orphand_pidmap *map, orphand_pidmap_iter *iter)
+{
+    iter->map = map;
+    iter->pos = UINT32_MAX;
+    iter->leaf = NULL;
+}
+
+int
+orphand_pidmap_iternext(orphand_pidmap_iter *iter)
+{
+    orphand_pidmap *map = iter->map;
+    uint32_t pid = iter->pos + 1;
+
+    while (pid < ORPHAND_PID_LIMIT) {
+        struct orphand_pidmap_mid *mid = map->mids[TOP_IDX(pid)];
+        struct orphand_pidmap_leaf *leaf;
+        uint64_t bits;
+
+        if (!mid) {
+            pid = (TOP_IDX(pid) + 1) <<
+                    (ORPHAND_PIDMAP_LEAF_BITS + ORPHAND_PIDMAP_MID_BITS);
+            continue;
+        }
+
+        if ( (leaf = mid->leaves[MID_IDX(pid)]) == NULL) {
+            pid = (pid | (LEAF_SIZE - 1)) + 1;
+            continue;
+        }
+
+        bits = leaf->used[LEAF_IDX(pid) / 64] & (~0ULL << (pid & 63));
+        if (bits) {
+            iter->pos = (pid & ~63U) + __builtin_ctzll(bits);
+            iter->leaf = leaf;
+            return 1;
+        }
+        pid = (pid | 63) + 1;
+    }
+    return 0;
+}
+
+void *
+orphand_pidmap_iterval(orphand_pidmap_iter *iter)
+{
+    return leaf_valp(iter->map, iter->leaf, iter->pos);
+}
+
+void
+orphand_pidmap_iterdel(orphand_pidmap_iter *iter)
+{
+    orphand_pidmap_delete(iter->map, iter->pos);
+    iter->leaf = NULL;
+}
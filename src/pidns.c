@@ -0,0 +1,299 @@
+/**
+ * Clients in other PID namespaces (e.g. containers sharing a host-wide
+ * orphand through a bind-mounted socket).
+ *
+ * Each connection's namespace is found through SO_PEERCRED, which gives the
+ * peer's PID as we see it, and the inode of /proc/[pid]/ns/pid. PIDs in
+ * messages from other namespaces are translated to ours on the way in, so
+ * the registry, the sweep and the kill scheduler only ever deal with our
+ * own PIDs. A PID is translated by looking for the process in our /proc
+ * whose namespace matches and whose innermost NSpid is the one sent.
+ */
+
+#include "orphand_priv.h"
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static int
+pidns_ino(const char *pid, uint64_t *ino)
+{
+    char path[64];
+    struct stat st;
+
+    snprintf(path, sizeof(path), "/proc/%s/ns/pid", pid);
+    if (stat(path, &st) == -1) {
+        return -1;
+    }
+    *ino = st.st_ino;
+    return 0;
+}
+
+/**
+ * The PID of a process in its own namespace, which is the last field of
+ * NSpid in /proc/[pid]/status. Returns 0 if it can't be read.
+ */
+static pid_t
+pid_in_ns(const char *pid)
+{
+    char path[64], buf[4096], *line, *end;
+    ssize_t nr;
+    pid_t ret = 0;
+    int fd;
+
+    snprintf(path, sizeof(path), "/proc/%s/status", pid);
+    if ( (fd = open(path, O_RDONLY|O_CLOEXEC)) == -1) {
+        return 0;
+    }
+    nr = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (nr <= 0) {
+        return 0;
+    }
+    buf[nr] = '\0';
+
+    if ( (line = strstr(buf, "\nNSpid:")) == NULL) {
+        return 0;
+    }
+    line += sizeof("\nNSpid:") - 1;
+
+    while (1) {
+        long val = strtol(line, &end, 10);
+        if (end == line) {
+            break;
+        }
+        ret = val;
+        line = end;
+    }
+    return ret;
+}
+
+/**
+ * Whether our process pid is nspid in the namespace
+ */
+static int
+is_nspid(const orphand_pidns *ns, pid_t pid, pid_t nspid)
+{
+    char name[16];
+    uint64_t ino;
+
+    snprintf(name, sizeof(name), "%d", pid);
+    return pidns_ino(name, &ino) == 0 && ino == ns->ino &&
+            pid_in_ns(name) == nspid;
+}
+
+int
+orphand_pidns_init(orphand_server *srv)
+{
+    if (pidns_ino("self", &srv->pidns_ino) == -1) {
+        WARN("Couldn't find our PID namespace: %s", strerror(errno));
+        return -1;
+    }
+
+    srv->namespaces = orphand_nsht_make(16);
+    orphand_nsht_set_hash(srv->namespaces, srv->hash_mode);
+    orphand_pidmap_init(&srv->nsrefs, sizeof(orphand_nsref));
+    return 0;
+}
+
+int
+orphand_pidns_attach(orphand_server *srv, orphand_client *cli)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    orphand_pidns **nsp;
+    char name[16];
+    uint64_t ino;
+
+    if (!srv->namespaces) {
+        return 0;
+    }
+
+    /* The PID is 0 if the peer is outside of our namespace's hierarchy */
+    if (getsockopt(cli->sockfd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1 ||
+            cred.pid < 1) {
+        WARN("fd=%d peer isn't visible from our PID namespace", cli->sockfd);
+        return -1;
+    }
+
+    snprintf(name, sizeof(name), "%d", cred.pid);
+    if (pidns_ino(name, &ino) == -1) {
+        WARN("fd=%d Couldn't find the PID namespace of %d: %s",
+             cli->sockfd, cred.pid, strerror(errno));
+        return -1;
+    }
+
+    if (ino == srv->pidns_ino) {
+        return 0;
+    }
+
+    cli->peer_pid = cred.pid;
+    cli->peer_nspid = pid_in_ns(name);
+    if (!cli->peer_nspid) {
+        WARN("fd=%d Couldn't read NSpid of %d", cli->sockfd, cred.pid);
+        return -1;
+    }
+
+    nsp = orphand_nsht_fetch(srv->namespaces, ino, 1);
+    if (!*nsp) {
+        *nsp = orphand_pool_alloc(sizeof(orphand_pidns));
+        (*nsp)->ino = ino;
+        (*nsp)->nclients = 0;
+        orphand_pidmap_init(&(*nsp)->pids, sizeof(orphand_nspid));
+        (*nsp)->scan_tokens = ORPHAND_PIDNS_SCAN_BURST;
+        (*nsp)->scan_refill = orphand_now_ms();
+        INFO("New PID namespace %llu", (unsigned long long)ino);
+    }
+
+    cli->ns = *nsp;
+    cli->ns->nclients++;
+    DEBUG("fd=%d is %d in namespace %llu (%d here)", cli->sockfd,
+          cli->peer_nspid, (unsigned long long)ino, cli->peer_pid);
+    return 0;
+}
+
+void
+orphand_pidns_detach(orphand_server *srv, orphand_client *cli)
+{
+    orphand_pidns *ns = cli->ns;
+    orphand_pidmap_iter iter;
+
+    if (!ns || --ns->nclients) {
+        return;
+    }
+
+    /* Registrations stay, but nobody is left to unregister them */
+    orphand_pidmap_iterinit(&ns->pids, &iter);
+    while (orphand_pidmap_iternext(&iter)) {
+        orphand_nspid *ent = orphand_pidmap_iterval(&iter);
+        orphand_pidmap_delete(&srv->nsrefs, ent->pid);
+        orphand_pidmap_iterdel(&iter);
+    }
+
+    INFO("Last client of PID namespace %llu is gone",
+         (unsigned long long)ns->ino);
+    orphand_nsht_delete(srv->namespaces, ns->ino);
+    orphand_pool_free(ns, sizeof(*ns));
+}
+
+void
+orphand_pidns_add(orphand_server *srv,
+                  orphand_client *cli,
+                  pid_t nspid,
+                  pid_t pid,
+                  uint64_t starttime)
+{
+    orphand_nspid *ent = orphand_pidmap_fetch(&cli->ns->pids, nspid, 1);
+    orphand_nsref *ref = orphand_pidmap_fetch(&srv->nsrefs, pid, 1);
+
+    ent->pid = pid;
+    ent->starttime = starttime;
+    ref->ino = cli->ns->ino;
+    ref->nspid = nspid;
+}
+
+void
+orphand_pidns_release(orphand_server *srv, pid_t pid)
+{
+    orphand_nsref *ref;
+    orphand_pidns **nsp;
+    orphand_nspid *ent;
+
+    if (!orphand_pidmap_count(&srv->nsrefs) ||
+            !(ref = orphand_pidmap_fetch(&srv->nsrefs, pid, 0))) {
+        return;
+    }
+
+    /**
+     * The PID may since have been registered again from the namespace, as
+     * someone else
+     */
+    if ( (nsp = orphand_nsht_fetch(srv->namespaces, ref->ino, 0)) &&
+            (ent = orphand_pidmap_fetch(&(*nsp)->pids, ref->nspid, 0)) &&
+            ent->pid == pid) {
+        orphand_pidmap_delete(&(*nsp)->pids, ref->nspid);
+    }
+    orphand_pidmap_delete(&srv->nsrefs, pid);
+}
+
+/**
+ * Whether the namespace may scan all of /proc now. A client which keeps
+ * sending PIDs that can't be found would otherwise have us read the status
+ * of every process for each of them.
+ */
+static int
+scan_allowed(orphand_pidns *ns)
+{
+    uint64_t now = orphand_now_ms();
+
+    ns->scan_tokens += (double)(now - ns->scan_refill) *
+            ORPHAND_PIDNS_SCAN_RATE / 1000;
+    if (ns->scan_tokens > ORPHAND_PIDNS_SCAN_BURST) {
+        ns->scan_tokens = ORPHAND_PIDNS_SCAN_BURST;
+    }
+    ns->scan_refill = now;
+
+    if (ns->scan_tokens < 1) {
+        return 0;
+    }
+    ns->scan_tokens--;
+    return 1;
+}
+
+pid_t
+orphand_pidns_find(orphand_server *srv,
+                   orphand_client *cli,
+                   pid_t nspid,
+                   pid_t parent)
+{
+    static orphand_pidlist children;
+    DIR *dir;
+    struct dirent *de;
+    size_t ii;
+
+    if (nspid == cli->peer_nspid) {
+        return cli->peer_pid;
+    }
+
+    /**
+     * A new child is usually the last one its parent created, and the
+     * children already registered can't be it
+     */
+    children.npids = 0;
+    if (parent && orphand_proc_children(parent, &children) == 0) {
+        for (ii = children.npids; ii > 0; ii--) {
+            pid_t pid = children.pids[ii - 1];
+            if (!orphand_pidmap_fetch(&srv->owners, pid, 0) &&
+                    is_nspid(cli->ns, pid, nspid)) {
+                return pid;
+            }
+        }
+    }
+
+    if (!scan_allowed(cli->ns)) {
+        DEBUG("Not looking for %d of namespace %llu in all of /proc: "
+              "rate limited", nspid, (unsigned long long)cli->ns->ino);
+        return 0;
+    }
+
+    DEBUG("Looking for %d of namespace %llu in all of /proc", nspid,
+          (unsigned long long)cli->ns->ino);
+
+    if ( (dir = opendir("/proc")) == NULL) {
+        return 0;
+    }
+
+    while ( (de = readdir(dir)) ) {
+        pid_t pid = atoi(de->d_name);
+        if (pid > 0 && is_nspid(cli->ns, pid, nspid)) {
+            closedir(dir);
+            return pid;
+        }
+    }
+
+    closedir(dir);
+    return 0;
+}
@@ -0,0 +1,276 @@
+/**
+ * Daemon side of the shared registration ring; see orphand_ring.h for the
+ * layout and the producer side.
+ *
+ * The ring is drained on every iteration of the event loop, before any
+ * socket is read. A client that falls back to its socket because the ring
+ * is full therefore never overtakes its own earlier records, unless one
+ * of them is stuck behind a stalled slot.
+ *
+ * Every client can write to the whole mapping, header included. Only our
+ * own copies of the size and the head are relied upon; 'expires' and
+ * 'sleeping' are written for producers and never read back, and 'tail' is
+ * checked before use (see ring_claimed).
+ */
+
+#include "orphand_priv.h"
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+int
+orphand_ring_init(orphand_server *srv, uint32_t nslots)
+{
+    orphand_ringq *rq = &srv->ring;
+    size_t nbytes = ORPHAND_RING_BYTES(nslots);
+
+    assert(nslots && (nslots & (nslots - 1)) == 0);
+    memset(rq, 0, sizeof(*rq));
+    rq->evfd = -1;
+
+    rq->memfd = memfd_create("orphand-ring", MFD_CLOEXEC|MFD_ALLOW_SEALING);
+    if (rq->memfd == -1) {
+        WARN("memfd_create: %s", strerror(errno));
+        return -1;
+    }
+
+    if (ftruncate(rq->memfd, nbytes) == -1) {
+        WARN("ftruncate: %s", strerror(errno));
+        goto GT_ERR;
+    }
+
+    /* Clients get a writable descriptor, but must not be able to resize it
+     * underneath us */
+    if (fcntl(rq->memfd, F_ADD_SEALS,
+              F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_SEAL) == -1) {
+        WARN("Couldn't seal ring: %s", strerror(errno));
+        goto GT_ERR;
+    }
+
+    rq->shm = mmap(NULL, nbytes, PROT_READ|PROT_WRITE, MAP_SHARED,
+                   rq->memfd, 0);
+    if (rq->shm == MAP_FAILED) {
+        WARN("mmap: %s", strerror(errno));
+        rq->shm = NULL;
+        goto GT_ERR;
+    }
+
+    rq->evfd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+    if (rq->evfd == -1) {
+        WARN("eventfd: %s", strerror(errno));
+        goto GT_ERR;
+    }
+
+    /* A zeroed slot is empty for the first lap, so that's all there is */
+    rq->nslots = nslots;
+    rq->nbytes = nbytes;
+    rq->shm->magic = ORPHAND_RING_MAGIC;
+    rq->shm->version = ORPHAND_RING_VERSION;
+    rq->shm->nslots = nslots;
+    rq->shm->hdrsize = sizeof(orphand_ring);
+    rq->shm->expires = orphand_now_ms();
+
+    FD_SET(rq->evfd, &srv->fds_rd);
+    srv->maxfd = -1;
+    return 0;
+
+    GT_ERR:
+    if (rq->shm) {
+        munmap(rq->shm, nbytes);
+    }
+    close(rq->memfd);
+    memset(rq, 0, sizeof(*rq));
+    rq->evfd = -1;
+    return -1;
+}
+
+void
+orphand_ring_share(orphand_server *srv,
+                   orphand_client *cli,
+                   const orphand_message *msg)
+{
+    orphand_ringq *rq = &srv->ring;
+    struct orphand_buffer *ob = &cli->sndbuf;
+    struct iovec iov;
+    struct msghdr mh;
+    struct cmsghdr *cmsg;
+    union {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } cbuf;
+    ssize_t nw = 0;
+
+    if (ob->total - ob->used < sizeof(*msg)) {
+        ERROR("Too little space in send buffer..");
+        return;
+    }
+
+    /* Descriptors can only go out with the reply itself. Ring records
+     * carry no namespace, so other namespaces use their sockets */
+    if (!rq->shm || ob->used || cli->ns) {
+        goto GT_BUFFER;
+    }
+
+    iov.iov_base = (void*)msg;
+    iov.iov_len = sizeof(*msg);
+
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf.buf;
+    mh.msg_controllen = sizeof(cbuf.buf);
+
+    cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &rq->memfd, sizeof(int));
+    memcpy(CMSG_DATA(cmsg) + sizeof(int), &rq->evfd, sizeof(int));
+
+    nw = sendmsg(cli->sockfd, &mh, MSG_DONTWAIT|MSG_NOSIGNAL);
+    if (nw == -1) {
+        WARN("fd=%d Couldn't send ring: %s", cli->sockfd, strerror(errno));
+        nw = 0;
+    }
+
+    GT_BUFFER:
+    memcpy(ob->buf + ob->used, (const char*)msg + nw, sizeof(*msg) - nw);
+    ob->used += sizeof(*msg) - nw;
+}
+
+/**
+ * The number of slots producers have claimed beyond our head. A valid tail
+ * is never behind the head, nor more than a lap ahead of it; anything else
+ * was scribbled by a client, and is put back.
+ */
+static uint64_t
+ring_claimed(orphand_ringq *rq)
+{
+    uint64_t tail = __atomic_load_n(&rq->shm->tail, __ATOMIC_RELAXED);
+
+    if (tail - rq->head <= rq->nslots) {
+        return tail - rq->head;
+    }
+
+    WARN("Ring tail %llu is out of range (head %llu), resetting it",
+         (unsigned long long)tail, (unsigned long long)rq->head);
+    __atomic_compare_exchange_n(&rq->shm->tail, &tail, rq->head, 0,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void
+orphand_ring_prepare(orphand_server *srv, struct timeval *tmo)
+{
+    orphand_ringq *rq = &srv->ring;
+    uint64_t wait_ms, word;
+
+    if (!rq->shm) {
+        return;
+    }
+
+    wait_ms = (uint64_t)tmo->tv_sec * 1000 + tmo->tv_usec / 1000;
+
+    /* Claimed slots are published shortly, or skipped after a while */
+    if (ring_claimed(rq) && wait_ms > ORPHAND_RING_STALL_MS) {
+        wait_ms = ORPHAND_RING_STALL_MS;
+    }
+
+    __atomic_store_n(&rq->shm->expires, orphand_now_ms() + wait_ms,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&rq->shm->sleeping, 1, __ATOMIC_SEQ_CST);
+
+    /**
+     * Anything published before the flag was visible won't be followed by
+     * a wakeup, so check once more before blocking.
+     */
+    word = __atomic_load_n(rq->shm->slots + (rq->head & (rq->nslots - 1)),
+                           __ATOMIC_SEQ_CST);
+    if ((word & ~ORPHAND_RING_RECORD_MASK) ==
+            ORPHAND_RING_FULL(rq, rq->head)) {
+        __atomic_store_n(&rq->shm->sleeping, 0, __ATOMIC_RELAXED);
+        wait_ms = 0;
+    }
+
+    tmo->tv_sec = wait_ms / 1000;
+    tmo->tv_usec = (wait_ms % 1000) * 1000;
+}
+
+static void
+process_record(orphand_server *srv, uint64_t word)
+{
+    orphand_message msg;
+
+    msg.parent = ORPHAND_RING_REC_PARENT(word);
+    msg.child = ORPHAND_RING_REC_CHILD(word);
+    msg.action = ORPHAND_RING_REC_ACTION(word);
+
+    if (msg.action != ORPHAND_ACTION_REGISTER &&
+            msg.action != ORPHAND_ACTION_UNREGISTER) {
+        WARN("Ignoring ring record with action %u", msg.action);
+        return;
+    }
+    orphand_process_message(srv, NULL, &msg, NULL, 0);
+}
+
+void
+orphand_ring_drain(orphand_server *srv, uint64_t now)
+{
+    orphand_ringq *rq = &srv->ring;
+    uint32_t ii;
+
+    if (!rq->shm) {
+        return;
+    }
+
+    /* Awake; producers needn't bother with the eventfd for now */
+    __atomic_store_n(&rq->shm->sleeping, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&rq->shm->expires, now, __ATOMIC_RELAXED);
+
+    for (ii = 0; ii < rq->nslots; ii++) {
+        uint64_t *slot = rq->shm->slots + (rq->head & (rq->nslots - 1));
+        uint64_t word = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+
+        if ((word & ~ORPHAND_RING_RECORD_MASK) ==
+                ORPHAND_RING_FULL(rq, rq->head)) {
+            process_record(srv, word);
+            __atomic_store_n(slot,
+                             ORPHAND_RING_EMPTY(rq, rq->head + rq->nslots),
+                             __ATOMIC_RELEASE);
+            rq->head++;
+            rq->stalled_since = 0;
+            continue;
+        }
+
+        /* Nothing more, unless a producer claimed this slot and hasn't
+         * filled it in yet */
+        if (!ring_claimed(rq)) {
+            break;
+        }
+
+        if (!rq->stalled_since) {
+            rq->stalled_since = now;
+            break;
+        }
+        if (now - rq->stalled_since < ORPHAND_RING_STALL_MS) {
+            break;
+        }
+
+        /* The producer probably died. If it's merely slow, its publish
+         * fails and it uses the socket instead */
+        if (__atomic_compare_exchange_n(slot, &word,
+                                        ORPHAND_RING_EMPTY(rq, rq->head +
+                                                           rq->nslots),
+                                        0, __ATOMIC_SEQ_CST,
+                                        __ATOMIC_RELAXED)) {
+            WARN("Skipping ring slot %llu, stalled for %llu ms",
+                 (unsigned long long)rq->head,
+                 (unsigned long long)(now - rq->stalled_since));
+            rq->head++;
+            rq->stalled_since = 0;
+        }
+    }
+}
@@ -0,0 +1,251 @@
+/**
+ * Fixed size object caches, and a set of power-of-two size classes built
+ * on top of them for variable sized arrays. Freed objects are kept for
+ * reuse, so once the daemon has seen its peak load it rarely maps memory.
+ * Chunks which become entirely free are unmapped, keeping one chunk's
+ * worth of spare objects, so that memory follows the live registrations
+ * down after a spike.
+ */
+
+#include "orphand_priv.h"
+#include <sys/mman.h>
+
+/** Smallest chunk mapped when a cache runs out */
+#define SLAB_CHUNK_SIZE 65536
+
+/** Chunks hold at least this many of the larger objects */
+#define SLAB_CHUNK_MIN_OBJS 8
+
+/**
+ * Size classes from 16 bytes up to 64KB. Anything larger goes to malloc,
+ * so that big tables which shrink give their memory back to the system.
+ */
+#define POOL_MIN_SHIFT 4
+#define POOL_NCLASSES 13
+
+/**
+ * Each chunk is aligned to its size, so an object's chunk is found by
+ * masking its address. The header is followed by the objects.
+ */
+struct orphand_slab_chunk {
+    struct orphand_slab_chunk *next;
+    struct orphand_slab_chunk *prev;
+    void *freelist;
+    size_t nfree;
+};
+
+#define CHUNK_HDR_SIZE \
+    ((sizeof(struct orphand_slab_chunk) + 15) & ~(size_t)15)
+
+#define chunk_of(slab, ptr) \
+    ((struct orphand_slab_chunk*)((uintptr_t)(ptr) & ~((slab)->chunksize - 1)))
+
+static orphand_slab Pool[POOL_NCLASSES];
+
+void
+orphand_slab_init(orphand_slab *slab, size_t objsize)
+{
+    memset(slab, 0, sizeof(*slab));
+
+    /* Room for the freelist pointer, and keep everything aligned */
+    if (objsize < sizeof(void*)) {
+        objsize = sizeof(void*);
+    }
+    slab->objsize = (objsize + 7) & ~(size_t)7;
+
+    slab->chunksize = SLAB_CHUNK_SIZE;
+    while (slab->chunksize <
+            CHUNK_HDR_SIZE + slab->objsize * SLAB_CHUNK_MIN_OBJS) {
+        slab->chunksize *= 2;
+    }
+    slab->perchunk = (slab->chunksize - CHUNK_HDR_SIZE) / slab->objsize;
+}
+
+static void
+partial_push(orphand_slab *slab, struct orphand_slab_chunk *chunk)
+{
+    chunk->prev = NULL;
+    chunk->next = slab->partial;
+    if (slab->partial) {
+        slab->partial->prev = chunk;
+    }
+    slab->partial = chunk;
+}
+
+static void
+partial_unlink(orphand_slab *slab, struct orphand_slab_chunk *chunk)
+{
+    if (chunk->prev) {
+        chunk->prev->next = chunk->next;
+    } else {
+        slab->partial = chunk->next;
+    }
+    if (chunk->next) {
+        chunk->next->prev = chunk->prev;
+    }
+}
+
+/**
+ * Map a chunk aligned to its size, by mapping twice as much and trimming
+ * the excess on either side
+ */
+static void
+chunk_new(orphand_slab *slab)
+{
+    struct orphand_slab_chunk *chunk;
+    size_t size = slab->chunksize, lead, ii;
+    char *map, *base;
+
+    map = mmap(NULL, size * 2, PROT_READ|PROT_WRITE,
+               MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        ERROR("Couldn't map %lu bytes", (unsigned long)size);
+        abort();
+    }
+
+    base = (char*)(((uintptr_t)map + size - 1) & ~(size - 1));
+    lead = base - map;
+    if (lead) {
+        munmap(map, lead);
+    }
+    munmap(base + size, size - lead);
+
+    chunk = (struct orphand_slab_chunk*)base;
+    chunk->freelist = NULL;
+    for (ii = slab->perchunk; ii > 0; ii--) {
+        void **obj = (void**)(base + CHUNK_HDR_SIZE +
+                              (ii - 1) * slab->objsize);
+        *obj = chunk->freelist;
+        chunk->freelist = obj;
+    }
+    chunk->nfree = slab->perchunk;
+
+    partial_push(slab, chunk);
+    slab->nfree += slab->perchunk;
+    slab->nbytes += size;
+}
+
+void
+orphand_slab_reserve(orphand_slab *slab, size_t count)
+{
+    if (slab->nused + count > slab->nreserved) {
+        slab->nreserved = slab->nused + count;
+    }
+    while (slab->nfree < count) {
+        chunk_new(slab);
+    }
+}
+
+void *
+orphand_slab_alloc(orphand_slab *slab)
+{
+    struct orphand_slab_chunk *chunk;
+    void **ret;
+
+    if (!slab->partial) {
+        chunk_new(slab);
+    }
+
+    chunk = slab->partial;
+    ret = chunk->freelist;
+    chunk->freelist = *ret;
+    if (!--chunk->nfree) {
+        partial_unlink(slab, chunk);
+    }
+
+    slab->nfree--;
+    slab->nused++;
+    return ret;
+}
+
+void
+orphand_slab_free(orphand_slab *slab, void *ptr)
+{
+    struct orphand_slab_chunk *chunk;
+    void **obj = ptr;
+
+    if (!ptr) {
+        return;
+    }
+
+    chunk = chunk_of(slab, ptr);
+    *obj = chunk->freelist;
+    chunk->freelist = obj;
+    if (!chunk->nfree++) {
+        partial_push(slab, chunk);
+    }
+    slab->nfree++;
+    slab->nused--;
+
+    /* Keep a chunk's worth of spare objects, and what was reserved */
+    if (chunk->nfree == slab->perchunk &&
+            slab->nfree >= slab->perchunk * 2 &&
+            slab->nused + slab->nfree - slab->perchunk >= slab->nreserved) {
+        partial_unlink(slab, chunk);
+        slab->nfree -= slab->perchunk;
+        slab->nbytes -= slab->chunksize;
+        munmap(chunk, slab->chunksize);
+    }
+}
+
+static int
+pool_class(size_t size)
+{
+    int cls = 0;
+    while (((size_t)1 << (cls + POOL_MIN_SHIFT)) < size) {
+        cls++;
+    }
+    return cls < POOL_NCLASSES ? cls : -1;
+}
+
+static orphand_slab *
+pool_slab(size_t size)
+{
+    int cls = pool_class(size);
+    if (cls < 0) {
+        return NULL;
+    }
+    if (!Pool[cls].objsize) {
+        orphand_slab_init(&Pool[cls], (size_t)1 << (cls + POOL_MIN_SHIFT));
+    }
+    return &Pool[cls];
+}
+
+void *
+orphand_pool_alloc(size_t size)
+{
+    orphand_slab *slab = pool_slab(size);
+    if (!slab) {
+        return malloc(size);
+    }
+    return orphand_slab_alloc(slab);
+}
+
+void
+orphand_pool_free(void *ptr, size_t size)
+{
+    orphand_slab *slab = pool_slab(size);
+    if (!slab) {
+        free(ptr);
+    } else {
+        orphand_slab_free(slab, ptr);
+    }
+}
+
+void *
+orphand_pool_realloc(void *ptr, size_t oldsize, size_t newsize)
+{
+    int oldcls = pool_class(oldsize), newcls = pool_class(newsize);
+    void *ret;
+
+    if (oldcls == newcls) {
+        return newcls == -1 ? realloc(ptr, newsize) : ptr;
+    }
+
+    if ( (ret = orphand_pool_alloc(newsize)) == NULL) {
+        return NULL;
+    }
+    memcpy(ret, ptr, oldsize < newsize ? oldsize : newsize);
+    orphand_pool_free(ptr, oldsize);
+    return ret;
+}
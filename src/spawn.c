@@ -0,0 +1,255 @@
+/**
+ * Children spawned by orphand itself, on behalf of clients.
+ *
+ * orphand is their real parent, so their PIDs can't be reused until they
+ * are reaped here, and reaping them tells us exactly when they are gone.
+ * orphand also becomes a subreaper, so that their orphaned descendants are
+ * reparented to it rather than to init, and reaped the same way.
+ */
+
+#include "orphand_priv.h"
+#include <spawn.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+int
+orphand_spawn_init(orphand_server *srv)
+{
+    sigset_t mask;
+
+    srv->sigfd = -1;
+
+    if (prctl(PR_SET_CHILD_SUBREAPER, 1) == -1) {
+        WARN("Couldn't become a subreaper: %s", strerror(errno));
+    }
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
+        WARN("sigprocmask: %s", strerror(errno));
+        return -1;
+    }
+
+    srv->sigfd = signalfd(-1, &mask, SFD_CLOEXEC|SFD_NONBLOCK);
+    if (srv->sigfd == -1) {
+        WARN("signalfd: %s", strerror(errno));
+        sigprocmask(SIG_UNBLOCK, &mask, NULL);
+        return -1;
+    }
+
+    FD_SET(srv->sigfd, &srv->fds_rd);
+    srv->maxfd = -1;
+    return 0;
+}
+
+/**
+ * Take the first n descriptors the client has sent. Returns how many
+ * there were.
+ */
+static unsigned int
+take_fds(orphand_client *cli, int *fds, unsigned int n)
+{
+    if (n > cli->nfds) {
+        n = cli->nfds;
+    }
+    memcpy(fds, cli->fds, n * sizeof(int));
+    cli->nfds -= n;
+    memmove(cli->fds, cli->fds + n, cli->nfds * sizeof(int));
+    return n;
+}
+
+/**
+ * Only processes running as our own user may have us run programs;
+ * anything else would make us a proxy for execve(2) as well as kill(2)
+ */
+static int
+peer_allowed(orphand_client *cli)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(cli->sockfd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1) {
+        WARN("fd=%d SO_PEERCRED: %s", cli->sockfd, strerror(errno));
+        return 0;
+    }
+    return cred.uid == geteuid();
+}
+
+/**
+ * Split the strings following the extension header into argv and envp,
+ * which point into the payload. Returns the (pool allocated) vector, or
+ * NULL if the payload is malformed.
+ */
+static char **
+parse_strings(const orphand_spawn_ext *spext,
+              const char *strings,
+              size_t len,
+              size_t *vsize)
+{
+    size_t nstrings = (size_t)spext->argc + spext->envc, ii, pos = 0;
+    char **vec;
+
+    /* Each string is at least its terminator */
+    if (!spext->argc || nstrings > len) {
+        return NULL;
+    }
+
+    *vsize = (nstrings + 2) * sizeof(char*);
+    vec = orphand_pool_alloc(*vsize);
+
+    for (ii = 0; ii < nstrings; ii++) {
+        const char *end = memchr(strings + pos, '\0', len - pos);
+        if (!end) {
+            orphand_pool_free(vec, *vsize);
+            return NULL;
+        }
+
+        /* argv and envp are each NULL terminated */
+        vec[ii + (ii >= spext->argc)] = (char*)strings + pos;
+        pos = end - strings + 1;
+    }
+
+    vec[spext->argc] = NULL;
+    vec[nstrings + 1] = NULL;
+    return vec;
+}
+
+int
+orphand_spawn(orphand_server *srv,
+              orphand_client *cli,
+              const orphand_message *msg,
+              const void *ext,
+              unsigned int next,
+              pid_t *pid,
+              int *pidfd)
+{
+    orphand_spawn_ext spext;
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t sigs;
+    int fds[ORPHAND_SPAWN_MAX_FDS];
+    unsigned int nfds = 0, ii;
+    char **vec = NULL;
+    size_t vsize = 0;
+    int err;
+
+    *pid = 0;
+    *pidfd = -1;
+
+    if (next < sizeof(spext)) {
+        /* Whatever was sent along with it is still ours to close */
+        nfds = take_fds(cli, fds, ORPHAND_SPAWN_MAX_FDS);
+        err = EINVAL;
+        goto GT_DONE;
+    }
+
+    memcpy(&spext, ext, sizeof(spext));
+    nfds = take_fds(cli, fds, spext.nfds < ORPHAND_SPAWN_MAX_FDS
+                    ? spext.nfds : ORPHAND_SPAWN_MAX_FDS);
+
+    if (spext.nfds > ORPHAND_SPAWN_MAX_FDS || nfds < spext.nfds) {
+        WARN("fd=%d SPAWN with %u descriptors, %u received",
+             cli->sockfd, spext.nfds, nfds);
+        err = EBADF;
+        goto GT_DONE;
+    }
+
+    if (msg->parent < 1 || msg->parent >= ORPHAND_PID_LIMIT) {
+        err = EINVAL;
+        goto GT_DONE;
+    }
+
+    /* The child would be in our PID namespace, not the client's */
+    if (srv->sigfd == -1 || cli->ns || !peer_allowed(cli)) {
+        err = EPERM;
+        goto GT_DONE;
+    }
+
+    vec = parse_strings(&spext, (const char*)ext + sizeof(spext),
+                        next - sizeof(spext), &vsize);
+    if (!vec) {
+        WARN("fd=%d sent a malformed SPAWN request", cli->sockfd);
+        err = EINVAL;
+        goto GT_DONE;
+    }
+
+    posix_spawn_file_actions_init(&actions);
+    for (ii = 0; ii < ORPHAND_SPAWN_MAX_FDS; ii++) {
+        if (ii < nfds) {
+            posix_spawn_file_actions_adddup2(&actions, fds[ii], ii);
+        } else {
+            posix_spawn_file_actions_addopen(&actions, ii, "/dev/null",
+                                             O_RDWR, 0);
+        }
+    }
+
+    /* Don't pass on our blocked SIGCHLD and ignored SIGPIPE */
+    posix_spawnattr_init(&attr);
+    sigemptyset(&sigs);
+    posix_spawnattr_setsigmask(&attr, &sigs);
+    sigaddset(&sigs, SIGCHLD);
+    sigaddset(&sigs, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &sigs);
+    posix_spawnattr_setflags(&attr,
+                             POSIX_SPAWN_SETSIGMASK|POSIX_SPAWN_SETSIGDEF);
+
+    if (strchr(vec[0], '/')) {
+        err = posix_spawn(pid, vec[0], &actions, &attr,
+                          vec, vec + spext.argc + 1);
+    } else {
+        err = posix_spawnp(pid, vec[0], &actions, &attr,
+                           vec, vec + spext.argc + 1);
+    }
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (err) {
+        INFO("Couldn't spawn %s for %d: %s",
+             vec[0], msg->parent, strerror(err));
+        *pid = 0;
+        goto GT_DONE;
+    }
+
+    /* It can't have been reaped yet, so this is the right process */
+    *pidfd = orphand_pidfd_open(*pid);
+    INFO("Spawned %d (%s) for %d", *pid, vec[0], msg->parent);
+
+    GT_DONE:
+    for (ii = 0; ii < nfds; ii++) {
+        close(fds[ii]);
+    }
+    if (vec) {
+        orphand_pool_free(vec, vsize);
+    }
+    return err;
+}
+
+void
+orphand_spawn_reap(orphand_server *srv)
+{
+    struct signalfd_siginfo ssi;
+    orphand_message msg;
+    pid_t pid;
+    int status;
+
+    while (read(srv->sigfd, &ssi, sizeof(ssi)) == sizeof(ssi)) {
+        /* Signals coalesce, so the count means nothing */
+    }
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        DEBUG("Reaped %d (status 0x%x)", pid, status);
+
+        /* Whoever it was registered to, it's gone for sure */
+        msg.parent = 0;
+        msg.child = pid;
+        msg.action = ORPHAND_ACTION_UNREGISTER;
+        orphand_process_message(srv, NULL, &msg, NULL, 0);
+    }
+}
@@ -0,0 +1,174 @@
+/**
+ * Hierarchical timer wheel. The lowest level has one slot per tick, each
+ * higher level covers WHEEL_SIZE slots of the level beneath it. Timers are
+ * cascaded down a level when the lower level wraps around, so adding,
+ * removing and expiring a timer is O(1) regardless of how many are pending.
+ */
+
+#include "orphand_priv.h"
+
+#define WHEEL_MASK (ORPHAND_WHEEL_SIZE - 1)
+#define LEVEL_SHIFT(level) (ORPHAND_WHEEL_BITS * (level))
+#define WHEEL_MAX_DELTA \
+    ((1ULL << LEVEL_SHIFT(ORPHAND_WHEEL_LEVELS)) - 1)
+
+static void
+list_init(orphand_timer *head)
+{
+    head->next = head->prev = head;
+}
+
+static void
+wheel_link(orphand_wheel *wheel, orphand_timer *timer)
+{
+    uint64_t expires = timer->expires, delta;
+    orphand_timer *head;
+    int level;
+
+    if (expires < wheel->current) {
+        expires = wheel->current;
+    }
+
+    delta = expires - wheel->current;
+    if (delta > WHEEL_MAX_DELTA) {
+        expires = wheel->current + WHEEL_MAX_DELTA;
+        delta = WHEEL_MAX_DELTA;
+    }
+
+    for (level = 0; level < ORPHAND_WHEEL_LEVELS - 1; level++) {
+        if (delta < (1ULL << LEVEL_SHIFT(level + 1))) {
+            break;
+        }
+    }
+
+    head = &wheel->slots[level][(expires >> LEVEL_SHIFT(level)) & WHEEL_MASK];
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void
+wheel_unlink(orphand_timer *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = timer->prev = NULL;
+}
+
+void
+orphand_wheel_init(orphand_wheel *wheel, uint64_t now)
+{
+    int ii, jj;
+    for (ii = 0; ii < ORPHAND_WHEEL_LEVELS; ii++) {
+        for (jj = 0; jj < ORPHAND_WHEEL_SIZE; jj++) {
+            list_init(&wheel->slots[ii][jj]);
+        }
+    }
+    wheel->current = now / ORPHAND_WHEEL_TICK_MS;
+    wheel->count = 0;
+}
+
+void
+orphand_wheel_add(orphand_wheel *wheel, orphand_timer *timer, uint64_t when)
+{
+    assert(!orphand_timer_pending(timer));
+    timer->expires =
+            (when + ORPHAND_WHEEL_TICK_MS - 1) / ORPHAND_WHEEL_TICK_MS;
+    wheel_link(wheel, timer);
+    wheel->count++;
+}
+
+void
+orphand_wheel_del(orphand_wheel *wheel, orphand_timer *timer)
+{
+    if (!orphand_timer_pending(timer)) {
+        return;
+    }
+    wheel_unlink(timer);
+    wheel->count--;
+}
+
+/**
+ * Move all timers in the given slot to their new positions. Returns the
+ * index of the slot, so the caller knows whether this level wrapped as well.
+ */
+static int
+cascade(orphand_wheel *wheel, int level)
+{
+    int idx = (wheel->current >> LEVEL_SHIFT(level)) & WHEEL_MASK;
+    orphand_timer *head = &wheel->slots[level][idx], pending;
+
+    if (head->next == head) {
+        return idx;
+    }
+
+    /* Detach the whole list first, as re-linking may land in the same slot */
+    pending.next = head->next;
+    pending.prev = head->prev;
+    pending.next->prev = &pending;
+    pending.prev->next = &pending;
+    list_init(head);
+
+    while (pending.next != &pending) {
+        orphand_timer *timer = pending.next;
+        wheel_unlink(timer);
+        wheel_link(wheel, timer);
+    }
+    return idx;
+}
+
+void
+orphand_wheel_run(orphand_wheel *wheel, uint64_t now, void *arg)
+{
+    uint64_t target = now / ORPHAND_WHEEL_TICK_MS;
+
+    while (wheel->current <= target) {
+        int idx = wheel->current & WHEEL_MASK, level;
+        orphand_timer *head;
+
+        if (!wheel->count) {
+            wheel->current = target + 1;
+            break;
+        }
+
+        for (level = 1; !idx && level < ORPHAND_WHEEL_LEVELS; level++) {
+            idx = cascade(wheel, level);
+        }
+
+        head = &wheel->slots[0][wheel->current & WHEEL_MASK];
+        while (head->next != head) {
+            orphand_timer *timer = head->next;
+            wheel_unlink(timer);
+            wheel->count--;
+            timer->callback(timer, arg);
+        }
+
+        wheel->current++;
+    }
+}
+
+long
+orphand_wheel_next(orphand_wheel *wheel, uint64_t now)
+{
+    uint64_t tick = wheel->current, when;
+
+    if (!wheel->count) {
+        return -1;
+    }
+
+    /**
+     * Only the lowest level is exact. If nothing is there, wake up when it
+     * wraps around and timers are cascaded into it.
+     */
+    while (tick & WHEEL_MASK) {
+        orphand_timer *head = &wheel->slots[0][tick & WHEEL_MASK];
+        if (head->next != head) {
+            break;
+        }
+        tick++;
+    }
+
+    when = tick * ORPHAND_WHEEL_TICK_MS;
+    return when > now ? (long)(when - now) : 0;
+}
@@ -0,0 +1,225 @@
+/**
+ * Stress test for embcht: lock-free readers against concurrent writers.
+ *
+ * The table has few buckets, so bucket arrays keep growing (and being
+ * retired) while readers are walking them. Writers own disjoint key ranges.
+ * Each of them keeps rewriting a set of stable keys, which are never
+ * deleted, and inserts and deletes a growing set of churn keys. Every value
+ * carries its key and a checksum, so a reader which copies out a value
+ * torn by a concurrent write notices. Readers must always find the stable
+ * keys.
+ *
+ *     make check
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/** Wide enough that copying it in and out takes a while */
+#define NCHECKS 7
+
+typedef struct {
+    uint32_t key;
+    uint32_t gen;
+    uint64_t check[NCHECKS];
+} stress_value;
+
+#define EMBCHT_API
+#define EMBHT_VALUE_SIZE sizeof(stress_value)
+
+#include <contrib/embcht.c>
+
+#define NBUCKETS 64
+#define NWRITERS 2
+#define NREADERS 4
+#define NROUNDS 64
+
+/** Keys per writer; the stable ones come first */
+#define NSTABLE 32
+#define CHURN_STEP 64
+#define KEY_RANGE (NSTABLE + CHURN_STEP * NROUNDS)
+
+static embcht_table *Table;
+static int Writers_done;
+static int Failed;
+
+static uint64_t
+value_check(uint32_t key, uint32_t gen, int idx)
+{
+    uint64_t x = ((uint64_t)key << 32 | gen) * 0x9e3779b97f4a7c15ULL;
+    return (x ^ (x >> 29)) + idx;
+}
+
+static void
+make_value(stress_value *val, uint32_t key, uint32_t gen)
+{
+    int ii;
+
+    val->key = key;
+    val->gen = gen;
+    for (ii = 0; ii < NCHECKS; ii++) {
+        val->check[ii] = value_check(key, gen, ii);
+    }
+}
+
+static int
+value_ok(const stress_value *val, uint32_t key)
+{
+    int ii;
+
+    if (val->key != key) {
+        return 0;
+    }
+    for (ii = 0; ii < NCHECKS; ii++) {
+        if (val->check[ii] != value_check(key, val->gen, ii)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void
+fail(const char *what, uint32_t key)
+{
+    if (!__atomic_exchange_n(&Failed, 1, __ATOMIC_RELAXED)) {
+        fprintf(stderr, "embcht-stress: %s (key %u)\n", what, key);
+    }
+}
+
+static void *
+writer_main(void *arg)
+{
+    uint32_t base = 1 + (uint32_t)(uintptr_t)arg * KEY_RANGE;
+    uint32_t gen = 0, ii, round;
+    stress_value val;
+
+    for (round = 1; round <= NROUNDS; round++) {
+        uint32_t nchurn = CHURN_STEP * round;
+
+        for (ii = 0; ii < NSTABLE; ii++) {
+            make_value(&val, base + ii, ++gen);
+            embcht_storei(Table, base + ii, &val);
+        }
+
+        /**
+         * Each round holds more keys than the last, so buckets grow. The
+         * stable keys keep being rewritten meanwhile, for readers to race
+         * with.
+         */
+        for (ii = 0; ii < nchurn; ii++) {
+            uint32_t key = base + NSTABLE + ii;
+            make_value(&val, key, ++gen);
+            embcht_storei(Table, key, &val);
+
+            make_value(&val, base + ii % NSTABLE, ++gen);
+            embcht_storei(Table, base + ii % NSTABLE, &val);
+        }
+
+        for (ii = 0; ii < nchurn; ii++) {
+            uint32_t key = base + NSTABLE + ii;
+            if (!embcht_deletei(Table, key, &val)) {
+                fail("churn key vanished", key);
+            } else if (!value_ok(&val, key)) {
+                fail("deleted value is corrupt", key);
+            }
+        }
+    }
+    return NULL;
+}
+
+static void *
+reader_main(void *arg)
+{
+    unsigned int seed = (unsigned int)(uintptr_t)arg;
+    stress_value val;
+    uint64_t nlookups = 0;
+
+    while (!__atomic_load_n(&Writers_done, __ATOMIC_ACQUIRE) &&
+            !__atomic_load_n(&Failed, __ATOMIC_RELAXED)) {
+        uint32_t base = 1 + (rand_r(&seed) % NWRITERS) * KEY_RANGE;
+        uint32_t key = base + rand_r(&seed) % NSTABLE;
+
+        if (!embcht_lookupi(Table, key, &val)) {
+            fail("stable key not found", key);
+        } else if (!value_ok(&val, key)) {
+            fail("torn read of a stable key", key);
+        }
+
+        key = base + NSTABLE + rand_r(&seed) % (KEY_RANGE - NSTABLE);
+        if (embcht_lookupi(Table, key, &val) && !value_ok(&val, key)) {
+            fail("torn read of a churn key", key);
+        }
+        nlookups += 2;
+    }
+    return (void*)(uintptr_t)nlookups;
+}
+
+static void
+count_entry(const embht_entry *ent, void *arg)
+{
+    stress_value val;
+
+    memcpy(&val, &ent->u_value, sizeof(val));
+    if (!value_ok(&val, ent->key.u_kdata.kd32)) {
+        fail("corrupt value after the run", ent->key.u_kdata.kd32);
+    }
+    (*(size_t*)arg)++;
+}
+
+int main(void)
+{
+    pthread_t writers[NWRITERS], readers[NREADERS];
+    uint64_t nlookups = 0;
+    size_t nfound = 0;
+    stress_value val;
+    void *ret;
+    int ii;
+
+    Table = embcht_make(NBUCKETS);
+
+    /* Readers may look up stable keys before their writer gets to them */
+    for (ii = 0; ii < NWRITERS * KEY_RANGE; ii += KEY_RANGE) {
+        uint32_t jj;
+        for (jj = 0; jj < NSTABLE; jj++) {
+            make_value(&val, 1 + ii + jj, 0);
+            embcht_storei(Table, 1 + ii + jj, &val);
+        }
+    }
+
+    for (ii = 0; ii < NREADERS; ii++) {
+        pthread_create(readers + ii, NULL, reader_main,
+                       (void*)(uintptr_t)(ii + 1));
+    }
+    for (ii = 0; ii < NWRITERS; ii++) {
+        pthread_create(writers + ii, NULL, writer_main, (void*)(uintptr_t)ii);
+    }
+
+    for (ii = 0; ii < NWRITERS; ii++) {
+        pthread_join(writers[ii], NULL);
+    }
+    __atomic_store_n(&Writers_done, 1, __ATOMIC_RELEASE);
+    for (ii = 0; ii < NREADERS; ii++) {
+        pthread_join(readers[ii], &ret);
+        nlookups += (uintptr_t)ret;
+    }
+
+    /* Only the stable keys are left */
+    embcht_foreach(Table, count_entry, &nfound);
+    if (nfound != NWRITERS * NSTABLE ||
+            embcht_count(Table) != NWRITERS * NSTABLE) {
+        fprintf(stderr, "embcht-stress: %lu entries left, expected %d\n",
+                (unsigned long)nfound, NWRITERS * NSTABLE);
+        Failed = 1;
+    }
+
+    embcht_reclaim(Table);
+    embcht_destroy(Table);
+
+    printf("embcht-stress: %s (%llu lookups)\n",
+           Failed ? "FAILED" : "ok", (unsigned long long)nlookups);
+    return Failed;
+}
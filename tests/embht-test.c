@@ -0,0 +1,336 @@
+/**
+ * Tests for embht: growth and shrinking of resizable tables (including
+ * lookups, deletion and iteration halfway through a resize), compaction of
+ * bucket arrays, the statistics histograms and the integer key finalizers.
+ * Every table is checked against a plain array of the keys it should hold.
+ *
+ *     make check
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define EMBHT_API
+#define EMBHT_VALUE_SIZE sizeof(uint32_t)
+
+#include <contrib/embht.c>
+
+/** Keys used with resizable tables, and the buckets they start with */
+#define NKEYS 20000
+#define INITIAL_SIZE 16
+
+static int Failed;
+
+#define EXPECT(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "embht-test:%d: %s: expected %s\n", \
+                __LINE__, Context, #cond); \
+        Failed = 1; \
+    } \
+} while (0)
+
+/** Names the table being checked, for failure messages */
+static const char *Context = "";
+
+static uint32_t
+value_of(uint32_t key)
+{
+    return key * 2654435761U;
+}
+
+static void
+store(embht_table *ht, uint32_t key)
+{
+    *(uint32_t*)embht_fetchi(ht, key, 1)->u_value.value = value_of(key);
+}
+
+/**
+ * Check that the table holds exactly the keys marked in 'present'
+ * (indexed by key), both by lookup and by iteration.
+ */
+static void
+check_contents(embht_table *ht, const char *present, uint32_t maxkey)
+{
+    embht_iterator iter;
+    size_t nexpected = 0, nseen = 0;
+    uint32_t key;
+
+    for (key = 1; key <= maxkey; key++) {
+        embht_entry *ent = embht_fetchi(ht, key, 0);
+        if (present[key]) {
+            nexpected++;
+            EXPECT(ent != NULL);
+            if (ent) {
+                EXPECT(*(uint32_t*)ent->u_value.value == value_of(key));
+            }
+        } else {
+            EXPECT(ent == NULL);
+        }
+    }
+    EXPECT(ht->nitems == nexpected);
+
+    embht_iterinit(ht, &iter);
+    while (embht_iternext(&iter)) {
+        key = embht_iterkey(&iter).u_kdata.kd32;
+        EXPECT(key >= 1 && key <= maxkey && present[key]);
+        nseen++;
+    }
+    EXPECT(nseen == nexpected);
+}
+
+/**
+ * The histograms must account for every live bucket and every item.
+ */
+static void
+check_stats(embht_table *ht)
+{
+    embht_statistics stats;
+    unsigned int noccupancy = 0, nprobes = 0, nnonempty = 0, ii;
+
+    embht_stat(ht, &stats);
+    for (ii = 0; ii < EMBHT_HIST_SIZE; ii++) {
+        noccupancy += stats.occupancy[ii];
+        nprobes += stats.probes[ii];
+        if (ii) {
+            nnonempty += stats.occupancy[ii];
+        }
+    }
+
+    EXPECT(stats.item_count == ht->nitems);
+    EXPECT(nprobes == stats.item_count);
+    EXPECT(nnonempty == stats.full_buckets);
+    EXPECT(noccupancy ==
+           ht->nbuckets + ht->old_nbuckets - ht->rehash_idx);
+}
+
+/**
+ * Grow a resizable table well past its initial size, check it along the
+ * way (including while entries are being moved), then delete most of it
+ * and check that it shrinks back.
+ */
+static void
+test_resize(embht_flags_t flags, const char *name)
+{
+    embht_table *ht = embht_make(INITIAL_SIZE, EMBHT_F_RESIZE | flags);
+    char *present = calloc(NKEYS + 1, 1);
+    int seen_rehash = 0;
+    embht_iterator iter;
+    uint32_t key;
+
+    Context = name;
+
+    for (key = 1; key <= NKEYS; key++) {
+        store(ht, key);
+        present[key] = 1;
+        if (ht->old_buckets && !seen_rehash && key > 1000) {
+            seen_rehash = 1;
+            check_contents(ht, present, NKEYS);
+            check_stats(ht);
+        }
+    }
+    EXPECT(seen_rehash);
+    EXPECT(ht->nbuckets * EMBHT_MAX_LOAD >= NKEYS / 2);
+    check_contents(ht, present, NKEYS);
+    check_stats(ht);
+
+    /* Delete odd keys through the iterator */
+    embht_iterinit(ht, &iter);
+    while (embht_iternext(&iter)) {
+        key = embht_iterkey(&iter).u_kdata.kd32;
+        if (key % 2) {
+            embht_iterdel(&iter);
+            present[key] = 0;
+        }
+    }
+    check_contents(ht, present, NKEYS);
+    check_stats(ht);
+
+    /* And all but every 64th key directly */
+    for (key = 2; key <= NKEYS; key += 2) {
+        uint32_t *val;
+        if (key % 64 == 0) {
+            continue;
+        }
+        val = embht_deletei(ht, key);
+        EXPECT(val && *val == value_of(key));
+        present[key] = 0;
+        EXPECT(embht_deletei(ht, key) == NULL);
+    }
+    check_contents(ht, present, NKEYS);
+    check_stats(ht);
+
+    EXPECT(ht->nbuckets < NKEYS / EMBHT_MAX_LOAD / 8);
+    EXPECT(ht->nbuckets >= INITIAL_SIZE);
+
+    /* Emptying it leaves the initial size */
+    for (key = 64; key <= NKEYS; key += 64) {
+        EXPECT(embht_deletei(ht, key) != NULL);
+        present[key] = 0;
+    }
+    while (ht->old_buckets) {
+        store(ht, 1);
+        embht_deletei(ht, 1);
+    }
+    check_contents(ht, present, NKEYS);
+    check_stats(ht);
+    EXPECT(ht->nbuckets == INITIAL_SIZE);
+
+    free(present);
+    embht_destroy(ht);
+}
+
+/**
+ * Fill a few fixed buckets and then empty them again; their arrays must
+ * shrink along with them.
+ */
+static void
+test_compact(void)
+{
+    embht_table *ht = embht_make(4, 0);
+    char *present = calloc(NKEYS + 1, 1);
+    uint32_t key;
+    size_t ii;
+
+    Context = "compaction";
+
+    for (key = 1; key <= 4000; key++) {
+        store(ht, key);
+        present[key] = 1;
+    }
+    for (ii = 0; ii < ht->nbuckets; ii++) {
+        EXPECT(ht->buckets[ii].capacity >= 1000);
+    }
+
+    for (key = 1; key <= 4000; key++) {
+        if (key % 100) {
+            embht_deletei(ht, key);
+            present[key] = 0;
+        }
+    }
+    check_contents(ht, present, 4000);
+    check_stats(ht);
+
+    for (ii = 0; ii < ht->nbuckets; ii++) {
+        embht_bucket *bh = ht->buckets + ii;
+        EXPECT(bh->capacity <= EMBHT_INITIAL_FILL_SIZE ||
+               bh->fill * EMBHT_MIN_LOAD_DIV > bh->capacity);
+    }
+
+    /* Slots freed by compaction are reused */
+    for (key = 1; key <= 4000; key++) {
+        if (key % 100) {
+            store(ht, key);
+            present[key] = 1;
+        }
+    }
+    check_contents(ht, present, 4000);
+
+    for (key = 1; key <= 4000; key++) {
+        embht_deletei(ht, key);
+        present[key] = 0;
+    }
+    check_contents(ht, present, 4000);
+    for (ii = 0; ii < ht->nbuckets; ii++) {
+        EXPECT(ht->buckets[ii].capacity <= EMBHT_INITIAL_FILL_SIZE);
+    }
+
+    free(present);
+    embht_destroy(ht);
+}
+
+/**
+ * Keys which are multiples of the bucket count all land in one bucket with
+ * the identity hash; the finalizers must spread them out.
+ */
+static void
+test_hash_modes(void)
+{
+    static const struct {
+        embht_flags_t flags;
+        const char *name;
+        int spread;
+    } modes[] = {
+        { 0, "identity hash", 0 },
+        { EMBHT_F_HASH_MUL, "multiplicative hash", 1 },
+        { EMBHT_F_HASH_MURMUR, "murmur hash", 1 }
+    };
+    unsigned int ii;
+
+    for (ii = 0; ii < sizeof(modes) / sizeof(modes[0]); ii++) {
+        embht_table *ht = embht_make(64, modes[ii].flags);
+        char *present = calloc(64 * 64 + 1, 1);
+        embht_statistics stats;
+        uint32_t key;
+
+        Context = modes[ii].name;
+
+        for (key = 64; key <= 64 * 64; key += 64) {
+            store(ht, key);
+            present[key] = 1;
+        }
+        check_contents(ht, present, 64 * 64);
+        check_stats(ht);
+
+        embht_stat(ht, &stats);
+        if (modes[ii].spread) {
+            EXPECT(stats.full_buckets >= 16);
+            EXPECT(stats.occupancy[EMBHT_HIST_SIZE - 1] == 0);
+        } else {
+            EXPECT(stats.full_buckets == 1);
+            EXPECT(stats.occupancy[EMBHT_HIST_SIZE - 1] == 1);
+        }
+
+        free(present);
+        embht_destroy(ht);
+    }
+}
+
+/**
+ * String keys take the same paths, with their own hash.
+ */
+static void
+test_string_keys(void)
+{
+    embht_table *ht = embht_make(INITIAL_SIZE, EMBHT_F_RESIZE);
+    char buf[32];
+    int ii;
+
+    Context = "string keys";
+
+    for (ii = 0; ii < 1000; ii++) {
+        sprintf(buf, "key-%d", ii);
+        *(uint32_t*)embht_fetchz(ht, buf, 1)->u_value.value = ii;
+    }
+    EXPECT(embht_fetchi(ht, 1, 0) == NULL);
+    for (ii = 0; ii < 1000; ii++) {
+        embht_entry *ent;
+        sprintf(buf, "key-%d", ii);
+        ent = embht_fetchz(ht, buf, 0);
+        EXPECT(ent && *(uint32_t*)ent->u_value.value == (uint32_t)ii);
+        if (ii % 2) {
+            EXPECT(embht_delete(ht, buf, strlen(buf)) != NULL);
+        }
+    }
+    EXPECT(ht->nitems == 500);
+    EXPECT(embht_fetchz(ht, "key-1", 0) == NULL);
+    EXPECT(embht_fetchz(ht, "key-2", 0) != NULL);
+    check_stats(ht);
+
+    embht_destroy(ht);
+}
+
+int main(void)
+{
+    test_resize(0, "resize");
+    test_resize(EMBHT_F_HASH_MUL, "resize, multiplicative hash");
+    test_resize(EMBHT_F_HASH_MURMUR, "resize, murmur hash");
+    test_compact();
+    test_hash_modes();
+    test_string_keys();
+
+    printf("embht-test: %s\n", Failed ? "FAILED" : "ok");
+    return Failed;
+}
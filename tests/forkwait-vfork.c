@@ -0,0 +1,250 @@
+/**
+ * Tests for vfork() under orphand-forkwait.so: the parent registers the
+ * child once it resumes, and a child which execs while the parent still
+ * has messages queued for a stalled daemon doesn't wait for them, as its
+ * parent stays suspended until it does.
+ *
+ * The test listens on sockets of its own, one which it never reads from
+ * and one where it plays the daemon, and runs itself again with the
+ * library preloaded against each.
+ *
+ *     make check
+ */
+
+#define _GNU_SOURCE
+
+#include "orphand.h"
+
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+/** Well under the library's FLUSH_EXIT_TIMEOUT_MS */
+#define VFORK_MAX_MS 250
+
+/** How long the pretend daemon waits for the preloaded process */
+#define SERVE_TIMEOUT_MS 5000
+
+static long
+elapsed_ms(const struct timespec *since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 +
+            (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+/**
+ * Runs with the library preloaded. The fork() queues a registration, which
+ * the flush thread can't get rid of while the daemon doesn't answer.
+ */
+static int
+run_preloaded(void)
+{
+    struct timespec start;
+    pid_t child, vchild;
+    long ms;
+    int status;
+
+    if ( (child = fork()) == 0) {
+        pause();
+        _exit(0);
+    } else if (child == -1) {
+        perror("fork");
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if ( (vchild = vfork()) == 0) {
+        execl("/bin/true", "true", (char*)NULL);
+        _exit(127);
+    }
+    ms = elapsed_ms(&start);
+
+    kill(child, SIGKILL);
+    waitpid(child, NULL, 0);
+
+    if (vchild == -1) {
+        perror("vfork");
+        return 1;
+    }
+    if (waitpid(vchild, &status, 0) != vchild ||
+            !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "forkwait-vfork: exec failed\n");
+        return 1;
+    }
+    if (ms > VFORK_MAX_MS) {
+        fprintf(stderr, "forkwait-vfork: parent resumed after %ldms\n", ms);
+        return 1;
+    }
+    return 0;
+}
+
+static int
+listen_at(const char *path)
+{
+    struct sockaddr_un saddr;
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    memset(&saddr, 0, sizeof(saddr));
+    saddr.sun_family = AF_UNIX;
+    strncpy(saddr.sun_path, path, sizeof(saddr.sun_path) - 1);
+
+    if (sock == -1 ||
+            bind(sock, (struct sockaddr*)&saddr, sizeof(saddr)) != 0 ||
+            listen(sock, 16) != 0) {
+        perror("forkwait-vfork: socket");
+        if (sock != -1) {
+            close(sock);
+        }
+        return -1;
+    }
+    return sock;
+}
+
+static pid_t
+spawn_preloaded(const char *path, int sock, const char *argv0)
+{
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        close(sock);
+        setenv("ORPHAND_SOCKET", path, 1);
+        setenv("LD_PRELOAD", "./orphand-forkwait.so", 1);
+        execl("/proc/self/exe", argv0, "preloaded", (char*)NULL);
+        perror("forkwait-vfork: exec");
+        _exit(1);
+    }
+    return pid;
+}
+
+static int
+exited_ok(pid_t pid)
+{
+    int status;
+    return pid != -1 && waitpid(pid, &status, 0) == pid &&
+            WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/**
+ * Nobody reads the socket; the vfork() child must not wait for it.
+ */
+static int
+test_stalled(const char *path, const char *argv0)
+{
+    int sock = listen_at(path), ok;
+
+    if (sock == -1) {
+        return 0;
+    }
+    ok = exited_ok(spawn_preloaded(path, sock, argv0));
+    close(sock);
+    if (!ok) {
+        fprintf(stderr, "forkwait-vfork: failed with a stalled daemon\n");
+    }
+    return ok;
+}
+
+/**
+ * Play the daemon, without a ring, and count the children registered by
+ * the preloaded process: the fork()ed one and the vfork()ed one.
+ */
+static int
+test_registered(const char *path, const char *argv0)
+{
+    orphand_message msg;
+    struct pollfd pfd;
+    int sock = listen_at(path), conn = -1, nregistered = 0, ok = 0;
+    size_t nread = 0;
+    ssize_t nr;
+    pid_t pid;
+
+    if (sock == -1) {
+        return 0;
+    }
+    if ( (pid = spawn_preloaded(path, sock, argv0)) == -1) {
+        goto GT_DONE;
+    }
+
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, SERVE_TIMEOUT_MS) != 1 ||
+            (conn = accept(sock, NULL, NULL)) == -1) {
+        goto GT_WAIT;
+    }
+
+    pfd.fd = conn;
+    while (poll(&pfd, 1, SERVE_TIMEOUT_MS) == 1) {
+        if ( (nr = read(conn, (char*)&msg + nread,
+                        sizeof(msg) - nread)) < 1) {
+            break;
+        }
+        if ( (nread += nr) < sizeof(msg)) {
+            continue;
+        }
+        nread = 0;
+
+        switch (ORPHAND_ACTION_CODE(msg.action)) {
+        case ORPHAND_ACTION_REGISTER:
+            nregistered += (msg.parent == (uint32_t)pid);
+            break;
+        case ORPHAND_ACTION_RING:
+        case ORPHAND_ACTION_PING:
+            if (write(conn, &msg, sizeof(msg)) != sizeof(msg)) {
+                goto GT_WAIT;
+            }
+            break;
+        }
+    }
+
+    GT_WAIT:
+    ok = exited_ok(pid);
+    if (ok && nregistered != 2) {
+        fprintf(stderr, "forkwait-vfork: %d children registered, "
+                "expected 2\n", nregistered);
+        ok = 0;
+    }
+
+    GT_DONE:
+    if (conn != -1) {
+        close(conn);
+    }
+    close(sock);
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    char dir[] = "/tmp/forkwait-vfork.XXXXXX";
+    char stalled[64], serving[64];
+    int failed = 1;
+
+    if (argc > 1 && strcmp(argv[1], "preloaded") == 0) {
+        return run_preloaded();
+    }
+
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    snprintf(stalled, sizeof(stalled), "%s/stalled", dir);
+    snprintf(serving, sizeof(serving), "%s/serving", dir);
+
+    if (test_stalled(stalled, argv[0]) && test_registered(serving, argv[0])) {
+        failed = 0;
+    }
+
+    unlink(stalled);
+    unlink(serving);
+    rmdir(dir);
+    printf("forkwait-vfork: %s\n", failed ? "FAILED" : "ok");
+    return failed;
+}